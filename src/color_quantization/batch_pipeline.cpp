@@ -0,0 +1,431 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <thread>
+#include "fmt/format.h"
+#include "graphics/fi_pixmap.hpp"
+#include "batch_pipeline.hpp"
+#include "image_files.hpp"
+
+
+namespace
+{
+
+
+typedef std::chrono::steady_clock clock_type;
+
+
+struct image_job
+{
+	std::size_t m_image_index;
+	graphics::fi_pixmap m_input_image;
+	std::vector < std::uint8_t > m_output_pixels;
+	context m_context;
+	// Set from the quantize stage until the map stage is done.
+	quantizer *m_quantizer;
+
+	explicit image_job(std::size_t p_image_index)
+		: m_image_index(p_image_index)
+		, m_quantizer(nullptr)
+	{
+	}
+};
+
+typedef std::unique_ptr < image_job > image_job_ptr;
+typedef base::bounded_queue < image_job_ptr > image_job_queue;
+
+
+// Splits the running time of a stage thread into the time spent
+// working and the time spent waiting. Each call adds the time since
+// the previous call to the corresponding sum.
+class stage_thread_timer
+{
+public:
+	explicit stage_thread_timer(batch_pipeline_stage_stats &p_stats)
+		: m_stats(p_stats)
+		, m_time_point(clock_type::now())
+	{
+	}
+
+	void busy_done()
+	{
+		m_stats.m_busy_time += get_elapsed_time();
+	}
+
+	void input_wait_done()
+	{
+		m_stats.m_input_wait_time += get_elapsed_time();
+	}
+
+	void output_wait_done()
+	{
+		m_stats.m_output_wait_time += get_elapsed_time();
+	}
+
+
+private:
+	double get_elapsed_time()
+	{
+		clock_type::time_point now = clock_type::now();
+		double elapsed_time = std::chrono::duration < double > (now - m_time_point).count();
+		m_time_point = now;
+		return elapsed_time;
+	}
+
+	batch_pipeline_stage_stats &m_stats;
+	clock_type::time_point m_time_point;
+};
+
+
+// Exceptions must not escape the stage threads, so an exception
+// only makes the image fail.
+template < typename Func >
+bool process_image(std::string const &p_input_filename, Func const &p_func)
+{
+	try
+	{
+		return p_func();
+	}
+	catch (std::exception const &p_exception)
+	{
+		fmt::print(stderr, "Exception caught while processing \"{}\": {}\n", p_input_filename, p_exception.what());
+		return false;
+	}
+}
+
+
+} // unnamed namespace end
+
+
+batch_pipeline_options::batch_pipeline_options()
+	: m_num_decode_threads(1)
+	, m_num_quantize_threads(1)
+	, m_num_map_threads(1)
+	, m_num_encode_threads(1)
+	, m_queue_capacity(2)
+	, m_use_dithering(false)
+	, m_color_metric(graphics::color_metric::rgb_low_cost)
+	, m_alpha_threshold(0)
+	, m_compression_level(graphics::indexed_image_writer::default_compression_level)
+	, m_show_progress(true)
+	, m_palette_cache(nullptr)
+{
+}
+
+
+batch_pipeline_stage_stats::batch_pipeline_stage_stats(char const *p_name)
+	: m_name(p_name)
+	, m_num_threads(0)
+	, m_num_images(0)
+	, m_busy_time(0.0)
+	, m_input_wait_time(0.0)
+	, m_output_wait_time(0.0)
+{
+}
+
+
+batch_pipeline_stats::batch_pipeline_stats()
+	: m_num_images(0)
+	, m_num_failed_images(0)
+	, m_total_time(0.0)
+	, m_num_quantizers(0)
+	, m_stages{ batch_pipeline_stage_stats("decode"), batch_pipeline_stage_stats("quantize"), batch_pipeline_stage_stats("map"), batch_pipeline_stage_stats("encode") }
+	, m_queues{}
+{
+}
+
+
+batch_pipeline_stats run_batch_pipeline(
+	batch_pipeline_options const &p_options,
+	std::vector < batch_pipeline_image_files > const &p_image_files,
+	quantizer const &p_quantizer
+)
+{
+	enum { decode_stage, quantize_stage, map_stage, encode_stage, num_stages };
+
+	batch_pipeline_stats stats;
+	stats.m_num_images = p_image_files.size();
+	stats.m_image_instrumentations.resize(p_image_files.size());
+
+	clock_type::time_point start_time_point = clock_type::now();
+
+	std::size_t const queue_capacity = std::max(p_options.m_queue_capacity, std::size_t(1));
+	image_job_queue decoded_queue(queue_capacity);
+	image_job_queue palette_queue(queue_capacity);
+	image_job_queue mapped_queue(queue_capacity);
+	image_job_queue *output_queues[num_stages] = { &decoded_queue, &palette_queue, &mapped_queue, nullptr };
+
+	std::size_t const num_threads[num_stages] = {
+		std::max(p_options.m_num_decode_threads, std::size_t(1)),
+		std::max(p_options.m_num_quantize_threads, std::size_t(1)),
+		std::max(p_options.m_num_map_threads, std::size_t(1)),
+		std::max(p_options.m_num_encode_threads, std::size_t(1))
+	};
+
+	// Every quantize and map thread holds at most one quantizer, and so
+	// does every image in the queue between them, so the pool never runs
+	// out of quantizers.
+	std::size_t const num_quantizers = num_threads[quantize_stage] + num_threads[map_stage] + queue_capacity;
+	std::vector < std::unique_ptr < quantizer > > quantizers;
+	base::bounded_queue < quantizer* > free_quantizers(num_quantizers);
+	for (std::size_t i = 0; i < num_quantizers; ++i)
+	{
+		quantizers.push_back(p_quantizer.clone());
+		free_quantizers.push(quantizers.back().get());
+	}
+	stats.m_num_quantizers = num_quantizers;
+
+	std::atomic < std::size_t > next_image_index(0);
+	std::atomic < unsigned long > num_failed_images(0);
+
+	// The last thread of a stage to finish closes the stage's output
+	// queue, which lets the threads of the next stage finish.
+	std::atomic < std::size_t > num_running_threads[num_stages];
+	for (int stage = 0; stage < num_stages; ++stage)
+		num_running_threads[stage] = num_threads[stage];
+
+	auto finish_stage_thread = [&](int p_stage) {
+		if ((--num_running_threads[p_stage] == 0) && (output_queues[p_stage] != nullptr))
+			output_queues[p_stage]->close();
+	};
+
+
+	auto decode = [&](batch_pipeline_stage_stats &p_stats) {
+		stage_thread_timer timer(p_stats);
+
+		while (true)
+		{
+			std::size_t image_index = next_image_index++;
+			if (image_index >= p_image_files.size())
+				break;
+
+			image_job_ptr job(new image_job(image_index));
+
+			bool ok = process_image(p_image_files[image_index].m_input_filename, [&]() -> bool {
+				context &ctx = job->m_context;
+				base::scoped_stage_timer stage_timer(ctx.m_instrumentation, "decode");
+
+				bool has_alpha;
+				if (!load_input_image(p_image_files[image_index].m_input_filename, job->m_input_image, has_alpha))
+					return false;
+
+				ctx.m_input_image = graphics::make_pixmap_view(job->m_input_image);
+
+				std::size_t width = graphics::width(ctx.m_input_image);
+				std::size_t height = graphics::height(ctx.m_input_image);
+				job->m_output_pixels.resize(width * height);
+				ctx.m_output_image = graphics::make_pixmap_view(job->m_output_pixels.data(), job->m_output_pixels.size(), width, height, width, 1);
+
+				ctx.m_use_dithering = p_options.m_use_dithering;
+				ctx.m_color_metric = p_options.m_color_metric;
+				ctx.m_alpha_threshold = has_alpha ? p_options.m_alpha_threshold : 0;
+				ctx.m_histogram_preview = p_options.m_histogram_preview;
+				ctx.m_show_progress = p_options.m_show_progress;
+				ctx.m_palette_cache = p_options.m_palette_cache;
+				ctx.m_palette_cache_options = p_options.m_palette_cache_options;
+				ctx.m_progress_label = p_image_files[image_index].m_input_filename;
+
+				return true;
+			});
+			timer.busy_done();
+
+			if (!ok)
+			{
+				++num_failed_images;
+				continue;
+			}
+
+			++p_stats.m_num_images;
+			decoded_queue.push(std::move(job));
+			timer.output_wait_done();
+		}
+
+		finish_stage_thread(decode_stage);
+	};
+
+	auto quantize = [&](batch_pipeline_stage_stats &p_stats) {
+		stage_thread_timer timer(p_stats);
+		image_job_ptr job;
+
+		while (decoded_queue.pop(job))
+		{
+			timer.input_wait_done();
+
+			quantizer *color_quantizer = nullptr;
+			free_quantizers.pop(color_quantizer);
+			timer.output_wait_done();
+
+			bool ok = process_image(p_image_files[job->m_image_index].m_input_filename, [&]() -> bool {
+				return color_quantizer->compute_palette(job->m_context);
+			});
+			timer.busy_done();
+
+			if (!ok)
+			{
+				free_quantizers.push(color_quantizer);
+				++num_failed_images;
+				continue;
+			}
+
+			++p_stats.m_num_images;
+			job->m_quantizer = color_quantizer;
+			palette_queue.push(std::move(job));
+			timer.output_wait_done();
+		}
+
+		finish_stage_thread(quantize_stage);
+	};
+
+	auto map = [&](batch_pipeline_stage_stats &p_stats) {
+		stage_thread_timer timer(p_stats);
+		image_job_ptr job;
+
+		while (palette_queue.pop(job))
+		{
+			timer.input_wait_done();
+
+			bool ok = process_image(p_image_files[job->m_image_index].m_input_filename, [&]() -> bool {
+				return job->m_quantizer->map_pixels(job->m_context);
+			});
+			free_quantizers.push(job->m_quantizer);
+			job->m_quantizer = nullptr;
+			timer.busy_done();
+
+			if (!ok)
+			{
+				++num_failed_images;
+				continue;
+			}
+
+			++p_stats.m_num_images;
+			mapped_queue.push(std::move(job));
+			timer.output_wait_done();
+		}
+
+		finish_stage_thread(map_stage);
+	};
+
+	auto encode = [&](batch_pipeline_stage_stats &p_stats) {
+		stage_thread_timer timer(p_stats);
+		image_job_ptr job;
+
+		while (mapped_queue.pop(job))
+		{
+			timer.input_wait_done();
+
+			batch_pipeline_image_files const &image_files = p_image_files[job->m_image_index];
+			bool ok = process_image(image_files.m_input_filename, [&]() -> bool {
+				base::scoped_stage_timer stage_timer(job->m_context.m_instrumentation, "encode");
+				return save_output_image(image_files.m_output_filename, job->m_context, p_options.m_compression_level);
+			});
+			// Each image has its own slot, so no locking is needed.
+			stats.m_image_instrumentations[job->m_image_index] = std::move(job->m_context.m_instrumentation);
+			job.reset();
+			timer.busy_done();
+
+			if (!ok)
+			{
+				++num_failed_images;
+				continue;
+			}
+
+			++p_stats.m_num_images;
+			fmt::print(stderr, "Saved output image \"{}\"\n", image_files.m_output_filename);
+		}
+
+		finish_stage_thread(encode_stage);
+	};
+
+
+	// Each thread has its own stats, which are summed up afterwards.
+	std::vector < batch_pipeline_stage_stats > thread_stats;
+	std::vector < int > thread_stages;
+	for (int stage = 0; stage < num_stages; ++stage)
+	{
+		thread_stats.resize(thread_stats.size() + num_threads[stage], batch_pipeline_stage_stats(stats.m_stages[stage].m_name));
+		thread_stages.resize(thread_stages.size() + num_threads[stage], stage);
+	}
+
+	std::vector < std::thread > threads;
+	for (std::size_t i = 0; i < thread_stats.size(); ++i)
+	{
+		batch_pipeline_stage_stats &cur_thread_stats = thread_stats[i];
+		switch (thread_stages[i])
+		{
+			case decode_stage: threads.emplace_back(decode, std::ref(cur_thread_stats)); break;
+			case quantize_stage: threads.emplace_back(quantize, std::ref(cur_thread_stats)); break;
+			case map_stage: threads.emplace_back(map, std::ref(cur_thread_stats)); break;
+			case encode_stage: threads.emplace_back(encode, std::ref(cur_thread_stats)); break;
+			default: break;
+		}
+	}
+
+	for (std::thread &thread : threads)
+		thread.join();
+
+
+	stats.m_num_failed_images = num_failed_images;
+	stats.m_total_time = std::chrono::duration < double > (clock_type::now() - start_time_point).count();
+
+	for (std::size_t i = 0; i < thread_stats.size(); ++i)
+	{
+		batch_pipeline_stage_stats &stage_stats = stats.m_stages[thread_stages[i]];
+		++stage_stats.m_num_threads;
+		stage_stats.m_num_images += thread_stats[i].m_num_images;
+		stage_stats.m_busy_time += thread_stats[i].m_busy_time;
+		stage_stats.m_input_wait_time += thread_stats[i].m_input_wait_time;
+		stage_stats.m_output_wait_time += thread_stats[i].m_output_wait_time;
+	}
+
+	stats.m_queues[0] = decoded_queue.get_stats();
+	stats.m_queues[1] = palette_queue.get_stats();
+	stats.m_queues[2] = mapped_queue.get_stats();
+
+	return stats;
+}
+
+
+void print_batch_pipeline_stats(batch_pipeline_stats const &p_stats)
+{
+	auto occupancy = [&p_stats](batch_pipeline_stage_stats const &p_stage_stats) -> double {
+		double total_thread_time = p_stats.m_total_time * p_stage_stats.m_num_threads;
+		return (total_thread_time > 0.0) ? (p_stage_stats.m_busy_time * 100.0 / total_thread_time) : 0.0;
+	};
+
+	fmt::print(stderr, "Batch: {} images, {} failed, {:.2f} s, {} quantizer instances\n", p_stats.m_num_images, p_stats.m_num_failed_images, p_stats.m_total_time, p_stats.m_num_quantizers);
+
+	fmt::print(stderr, "Pipeline stages:\n");
+	std::size_t bottleneck_stage = 0;
+	for (std::size_t stage = 0; stage < batch_pipeline_stats::num_stages; ++stage)
+	{
+		batch_pipeline_stage_stats const &stage_stats = p_stats.m_stages[stage];
+		fmt::print(
+			stderr,
+			"  {}: {} threads, {} images, occupancy {:.1f}% (busy {:.2f} s, waiting for input {:.2f} s, waiting for output {:.2f} s)\n",
+			stage_stats.m_name, stage_stats.m_num_threads, stage_stats.m_num_images, occupancy(stage_stats),
+			stage_stats.m_busy_time, stage_stats.m_input_wait_time, stage_stats.m_output_wait_time
+		);
+
+		if (occupancy(stage_stats) > occupancy(p_stats.m_stages[bottleneck_stage]))
+			bottleneck_stage = stage;
+	}
+
+	fmt::print(stderr, "Pipeline queues:\n");
+	for (std::size_t queue = 0; queue < (batch_pipeline_stats::num_stages - 1); ++queue)
+	{
+		base::bounded_queue_stats const &queue_stats = p_stats.m_queues[queue];
+		fmt::print(
+			stderr,
+			"  {} -> {}: capacity {}, average size {:.2f}, max size {}, full {} times, empty {} times\n",
+			p_stats.m_stages[queue].m_name, p_stats.m_stages[queue + 1].m_name,
+			queue_stats.m_capacity, queue_stats.m_average_size, queue_stats.m_max_size,
+			queue_stats.m_num_full_waits, queue_stats.m_num_empty_waits
+		);
+	}
+
+	fmt::print(stderr, "Bottleneck: {} stage\n", p_stats.m_stages[bottleneck_stage].m_name);
+}
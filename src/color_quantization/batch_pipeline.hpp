@@ -0,0 +1,112 @@
+#ifndef COLOR_QUANTIZATION_BATCH_PIPELINE_HPP______
+#define COLOR_QUANTIZATION_BATCH_PIPELINE_HPP______
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "base/bounded_queue.hpp"
+#include "base/instrumentation.hpp"
+#include "graphics/color_metric.hpp"
+#include "graphics/histogram_preview.hpp"
+#include "quantizer.hpp"
+
+
+// Color-quantizes a batch of images in a pipeline of four stages:
+//
+// 1. decode: loads the input images
+// 2. quantize: computes the histogram and the palette of each image
+// 3. map: maps the pixels to the palette, with optional dithering
+// 4. encode: writes the output images
+//
+// Each stage has its own threads. The stages are connected by bounded
+// queues, so a slow stage makes the ones before it wait instead of
+// letting decoded images pile up in memory.
+//
+// An image keeps its quantizer from the quantize stage until the map
+// stage is done with it, since mapping may depend on the quantizer's
+// state. Quantizers are therefore taken from a pool that holds enough
+// of them for all quantize and map threads plus the images in the queue
+// between these stages.
+
+
+struct batch_pipeline_options
+{
+	std::size_t m_num_decode_threads;
+	std::size_t m_num_quantize_threads;
+	std::size_t m_num_map_threads;
+	std::size_t m_num_encode_threads;
+	// Capacity of each queue between two stages.
+	std::size_t m_queue_capacity;
+
+	bool m_use_dithering;
+	graphics::color_metric m_color_metric;
+	// Used for images that have an alpha channel; see context.
+	int m_alpha_threshold;
+	// See context.
+	graphics::histogram_preview m_histogram_preview;
+	int m_compression_level;
+	bool m_show_progress;
+	// See context. The cache is shared by all quantize threads.
+	palette_cache const *m_palette_cache;
+	std::string m_palette_cache_options;
+
+	batch_pipeline_options();
+};
+
+
+struct batch_pipeline_image_files
+{
+	std::string m_input_filename;
+	std::string m_output_filename;
+};
+
+
+struct batch_pipeline_stage_stats
+{
+	char const *m_name;
+	std::size_t m_num_threads;
+	unsigned long m_num_images;
+	// Sums over all threads of the stage, in seconds: time spent
+	// working, time spent waiting for images from the previous stage,
+	// and time spent waiting for room in the next stage (backpressure).
+	double m_busy_time;
+	double m_input_wait_time;
+	double m_output_wait_time;
+
+	explicit batch_pipeline_stage_stats(char const *p_name = "");
+};
+
+
+struct batch_pipeline_stats
+{
+	enum { num_stages = 4 };
+
+	unsigned long m_num_images;
+	unsigned long m_num_failed_images;
+	double m_total_time;
+	std::size_t m_num_quantizers;
+	batch_pipeline_stage_stats m_stages[num_stages];
+	// The queues between consecutive stages.
+	base::bounded_queue_stats m_queues[num_stages - 1];
+	// Stage timings and counters of each image, in the order of the
+	// image files.
+	std::vector < base::instrumentation > m_image_instrumentations;
+
+	batch_pipeline_stats();
+};
+
+
+// Quantizes all images with clones of p_quantizer. Images that fail
+// are reported and skipped; their number is in the returned stats.
+batch_pipeline_stats run_batch_pipeline(
+	batch_pipeline_options const &p_options,
+	std::vector < batch_pipeline_image_files > const &p_image_files,
+	quantizer const &p_quantizer
+);
+
+// The occupancy of a stage is the fraction of the time its threads were
+// busy. The stage with the highest occupancy is the bottleneck.
+void print_batch_pipeline_stats(batch_pipeline_stats const &p_stats);
+
+
+#endif // COLOR_QUANTIZATION_BATCH_PIPELINE_HPP______
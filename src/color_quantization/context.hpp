@@ -1,12 +1,20 @@
 #ifndef COLOR_QUANTIZATION_CONTEXT_HPP______
 #define COLOR_QUANTIZATION_CONTEXT_HPP______
 
+#include <functional>
+#include <string>
 #include <vector>
 #include <cstddef>
 #include <cstdint>
-#include <boost/program_options.hpp>
+#include "base/instrumentation.hpp"
+#include "base/progress_report.hpp"
 #include "graphics/pixmap_view.hpp"
 #include "graphics/palette.hpp"
+#include "graphics/color_metric.hpp"
+#include "graphics/histogram_preview.hpp"
+
+
+class palette_cache;
 
 
 struct context
@@ -16,14 +24,84 @@ struct context
 
 	bool m_use_dithering;
 
+	// The metric used for quantization and for the nearest color search.
+	// m_palette is in the color space of this metric. Quantizers set this
+	// to rgb_low_cost if they use the image's own colors as the palette
+	// (see compute_lossless_palette()).
+	graphics::color_metric m_color_metric;
+
+	// Pixels with an alpha value below this are not quantized. They are
+	// mapped to a reserved, fully transparent palette entry instead. That
+	// entry is not part of m_palette; its index is m_palette.size().
+	// 0 means there is no such entry.
+	int m_alpha_threshold;
+
 	graphics::palette m_palette;
+
+	// If this has a block size above 1, the palette is computed from a
+	// downscaled preview of m_input_image. This is much faster for very
+	// large images. The full-resolution pixels are still used for the
+	// output.
+	graphics::histogram_preview m_histogram_preview;
+
+	// If set, this is called with the y coordinate of each row of
+	// m_output_image as soon as that row is final. This allows for
+	// writing out rows while the rest of the image is still being
+	// produced. Rows are finished in order of increasing y.
+	std::function < void(std::size_t p_y) > m_output_row_callback;
+
+	// If set, palettes are looked up in this cache before they are
+	// computed, and stored in it afterwards (see palette_cache.hpp).
+	// The cache must outlive the context.
+	palette_cache const *m_palette_cache;
+	// Identifies the quantizer and its options. Part of the cache keys,
+	// so that quantizers with different options get separate entries.
+	std::string m_palette_cache_options;
+	// Key of the histogram that missed the cache. Set by
+	// compute_input_histogram(), and consumed by store_palette_in_cache().
+	std::string m_palette_cache_key;
+
+	// Whether the quantizers print progress to stderr. If the label is
+	// not empty, it is printed in front of the progress (useful when
+	// multiple images are processed in parallel).
+	bool m_show_progress;
+	std::string m_progress_label;
+
+	// Stage timings and counters of the work done on this context.
+	base::instrumentation m_instrumentation;
+
+	context()
+		: m_use_dithering(false)
+		, m_color_metric(graphics::color_metric::rgb_low_cost)
+		, m_alpha_threshold(0)
+		, m_palette_cache(nullptr)
+		, m_show_progress(true)
+	{
+	}
 };
 
 
-void add_program_options(boost::program_options::options_description &p_options_description);
-bool setup_color_quantization(context &p_context);
-void teardown_color_quantization(context &p_context);
-bool apply_color_quantization(context &p_context);
+inline bool has_transparent_palette_entry(context const &p_context)
+{
+	return p_context.m_alpha_threshold > 0;
+}
+
+
+inline std::size_t get_transparent_palette_index(context const &p_context)
+{
+	return p_context.m_palette.size();
+}
+
+
+// Returns a disabled progress report if the context has progress
+// disabled. p_text must outlive the progress report.
+inline base::progress_report make_progress_report(context const &p_context, char const *p_text)
+{
+	if (!p_context.m_show_progress)
+		return base::progress_report();
+
+	return base::progress_report(p_text, p_context.m_progress_label.empty() ? nullptr : p_context.m_progress_label.c_str());
+}
 
 
 #endif // COLOR_QUANTIZATION_CONTEXT_HPP______
@@ -0,0 +1,22 @@
+#ifndef COLOR_QUANTIZATION_FRONTEND_HPP______
+#define COLOR_QUANTIZATION_FRONTEND_HPP______
+
+#include <memory>
+#include <boost/program_options.hpp>
+#include "quantizer.hpp"
+
+
+// These are implemented by each color quantization executable.
+// The rest of the command line frontend is in main.cpp.
+
+// Short name of the quantizer, like "octree". Palette cache keys
+// include it, so that different quantizers get separate entries.
+char const * get_quantizer_name();
+
+void add_program_options(boost::program_options::options_description &p_options_description);
+
+// Returns nullptr if the command line options are invalid.
+std::unique_ptr < quantizer > create_quantizer(boost::program_options::variables_map const &p_variables_map);
+
+
+#endif // COLOR_QUANTIZATION_FRONTEND_HPP______
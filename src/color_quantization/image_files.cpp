@@ -0,0 +1,104 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <FreeImage.h>
+#include "fmt/format.h"
+#include "image_files.hpp"
+
+
+bool load_input_image(std::string const &p_input_filename, graphics::fi_pixmap &p_input_image, bool &p_has_alpha)
+{
+	FREE_IMAGE_FORMAT input_format = FreeImage_GetFileType(p_input_filename.c_str());
+	if (input_format == FIF_UNKNOWN)
+	{
+		input_format = FreeImage_GetFIFFromFilename(p_input_filename.c_str());
+		if (input_format == FIF_UNKNOWN)
+		{
+			fmt::print(stderr, "Input image \"{}\" cannot be found, cannot be read, or has unknown file format\n", p_input_filename);
+			return false;
+		}
+	}
+
+	graphics::fi_pixmap input_image = FreeImage_Load(input_format, p_input_filename.c_str(), 0);
+	if (input_image.get_fibitmap() == nullptr)
+	{
+		fmt::print(stderr, "Could not load input image file \"{}\"\n", p_input_filename);
+		return false;
+	}
+
+	// 24-bit RGB and 32-bit RGBA images are used directly. Anything
+	// else is converted to one of these, depending on whether or not
+	// it has transparency information.
+
+	bool input_is_transparent = FreeImage_IsTransparent(input_image.get_fibitmap());
+	unsigned int input_bpp = FreeImage_GetBPP(input_image.get_fibitmap());
+
+	if ((FreeImage_GetImageType(input_image.get_fibitmap()) != FIT_BITMAP) || ((input_bpp != 24) && (input_bpp != 32)))
+	{
+		unsigned int converted_bpp = input_is_transparent ? 32 : 24;
+		graphics::fi_pixmap converted_input_image = input_is_transparent ? FreeImage_ConvertTo32Bits(input_image.get_fibitmap()) : FreeImage_ConvertTo24Bits(input_image.get_fibitmap());
+		if (converted_input_image.get_fibitmap() == nullptr)
+		{
+			fmt::print(stderr, "Could not convert input image file \"{}\" to {} bit\n", p_input_filename, converted_bpp);
+			return false;
+		}
+
+		// We no longer need the original input image, so get rid of it to save some resouces.
+		input_image = std::move(converted_input_image);
+	}
+
+	// FreeImage stores rows from bottom to top. Flip them, so that
+	// the output rows are produced in the order the image writer
+	// needs them (top to bottom).
+	FreeImage_FlipVertical(input_image.get_fibitmap());
+
+	p_has_alpha = input_is_transparent && (graphics::num_channels(graphics::make_pixmap_view(input_image)) == 4);
+	p_input_image = std::move(input_image);
+
+	return true;
+}
+
+
+graphics::indexed_image_format get_output_format(std::string const &p_output_filename)
+{
+	std::string::size_type dot_pos = p_output_filename.rfind('.');
+	std::string extension = (dot_pos != std::string::npos) ? p_output_filename.substr(dot_pos + 1) : "";
+	std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char p_c) { return std::tolower(p_c); });
+
+	return (extension == "png") ? graphics::indexed_image_format::png : graphics::indexed_image_format::gif;
+}
+
+
+graphics::palette make_output_palette(context const &p_context)
+{
+	graphics::palette output_palette;
+
+	for (graphics::color const &palette_entry : p_context.m_palette.m_colors)
+		output_palette.m_colors.push_back(convert_to_rgb(palette_entry, p_context.m_color_metric));
+
+	if (has_transparent_palette_entry(p_context))
+		output_palette.m_colors.push_back(graphics::color(0, 0, 0, 0));
+
+	return output_palette;
+}
+
+
+bool save_output_image(std::string const &p_output_filename, context const &p_context, int const p_compression_level)
+{
+	std::size_t width = graphics::width(p_context.m_output_image);
+	std::size_t height = graphics::height(p_context.m_output_image);
+
+	graphics::indexed_image_writer output_writer;
+	bool ok = output_writer.open(p_output_filename, get_output_format(p_output_filename), width, height, make_output_palette(p_context), p_compression_level);
+
+	for (std::size_t y = 0; ok && (y < height); ++y)
+		ok = output_writer.write_row(nonstd::span < std::uint8_t const > (graphics::at(p_context.m_output_image, 0, y), width));
+
+	if (!ok || !output_writer.close())
+	{
+		fmt::print(stderr, "Could not save output image to \"{}\"\n", p_output_filename);
+		return false;
+	}
+
+	return true;
+}
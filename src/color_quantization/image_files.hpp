@@ -0,0 +1,29 @@
+#ifndef COLOR_QUANTIZATION_IMAGE_FILES_HPP______
+#define COLOR_QUANTIZATION_IMAGE_FILES_HPP______
+
+#include <string>
+#include "graphics/fi_pixmap.hpp"
+#include "graphics/indexed_image_writer.hpp"
+#include "graphics/palette.hpp"
+#include "context.hpp"
+
+
+// Loads an input image as 24-bit RGB or 32-bit RGBA, with its rows
+// ordered from top to bottom. p_has_alpha is set to true if the image
+// has an alpha channel with transparency information. Prints an error
+// and returns false if the image could not be loaded.
+bool load_input_image(std::string const &p_input_filename, graphics::fi_pixmap &p_input_image, bool &p_has_alpha);
+
+// Derived from the filename extension: PNG for .png, GIF otherwise.
+graphics::indexed_image_format get_output_format(std::string const &p_output_filename);
+
+// Produces the RGBA palette that is written to the output image,
+// including the reserved transparent entry (if there is one).
+graphics::palette make_output_palette(context const &p_context);
+
+// Writes p_context.m_output_image with the palette of the context.
+// Prints an error and returns false if the image could not be saved.
+bool save_output_image(std::string const &p_output_filename, context const &p_context, int const p_compression_level);
+
+
+#endif // COLOR_QUANTIZATION_IMAGE_FILES_HPP______
@@ -0,0 +1,104 @@
+#include "fmt/format.h"
+#include "graphics/color_metric.hpp"
+#include "graphics/histogram_preview.hpp"
+#include "input_histogram.hpp"
+#include "palette_cache.hpp"
+
+
+bool compute_input_histogram(
+	context &p_context,
+	graphics::color_histogram &p_color_histogram,
+	std::size_t const p_max_num_palette_entries,
+	palettized_output_buffers &p_buffers
+)
+{
+	std::size_t width = graphics::width(p_context.m_input_image);
+	std::size_t height = graphics::height(p_context.m_input_image);
+	std::size_t preview_block_size = graphics::get_preview_block_size(p_context.m_histogram_preview, width, height);
+	std::size_t num_preview_pixels = 0;
+	bool use_preview = (preview_block_size > 1);
+	bool is_lossless = false;
+
+	// The quantizer assigns the colors of the new histogram anew.
+	p_buffers.m_assigned_color_map.clear();
+	p_context.m_palette_cache_key.clear();
+
+	{
+		base::scoped_stage_timer stage_timer(p_context.m_instrumentation, "histogram");
+
+		if (use_preview)
+		{
+			num_preview_pixels = compute_preview_color_histogram(
+				p_color_histogram,
+				p_context.m_input_image,
+				p_context.m_histogram_preview,
+				p_context.m_alpha_threshold,
+				make_progress_report(p_context, "Scanning preview pixels")
+			);
+
+			// A preview may lack some of the image's colors,
+			// so it cannot be used for a lossless palette.
+			p_buffers.m_exact_color_map.clear();
+
+			// The quantizers rely on having more colors than palette
+			// entries (median cut would get empty boxes otherwise).
+			// A preview with this few colors is typically that of a
+			// flat-color image, whose full histogram is small anyway,
+			// and may give a lossless palette.
+			if (p_color_histogram.size() <= p_max_num_palette_entries)
+			{
+				if (p_context.m_show_progress)
+					fmt::print(stderr, "\n");
+				fmt::print(stderr, "Preview has only {} colors; using the full-resolution histogram instead\n", p_color_histogram.size());
+				p_color_histogram.clear();
+				use_preview = false;
+			}
+		}
+
+		if (!use_preview)
+		{
+			compute_color_histogram(
+				p_color_histogram,
+				p_context.m_input_image,
+				p_context.m_alpha_threshold,
+				make_progress_report(p_context, "Scanning image pixels")
+			);
+			is_lossless = compute_lossless_palette(p_context, p_color_histogram, p_max_num_palette_entries, p_buffers);
+		}
+
+		if (!is_lossless)
+			convert_color_histogram(p_color_histogram, p_context.m_color_metric);
+	}
+	if (p_context.m_show_progress)
+		fmt::print(stderr, "\n");
+
+	if (use_preview)
+	{
+		fmt::print(
+			stderr, "Computed histogram from {} preview: {} x {} pixel blocks, {} preview pixels{}\n",
+			to_string(p_context.m_histogram_preview.m_filter),
+			preview_block_size, preview_block_size,
+			num_preview_pixels,
+			p_context.m_histogram_preview.m_use_edge_weighting ? ", edge weighted" : ""
+		);
+		p_context.m_instrumentation.add_to_counter("preview_block_size", preview_block_size);
+		p_context.m_instrumentation.add_to_counter("preview_pixels", num_preview_pixels);
+	}
+
+	p_context.m_instrumentation.add_to_counter("unique_colors", p_color_histogram.size());
+
+	// If all pixels are transparent, there are no colors to compute a
+	// palette from. The quantizers cannot cope with that, so the palette
+	// gets a single black entry instead (next to the transparent one).
+	if (p_color_histogram.empty())
+	{
+		p_context.m_palette.m_colors.assign(1, graphics::convert_from_rgb(graphics::color(0, 0, 0), p_context.m_color_metric));
+		fmt::print(stderr, "Image has no pixels to quantize; using a single black palette entry\n");
+		return true;
+	}
+
+	if (is_lossless)
+		return true;
+
+	return load_palette_from_cache(p_context, p_color_histogram, p_max_num_palette_entries, p_buffers);
+}
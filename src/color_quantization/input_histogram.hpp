@@ -0,0 +1,40 @@
+#ifndef COLOR_QUANTIZATION_INPUT_HISTOGRAM_HPP______
+#define COLOR_QUANTIZATION_INPUT_HISTOGRAM_HPP______
+
+#include <cstddef>
+#include "graphics/color.hpp"
+#include "context.hpp"
+#include "palettized_output.hpp"
+
+
+// Computes the histogram that the quantizers compute their palettes
+// from, as the "histogram" stage of the context's instrumentation.
+//
+// If the context's histogram preview has a block size above 1, the
+// histogram is computed from a downscaled preview of the input image,
+// unless the preview has at most p_max_num_palette_entries colors (the
+// quantizers need more colors than palette entries to work with).
+// Otherwise, all pixels are used, and if the image has at most
+// p_max_num_palette_entries colors, it gets a lossless palette (see
+// compute_lossless_palette()). In that case, true is returned, and the
+// quantizer must not compute a palette of its own. The same goes for
+// images without any pixels to quantize (because all of them are
+// transparent); their palette gets a single black entry.
+//
+// Otherwise, if the context has a palette cache, the histogram is looked
+// up in it (see load_palette_from_cache()). On a hit, the context gets
+// the cached palette, and true is returned as well. On a miss, the
+// quantizer must call store_palette_in_cache() once its palette is final.
+//
+// If false is returned, the histogram is in the color space of the
+// context's metric. The assigned color map of p_buffers is cleared in
+// any case (see set_assigned_palette_indices()).
+bool compute_input_histogram(
+	context &p_context,
+	graphics::color_histogram &p_color_histogram,
+	std::size_t const p_max_num_palette_entries,
+	palettized_output_buffers &p_buffers
+);
+
+
+#endif // COLOR_QUANTIZATION_INPUT_HISTOGRAM_HPP______
@@ -0,0 +1,414 @@
+#include <algorithm>
+#include <iterator>
+#include <assert.h>
+#include "k_means_filtering.hpp"
+
+
+namespace
+{
+
+
+typedef k_means_filtering_tree::point point;
+typedef k_means_filtering_tree::cell cell;
+
+
+// calculate_color_distance() is never above 1.5 times the lower bound
+// (see graphics::calculate_lower_bound_color_distance()).
+long calculate_upper_bound_color_distance(graphics::color const &p_first, graphics::color const &p_second, graphics::color_metric const p_color_metric)
+{
+	long lower_bound_distance = calculate_lower_bound_color_distance(p_first, p_second, p_color_metric);
+	if (p_color_metric == graphics::color_metric::oklab)
+		return lower_bound_distance;
+	else
+		return lower_bound_distance + (lower_bound_distance + 1) / 2;
+}
+
+
+// The corner of the cell that is furthest away from p_color.
+graphics::color get_furthest_cell_corner(graphics::color const &p_color, cell const &p_cell)
+{
+	graphics::color furthest_corner;
+	for (int c = 0; c < graphics::color::num_channels; ++c)
+		furthest_corner[c] = ((p_color[c] - p_cell.m_min_color[c]) > (p_cell.m_max_color[c] - p_color[c])) ? p_cell.m_min_color[c] : p_cell.m_max_color[c];
+	return furthest_corner;
+}
+
+
+// The distance between p_color and a point of the cell is a weighted sum
+// of the squared channel differences. This returns the range of each
+// channel's weight over all points of the cell. With rgb_low_cost, the
+// red and blue weights depend on the mean red value of the two colors;
+// the weights are scaled by 256 there, so they are integers.
+void get_channel_weight_ranges(
+	graphics::color const &p_color,
+	cell const &p_cell,
+	graphics::color_metric const p_color_metric,
+	long (&p_min_weights)[graphics::color::num_channels],
+	long (&p_max_weights)[graphics::color::num_channels]
+)
+{
+	if (p_color_metric == graphics::color_metric::oklab)
+	{
+		std::fill(std::begin(p_min_weights), std::end(p_min_weights), 1);
+		std::fill(std::begin(p_max_weights), std::end(p_max_weights), 1);
+		return;
+	}
+
+	long min_r_mean = (p_cell.m_min_color[0] + p_color[0]) / 2;
+	long max_r_mean = (p_cell.m_max_color[0] + p_color[0]) / 2;
+
+	p_min_weights[0] = 512 + min_r_mean;
+	p_max_weights[0] = 512 + max_r_mean;
+	p_min_weights[1] = p_max_weights[1] = 4 * 256;
+	p_min_weights[2] = 512 + 255 - max_r_mean;
+	p_max_weights[2] = 512 + 255 - min_r_mean;
+	p_min_weights[3] = p_max_weights[3] = 4 * 256;
+}
+
+
+// Returns true if p_candidate is strictly further away than p_best_candidate
+// from every point of the cell.
+//
+// The distances to the two candidates are bounded with the weight ranges
+// from get_channel_weight_ranges(): the lowest weights for the candidate,
+// the highest ones for the best candidate. The difference of the bounds
+// is a sum of one quadratic function per channel, so its minimum over the
+// cell is the sum of the minima over each channel's range. With oklab,
+// the weights are all 1, the functions are linear, and this is the test
+// from the paper: the minimum is at the corner that lies furthest in the
+// direction of p_candidate.
+bool is_further_from_cell(graphics::color const &p_candidate, graphics::color const &p_best_candidate, cell const &p_cell, graphics::color_metric const p_color_metric)
+{
+	long candidate_weights[graphics::color::num_channels], unused_weights[graphics::color::num_channels];
+	long best_candidate_weights[graphics::color::num_channels];
+	get_channel_weight_ranges(p_candidate, p_cell, p_color_metric, candidate_weights, unused_weights);
+	get_channel_weight_ranges(p_best_candidate, p_cell, p_color_metric, unused_weights, best_candidate_weights);
+
+	double min_difference = 0.0;
+	for (int c = 0; c < graphics::color::num_channels; ++c)
+	{
+		double candidate_weight = candidate_weights[c];
+		double best_candidate_weight = best_candidate_weights[c];
+		double candidate_value = p_candidate[c];
+		double best_candidate_value = p_best_candidate[c];
+
+		auto calculate_difference = [&](double p_value) -> double {
+			double candidate_diff = p_value - candidate_value;
+			double best_candidate_diff = p_value - best_candidate_value;
+			return candidate_weight * candidate_diff * candidate_diff - best_candidate_weight * best_candidate_diff * best_candidate_diff;
+		};
+
+		double min_value = p_cell.m_min_color[c];
+		double max_value = p_cell.m_max_color[c];
+		double channel_min_difference = std::min(calculate_difference(min_value), calculate_difference(max_value));
+
+		// Only a convex function can have its minimum inside the range.
+		if (candidate_weight > best_candidate_weight)
+		{
+			double vertex_value = (candidate_weight * candidate_value - best_candidate_weight * best_candidate_value) / (candidate_weight - best_candidate_weight);
+			if ((vertex_value > min_value) && (vertex_value < max_value))
+				channel_min_difference = std::min(channel_min_difference, calculate_difference(vertex_value));
+		}
+
+		min_difference += channel_min_difference;
+	}
+
+	// With oklab, the bounds are the exact (integer) distances. With
+	// rgb_low_cost, the red and blue terms of the distance are rounded
+	// down, by less than 256 each in the scaled units; another unit
+	// covers floating point errors from the convex case.
+	double const min_required_difference = (p_color_metric == graphics::color_metric::oklab) ? 0.0 : (2 * 256 + 1);
+	return min_difference > min_required_difference;
+}
+
+
+struct assignment
+{
+	base::kd_tree < point > const &m_kd_tree;
+	std::pmr::vector < cell > const &m_cells;
+	graphics::palette const &m_palette;
+	graphics::color_metric m_color_metric;
+	nonstd::span < double > m_sum_palette;
+	nonstd::span < double > m_sum_weights;
+	nonstd::span < std::size_t > m_nearest_palette_indices;
+	k_means_filtering_tree::stats &m_stats;
+	long m_max_distance;
+};
+
+
+bool has_node(assignment const &p_assignment, std::size_t const p_array_index)
+{
+	return (p_array_index < p_assignment.m_kd_tree.m_nodes.size()) && p_assignment.m_kd_tree.m_nodes[p_array_index].m_occupied;
+}
+
+
+// Raises the max distance to that of the farthest color in the subtree
+// from the palette entry. Subtrees whose cells are within the current
+// max distance are skipped.
+void update_max_distance(assignment &p_assignment, std::size_t const p_array_index, std::size_t const p_palette_index)
+{
+	graphics::color const &palette_color = p_assignment.m_palette[p_palette_index];
+	cell const &node_cell = p_assignment.m_cells[p_array_index];
+
+	if (calculate_upper_bound_color_distance(palette_color, get_furthest_cell_corner(palette_color, node_cell), p_assignment.m_color_metric) <= p_assignment.m_max_distance)
+		return;
+
+	long distance = calculate_color_distance(p_assignment.m_kd_tree.m_nodes[p_array_index].m_value.m_color, palette_color, p_assignment.m_color_metric);
+	++p_assignment.m_stats.m_num_distance_evaluations;
+	p_assignment.m_max_distance = std::max(p_assignment.m_max_distance, distance);
+
+	for (std::size_t child_array_index : { 2 * p_array_index + 1, 2 * p_array_index + 2 })
+	{
+		if (has_node(p_assignment, child_array_index))
+			update_max_distance(p_assignment, child_array_index, p_palette_index);
+	}
+}
+
+
+void set_subtree_palette_index(assignment &p_assignment, std::size_t const p_array_index, std::size_t const p_palette_index)
+{
+	p_assignment.m_nearest_palette_indices[p_assignment.m_kd_tree.m_nodes[p_array_index].m_value.m_index] = p_palette_index;
+
+	for (std::size_t child_array_index : { 2 * p_array_index + 1, 2 * p_array_index + 2 })
+	{
+		if (has_node(p_assignment, child_array_index))
+			set_subtree_palette_index(p_assignment, child_array_index, p_palette_index);
+	}
+}
+
+
+void assign_subtree(assignment &p_assignment, std::size_t const p_array_index, std::size_t const p_palette_index)
+{
+	cell const &node_cell = p_assignment.m_cells[p_array_index];
+	for (int c = 0; c < graphics::color::num_channels; ++c)
+		p_assignment.m_sum_palette[p_palette_index * graphics::color::num_channels + c] += node_cell.m_weighted_color_sum[c];
+	p_assignment.m_sum_weights[p_palette_index] += node_cell.m_weight;
+	++p_assignment.m_stats.m_num_subtree_assignments;
+
+	update_max_distance(p_assignment, p_array_index, p_palette_index);
+
+	if (!p_assignment.m_nearest_palette_indices.empty())
+		set_subtree_palette_index(p_assignment, p_array_index, p_palette_index);
+}
+
+
+// Assigns each color of a small subtree by searching the candidates.
+// This is cheaper than filtering the candidates for each of its nodes.
+void assign_subtree_colors(assignment &p_assignment, std::size_t const p_array_index, std::uint8_t const *p_candidates, std::size_t const p_num_candidates)
+{
+	graphics::palette const &palette = p_assignment.m_palette;
+	graphics::color_metric const color_metric = p_assignment.m_color_metric;
+	point const &node_point = p_assignment.m_kd_tree.m_nodes[p_array_index].m_value;
+
+	std::size_t nearest_palette_index = p_candidates[0];
+	long min_distance = calculate_color_distance(node_point.m_color, palette[nearest_palette_index], color_metric);
+	for (std::size_t i = 1; i < p_num_candidates; ++i)
+	{
+		long distance = calculate_color_distance(node_point.m_color, palette[p_candidates[i]], color_metric);
+		if (distance < min_distance)
+		{
+			min_distance = distance;
+			nearest_palette_index = p_candidates[i];
+		}
+	}
+	p_assignment.m_stats.m_num_distance_evaluations += p_num_candidates;
+
+	for (int c = 0; c < graphics::color::num_channels; ++c)
+		p_assignment.m_sum_palette[nearest_palette_index * graphics::color::num_channels + c] += node_point.m_color[c] * node_point.m_weight;
+	p_assignment.m_sum_weights[nearest_palette_index] += node_point.m_weight;
+	p_assignment.m_max_distance = std::max(p_assignment.m_max_distance, min_distance);
+	if (!p_assignment.m_nearest_palette_indices.empty())
+		p_assignment.m_nearest_palette_indices[node_point.m_index] = nearest_palette_index;
+
+	for (std::size_t child_array_index : { 2 * p_array_index + 1, 2 * p_array_index + 2 })
+	{
+		if (has_node(p_assignment, child_array_index))
+			assign_subtree_colors(p_assignment, child_array_index, p_candidates, p_num_candidates);
+	}
+}
+
+
+// p_candidates are palette indices in ascending order.
+void filter_node(assignment &p_assignment, std::size_t const p_array_index, std::uint8_t const *p_candidates, std::size_t const p_num_candidates)
+{
+	// Below this number of colors, subtrees are searched directly.
+	std::size_t const max_num_searched_subtree_colors = 8;
+
+	++p_assignment.m_stats.m_num_visited_nodes;
+
+	if (p_num_candidates == 1)
+	{
+		assign_subtree(p_assignment, p_array_index, p_candidates[0]);
+		return;
+	}
+
+	cell const &node_cell = p_assignment.m_cells[p_array_index];
+	if (node_cell.m_num_colors <= max_num_searched_subtree_colors)
+	{
+		assign_subtree_colors(p_assignment, p_array_index, p_candidates, p_num_candidates);
+		return;
+	}
+
+	graphics::palette const &palette = p_assignment.m_palette;
+	graphics::color_metric const color_metric = p_assignment.m_color_metric;
+	point const &node_point = p_assignment.m_kd_tree.m_nodes[p_array_index].m_value;
+
+	// The paper prunes against the candidate that is nearest to the
+	// middle of the cell, but any candidate will do. The one nearest to
+	// the node's own color is needed anyway, and is usually close to
+	// the middle, since the node's color is the median of the subtree.
+
+	std::size_t nearest_palette_index = p_candidates[0];
+	long min_distance = calculate_color_distance(node_point.m_color, palette[nearest_palette_index], color_metric);
+	for (std::size_t i = 1; i < p_num_candidates; ++i)
+	{
+		long distance = calculate_color_distance(node_point.m_color, palette[p_candidates[i]], color_metric);
+		if (distance < min_distance)
+		{
+			min_distance = distance;
+			nearest_palette_index = p_candidates[i];
+		}
+	}
+	p_assignment.m_stats.m_num_distance_evaluations += p_num_candidates;
+
+	std::uint8_t candidates[256];
+	std::size_t num_candidates = 0;
+	for (std::size_t i = 0; i < p_num_candidates; ++i)
+	{
+		std::size_t candidate = p_candidates[i];
+		if ((candidate == nearest_palette_index) || !is_further_from_cell(palette[candidate], palette[nearest_palette_index], node_cell, color_metric))
+			candidates[num_candidates++] = std::uint8_t(candidate);
+	}
+
+	if (num_candidates == 1)
+	{
+		assign_subtree(p_assignment, p_array_index, nearest_palette_index);
+		return;
+	}
+
+	// Assign the node's own color, then filter its children.
+
+	for (int c = 0; c < graphics::color::num_channels; ++c)
+		p_assignment.m_sum_palette[nearest_palette_index * graphics::color::num_channels + c] += node_point.m_color[c] * node_point.m_weight;
+	p_assignment.m_sum_weights[nearest_palette_index] += node_point.m_weight;
+	p_assignment.m_max_distance = std::max(p_assignment.m_max_distance, min_distance);
+	if (!p_assignment.m_nearest_palette_indices.empty())
+		p_assignment.m_nearest_palette_indices[node_point.m_index] = nearest_palette_index;
+
+	for (std::size_t child_array_index : { 2 * p_array_index + 1, 2 * p_array_index + 2 })
+	{
+		if (has_node(p_assignment, child_array_index))
+			filter_node(p_assignment, child_array_index, candidates, num_candidates);
+	}
+}
+
+
+} // unnamed namespace end
+
+
+k_means_filtering_tree::stats::stats()
+	: m_num_distance_evaluations(0)
+	, m_num_visited_nodes(0)
+	, m_num_subtree_assignments(0)
+{
+}
+
+
+k_means_filtering_tree::k_means_filtering_tree(std::pmr::memory_resource *p_memory_resource)
+	: m_kd_tree(p_memory_resource)
+	, m_cells(p_memory_resource)
+	, m_points(p_memory_resource)
+{
+}
+
+
+void k_means_filtering_tree::build(nonstd::span < graphics::color const > p_colors, nonstd::span < double const > p_color_weights)
+{
+	assert(p_colors.size() == p_color_weights.size());
+
+	base::clear(m_kd_tree, true);
+	m_cells.clear();
+
+	if (p_colors.empty())
+		return;
+
+	m_points.resize(p_colors.size());
+	graphics::color min_color = p_colors[0], max_color = p_colors[0];
+	for (std::size_t i = 0; i < std::size_t(p_colors.size()); ++i)
+	{
+		m_points[i] = point { p_colors[i], p_color_weights[i], i };
+		for (int c = 0; c < graphics::color::num_channels; ++c)
+		{
+			min_color[c] = std::min(min_color[c], p_colors[i][c]);
+			max_color[c] = std::max(max_color[c], p_colors[i][c]);
+		}
+	}
+
+	// The levels split along the channels that vary, in turn. (Alpha
+	// does not vary in opaque images.)
+	int split_channels[graphics::color::num_channels] = { 0 };
+	int num_split_channels = 0;
+	for (int c = 0; c < graphics::color::num_channels; ++c)
+	{
+		if (min_color[c] != max_color[c])
+			split_channels[num_split_channels++] = c;
+	}
+	num_split_channels = std::max(num_split_channels, 1);
+
+	base::fill(
+		m_kd_tree, m_points.begin(), m_points.end(),
+		[&split_channels, num_split_channels](point const &p_first, point const &p_second, unsigned int p_level) -> bool {
+			int c = split_channels[p_level % num_split_channels];
+			return p_first.m_color[c] < p_second.m_color[c];
+		}
+	);
+
+	base::compute_subtree_aggregates(
+		m_kd_tree, m_cells,
+		[](point const &p_point) -> cell {
+			cell point_cell;
+			for (int c = 0; c < graphics::color::num_channels; ++c)
+				point_cell.m_weighted_color_sum[c] = p_point.m_color[c] * p_point.m_weight;
+			point_cell.m_weight = p_point.m_weight;
+			point_cell.m_num_colors = 1;
+			point_cell.m_min_color = point_cell.m_max_color = p_point.m_color;
+			return point_cell;
+		},
+		[](cell &p_cell, cell const &p_child_cell) {
+			for (int c = 0; c < graphics::color::num_channels; ++c)
+			{
+				p_cell.m_weighted_color_sum[c] += p_child_cell.m_weighted_color_sum[c];
+				p_cell.m_min_color[c] = std::min(p_cell.m_min_color[c], p_child_cell.m_min_color[c]);
+				p_cell.m_max_color[c] = std::max(p_cell.m_max_color[c], p_child_cell.m_max_color[c]);
+			}
+			p_cell.m_weight += p_child_cell.m_weight;
+			p_cell.m_num_colors += p_child_cell.m_num_colors;
+		}
+	);
+}
+
+
+long k_means_filtering_tree::assign(
+	graphics::palette const &p_palette,
+	graphics::color_metric const p_color_metric,
+	nonstd::span < double > p_sum_palette,
+	nonstd::span < double > p_sum_weights,
+	nonstd::span < std::size_t > p_nearest_palette_indices,
+	stats &p_stats
+) const
+{
+	assert(p_palette.size() <= 256);
+
+	if (m_kd_tree.m_nodes.empty() || (p_palette.size() == 0))
+		return -1;
+
+	assignment palette_assignment { m_kd_tree, m_cells, p_palette, p_color_metric, p_sum_palette, p_sum_weights, p_nearest_palette_indices, p_stats, -1 };
+
+	std::uint8_t candidates[256];
+	for (std::size_t i = 0; i < p_palette.size(); ++i)
+		candidates[i] = std::uint8_t(i);
+
+	filter_node(palette_assignment, 0, candidates, p_palette.size());
+
+	return palette_assignment.m_max_distance;
+}
@@ -0,0 +1,99 @@
+#ifndef COLOR_QUANTIZATION_K_MEANS_FILTERING_HPP______
+#define COLOR_QUANTIZATION_K_MEANS_FILTERING_HPP______
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <vector>
+#include "base/custom_span.hpp"
+#include "base/kd_tree.hpp"
+#include "graphics/color.hpp"
+#include "graphics/color_metric.hpp"
+#include "graphics/palette.hpp"
+
+
+// The assignment step of k-means, as in the filtering algorithm from
+// the paper "An efficient k-means clustering algorithm: analysis and
+// implementation" by T. Kanungo et al. Link:
+// https://doi.org/10.1109/TPAMI.2002.1017616
+//
+// The unique colors are put into a kd-tree once. Each node of the tree
+// also has the weighted sum, the total weight and the bounding box
+// (the cell) of the colors in its subtree. The assignment walks the
+// tree with a set of candidate palette entries. At each node, entries
+// that are further away than another candidate from every point of
+// the cell are removed from the set. Once only one candidate is left,
+// the whole subtree is assigned to it at once, using the node's sums.
+// Only nodes in cells that are close to the boundaries between the
+// clusters are visited individually.
+//
+// The result is the same as with an exhaustive search: the pruning
+// only removes entries that are strictly further away, and among the
+// remaining ones, the lowest palette index wins ties, like with
+// graphics::find_nearest_color(). With oklab, the pruning test is the
+// one from the paper, which relies on the distance being a squared
+// norm. rgb_low_cost is not a norm, so there, the test uses bounds of
+// the distances within the cell instead, which prunes somewhat less.
+class k_means_filtering_tree
+{
+public:
+	struct point
+	{
+		graphics::color m_color;
+		double m_weight;
+		// Index of the color in the unique colors.
+		std::size_t m_index;
+	};
+
+	struct cell
+	{
+		double m_weighted_color_sum[graphics::color::num_channels];
+		double m_weight;
+		std::size_t m_num_colors;
+		graphics::color m_min_color;
+		graphics::color m_max_color;
+	};
+
+	struct stats
+	{
+		unsigned long long m_num_distance_evaluations;
+		unsigned long long m_num_visited_nodes;
+		// Subtrees (including single nodes) that were assigned as a
+		// whole, because only one candidate was left.
+		unsigned long long m_num_subtree_assignments;
+
+		stats();
+	};
+
+	explicit k_means_filtering_tree(std::pmr::memory_resource *p_memory_resource = std::pmr::get_default_resource());
+
+	void build(nonstd::span < graphics::color const > p_colors, nonstd::span < double const > p_color_weights);
+
+	// Assigns each color to its nearest palette entry, and adds the
+	// weighted colors and the weights to the sums of their entries.
+	// p_sum_palette has graphics::color::num_channels values per entry.
+	// The sums are not cleared first. If p_nearest_palette_indices is
+	// not empty, the palette index of each color is written to it, in
+	// the order of the colors given to build(); this needs a walk over
+	// all nodes, so it is best done once, after the last iteration.
+	// Returns the largest of the distances between the colors and their
+	// entries.
+	long assign(
+		graphics::palette const &p_palette,
+		graphics::color_metric const p_color_metric,
+		nonstd::span < double > p_sum_palette,
+		nonstd::span < double > p_sum_weights,
+		nonstd::span < std::size_t > p_nearest_palette_indices,
+		stats &p_stats
+	) const;
+
+
+private:
+	base::kd_tree < point > m_kd_tree;
+	std::pmr::vector < cell > m_cells;
+	// The colors of build(), kept to reuse their memory.
+	std::pmr::vector < point > m_points;
+};
+
+
+#endif // COLOR_QUANTIZATION_K_MEANS_FILTERING_HPP______
@@ -0,0 +1,274 @@
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include "fmt/format.h"
+#include "k_means_quantizer.hpp"
+#include "input_histogram.hpp"
+#include "palette_cache.hpp"
+#include "palettized_output.hpp"
+
+
+// The k-means iterations themselves are done by k_means_refiner (see
+// k_means_refinement.hpp).
+
+
+namespace
+{
+
+
+// Merges the colors that are the same in their upper p_num_bits bits of
+// each channel. A merged color is the weighted average of its colors,
+// and has their total weight. p_coarse_color_indices is a table with
+// one entry per combination of the upper bits.
+void build_coarse_colors(
+	std::pmr::vector < graphics::color > const &p_colors,
+	std::pmr::vector < double > const &p_color_weights,
+	unsigned int const p_num_bits,
+	std::pmr::vector < std::uint32_t > &p_coarse_color_indices,
+	std::pmr::vector < graphics::color > &p_coarse_colors,
+	std::pmr::vector < double > &p_coarse_color_weights
+)
+{
+	std::uint32_t const invalid_index = 0xFFFFFFFFu;
+	unsigned int const shift = 8 - p_num_bits;
+
+	p_coarse_color_indices.assign(std::size_t(1) << (graphics::color::num_channels * p_num_bits), invalid_index);
+
+	// Weighted sums of the merged colors, num_channels values per color.
+	std::pmr::vector < double > coarse_color_sums(p_coarse_colors.get_allocator().resource());
+	p_coarse_color_weights.clear();
+
+	for (std::size_t i = 0; i < p_colors.size(); ++i)
+	{
+		graphics::color const &color = p_colors[i];
+
+		std::uint32_t key = 0;
+		for (int c = 0; c < graphics::color::num_channels; ++c)
+			key = (key << p_num_bits) | std::uint32_t(color[c] >> shift);
+
+		std::uint32_t &coarse_color_index = p_coarse_color_indices[key];
+		if (coarse_color_index == invalid_index)
+		{
+			coarse_color_index = std::uint32_t(p_coarse_color_weights.size());
+			p_coarse_color_weights.push_back(0.0);
+			coarse_color_sums.resize(coarse_color_sums.size() + graphics::color::num_channels, 0.0);
+		}
+
+		for (int c = 0; c < graphics::color::num_channels; ++c)
+			coarse_color_sums[coarse_color_index * graphics::color::num_channels + c] += color[c] * p_color_weights[i];
+		p_coarse_color_weights[coarse_color_index] += p_color_weights[i];
+	}
+
+	p_coarse_colors.resize(p_coarse_color_weights.size());
+	for (std::size_t i = 0; i < p_coarse_colors.size(); ++i)
+	{
+		for (int c = 0; c < graphics::color::num_channels; ++c)
+			p_coarse_colors[i][c] = int(std::lround(coarse_color_sums[i * graphics::color::num_channels + c] / p_coarse_color_weights[i]));
+	}
+}
+
+
+} // unnamed namespace end
+
+
+k_means_quantizer_options::k_means_quantizer_options()
+	: m_palette_size(256)
+	, m_engine(k_means_engine::lloyd)
+	, m_num_coarse_bits(0)
+	, m_max_num_refinement_iterations(5)
+{
+}
+
+
+bool check_options(k_means_quantizer_options const &p_options)
+{
+	if ((p_options.m_palette_size < 2) || (p_options.m_palette_size > 256))
+	{
+		fmt::print(stderr, "Invalid palette size {}; valid range is 2-256\n", p_options.m_palette_size);
+		return false;
+	}
+
+	if ((p_options.m_num_coarse_bits != 0) && ((p_options.m_num_coarse_bits < 2) || (p_options.m_num_coarse_bits > 5)))
+	{
+		fmt::print(stderr, "Invalid number of coarse bits {}; valid range is 2-5 (or 0 to disable the coarse level)\n", p_options.m_num_coarse_bits);
+		return false;
+	}
+
+	if (p_options.m_max_num_refinement_iterations < 1)
+	{
+		fmt::print(stderr, "Invalid number of refinement iterations {}; must be at least 1\n", p_options.m_max_num_refinement_iterations);
+		return false;
+	}
+
+	return true;
+}
+
+
+k_means_quantizer::k_means_quantizer(k_means_quantizer_options const &p_options)
+	: m_options(p_options)
+	, m_unique_input_colors(m_scratch_arena.get_memory_resource())
+	, m_color_weights(m_scratch_arena.get_memory_resource())
+	, m_unique_input_colors_nearest_palette_indices(m_scratch_arena.get_memory_resource())
+	, m_coarse_colors(m_scratch_arena.get_memory_resource())
+	, m_coarse_color_weights(m_scratch_arena.get_memory_resource())
+	, m_coarse_colors_nearest_palette_indices(m_scratch_arena.get_memory_resource())
+	, m_coarse_color_indices(m_scratch_arena.get_memory_resource())
+	, m_refiner(m_scratch_arena.get_memory_resource())
+	, m_palettized_output_buffers(m_scratch_arena.get_memory_resource())
+{
+}
+
+
+bool k_means_quantizer::compute_palette(context &p_context)
+{
+	// This may be less than the palette size if palette entries
+	// are reserved for other purposes (like transparency).
+	std::size_t const num_palette_entries = m_options.m_palette_size - (has_transparent_palette_entry(p_context) ? 1 : 0);
+	p_context.m_palette.m_colors.assign(num_palette_entries, graphics::color{0, 0, 0});
+
+	// These are reused across calls, so their capacity is retained.
+	auto &unique_input_colors = m_unique_input_colors;
+	auto &color_weights = m_color_weights;
+	auto &unique_input_colors_nearest_palette_indices = m_unique_input_colors_nearest_palette_indices;
+	int prev_progress_percent;
+
+
+	// Initialize the unique_input_colors and
+	// unique_input_colors_nearest_palette_indices vectors.
+
+	{
+		graphics::color_histogram temp_color_histogram(m_scratch_arena.get_memory_resource());
+		if (compute_input_histogram(p_context, temp_color_histogram, num_palette_entries, m_palettized_output_buffers))
+			return true;
+
+		unique_input_colors.resize(temp_color_histogram.size());
+		color_weights.resize(temp_color_histogram.size());
+		unique_input_colors_nearest_palette_indices.resize(temp_color_histogram.size());
+
+		unsigned long total_num_pixels = graphics::width(p_context.m_input_image) * graphics::height(p_context.m_input_image);
+
+		std::size_t i = 0;
+		for (auto iter = temp_color_histogram.begin(); iter != temp_color_histogram.end(); ++i, ++iter)
+		{
+			unique_input_colors[i] = iter->first;
+			color_weights[i] = double(iter->second) / total_num_pixels;
+		}
+
+		fmt::print(stderr, "{} source pixel entries\n", unique_input_colors.size());
+	}
+
+
+	base::scoped_stage_timer stage_timer(p_context.m_instrumentation, "palette");
+
+
+	// Set up an initial palette.
+
+	prev_progress_percent = -1;
+	for (std::size_t i = 0; i < num_palette_entries; ++i)
+	{
+		int progress_percent = ((i + 1) * 100) / num_palette_entries;
+		if (p_context.m_show_progress && (progress_percent != prev_progress_percent))
+		{
+			fmt::print(stderr, "Setting up initial palette: {}%\r", progress_percent);
+			prev_progress_percent = progress_percent;
+		}
+
+		auto iter = unique_input_colors.begin() + i * unique_input_colors.size() / num_palette_entries;
+
+		p_context.m_palette[i] = *iter;
+	}
+	if (p_context.m_show_progress)
+		fmt::print(stderr, "\n");
+
+
+	k_means_refiner::stats refinement_stats;
+	unsigned int const max_num_iterations = 100;
+	unsigned int const num_unchecked_iterations = 31;
+	unsigned int num_iterations = 0;
+
+	if (m_options.m_num_coarse_bits > 0)
+	{
+		build_coarse_colors(unique_input_colors, color_weights, m_options.m_num_coarse_bits, m_coarse_color_indices, m_coarse_colors, m_coarse_color_weights);
+		m_coarse_colors_nearest_palette_indices.resize(m_coarse_colors.size());
+	}
+
+	// With no more colors than palette entries, there is nothing to
+	// gain from the coarse level.
+	if ((m_options.m_num_coarse_bits > 0) && (m_coarse_colors.size() > num_palette_entries))
+	{
+		std::chrono::steady_clock::time_point start_time_point = std::chrono::steady_clock::now();
+		unsigned int num_coarse_iterations;
+		{
+			base::scoped_stage_timer coarse_stage_timer(p_context.m_instrumentation, "k_means_coarse");
+			fmt::print(stderr, "Beginning color quantization iterations on {} colors with {} bits per channel\n", m_coarse_colors.size(), m_options.m_num_coarse_bits);
+			num_coarse_iterations = m_refiner.run_iterations(p_context, m_options.m_engine, m_coarse_colors, m_coarse_color_weights, m_coarse_colors_nearest_palette_indices, max_num_iterations, num_unchecked_iterations, refinement_stats);
+		}
+		double coarse_time = std::chrono::duration < double > (std::chrono::steady_clock::now() - start_time_point).count();
+
+		start_time_point = std::chrono::steady_clock::now();
+		unsigned int num_fine_iterations;
+		{
+			base::scoped_stage_timer fine_stage_timer(p_context.m_instrumentation, "k_means_fine");
+			fmt::print(stderr, "Beginning color quantization iterations on all {} colors\n", unique_input_colors.size());
+			num_fine_iterations = m_refiner.run_iterations(p_context, m_options.m_engine, unique_input_colors, color_weights, unique_input_colors_nearest_palette_indices, m_options.m_max_num_refinement_iterations, 1, refinement_stats);
+		}
+		double fine_time = std::chrono::duration < double > (std::chrono::steady_clock::now() - start_time_point).count();
+
+		fmt::print(stderr, "Coarse level: {} colors, {} iterations, {:.3f} s\n", m_coarse_colors.size(), num_coarse_iterations, coarse_time);
+		fmt::print(stderr, "Full resolution: {} colors, {} iterations, {:.3f} s\n", unique_input_colors.size(), num_fine_iterations, fine_time);
+
+		p_context.m_instrumentation.add_to_counter("k_means_coarse_colors", m_coarse_colors.size());
+		p_context.m_instrumentation.add_to_counter("k_means_coarse_iterations", num_coarse_iterations);
+		p_context.m_instrumentation.add_to_counter("k_means_fine_iterations", num_fine_iterations);
+		num_iterations = num_coarse_iterations + num_fine_iterations;
+	}
+	else
+	{
+		fmt::print(stderr, "Beginning color quantization iterations\n");
+		num_iterations = m_refiner.run_iterations(p_context, m_options.m_engine, unique_input_colors, color_weights, unique_input_colors_nearest_palette_indices, max_num_iterations, num_unchecked_iterations, refinement_stats);
+	}
+
+	set_assigned_palette_indices(
+		m_palettized_output_buffers,
+		nonstd::span < graphics::color const > (unique_input_colors.data(), unique_input_colors.size()),
+		nonstd::span < std::size_t const > (unique_input_colors_nearest_palette_indices.data(), unique_input_colors_nearest_palette_indices.size())
+	);
+
+	p_context.m_instrumentation.add_to_counter("k_means_iterations", num_iterations);
+	p_context.m_instrumentation.add_to_counter("distance_evaluations", refinement_stats.m_num_distance_evaluations + refinement_stats.m_filtering_stats.m_num_distance_evaluations);
+	if (m_options.m_engine == k_means_engine::filtering)
+	{
+		p_context.m_instrumentation.add_to_counter("k_means_filtering_visited_nodes", refinement_stats.m_filtering_stats.m_num_visited_nodes);
+		p_context.m_instrumentation.add_to_counter("k_means_filtering_subtree_assignments", refinement_stats.m_filtering_stats.m_num_subtree_assignments);
+	}
+
+
+	store_palette_in_cache(p_context, m_palettized_output_buffers);
+
+
+	return true;
+}
+
+
+bool k_means_quantizer::map_pixels(context &p_context)
+{
+	base::scoped_stage_timer stage_timer(p_context.m_instrumentation, "mapping");
+
+	auto output_stats = produce_palettized_output(
+		p_context,
+		m_palettized_output_buffers,
+		make_progress_report(p_context, "Determining pixels of output image")
+	);
+	if (p_context.m_show_progress)
+		fmt::print(stderr, "\n");
+	print_palettized_output_stats(output_stats);
+
+
+	return true;
+}
+
+
+std::unique_ptr < quantizer > k_means_quantizer::clone() const
+{
+	return std::unique_ptr < quantizer > (new k_means_quantizer(m_options));
+}
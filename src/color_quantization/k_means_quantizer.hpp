@@ -0,0 +1,61 @@
+#ifndef COLOR_QUANTIZATION_K_MEANS_QUANTIZER_HPP______
+#define COLOR_QUANTIZATION_K_MEANS_QUANTIZER_HPP______
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <vector>
+#include "graphics/color.hpp"
+#include "graphics/palette.hpp"
+#include "k_means_refinement.hpp"
+#include "palettized_output.hpp"
+#include "quantizer.hpp"
+
+
+struct k_means_quantizer_options
+{
+	// Valid range: 2-256.
+	std::size_t m_palette_size;
+	k_means_engine m_engine;
+	// If nonzero, k-means first runs on the colors reduced to this many
+	// bits per channel, which merges them into far fewer weighted colors.
+	// The result is then refined with a few iterations on all colors.
+	// Valid range: 2-5, or 0 to run all iterations on all colors.
+	unsigned int m_num_coarse_bits;
+	// Maximum number of iterations on all colors after the coarse level.
+	unsigned int m_max_num_refinement_iterations;
+
+	k_means_quantizer_options();
+};
+
+
+bool check_options(k_means_quantizer_options const &p_options);
+
+
+class k_means_quantizer
+	: public quantizer
+{
+public:
+	explicit k_means_quantizer(k_means_quantizer_options const &p_options = k_means_quantizer_options());
+
+	bool compute_palette(context &p_context) override;
+	bool map_pixels(context &p_context) override;
+	std::unique_ptr < quantizer > clone() const override;
+
+
+private:
+	k_means_quantizer_options m_options;
+
+	std::pmr::vector < graphics::color > m_unique_input_colors;
+	std::pmr::vector < double > m_color_weights;
+	std::pmr::vector < std::size_t > m_unique_input_colors_nearest_palette_indices;
+	std::pmr::vector < graphics::color > m_coarse_colors;
+	std::pmr::vector < double > m_coarse_color_weights;
+	std::pmr::vector < std::size_t > m_coarse_colors_nearest_palette_indices;
+	std::pmr::vector < std::uint32_t > m_coarse_color_indices;
+	k_means_refiner m_refiner;
+	palettized_output_buffers m_palettized_output_buffers;
+};
+
+
+#endif // COLOR_QUANTIZATION_K_MEANS_QUANTIZER_HPP______
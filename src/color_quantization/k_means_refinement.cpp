@@ -0,0 +1,348 @@
+#include <algorithm>
+#include <assert.h>
+#include <cmath>
+#include "fmt/format.h"
+#include "k_means_refinement.hpp"
+
+
+// The k-means iterations implement optimizations described in the
+// paper "Improving the performance of k-means for color quantization"
+// by M. Emre Celebi. Link:
+// https://doi.org/10.1016/j.imavis.2010.10.002
+
+
+namespace
+{
+
+
+// The assignment below skips palette entries t with
+//
+//   L(t, p) > 4 * distance(x, p)
+//
+// where x is the input color, p is its previous palette entry, and L is
+// graphics::calculate_lower_bound_color_distance(), a squared norm with
+// L <= distance. Such entries are strictly further away from x than p,
+// so they can neither be nearer nor win a tie. By the triangle
+// inequality of the norm:
+//
+//   sqrt(L(x, t)) >= sqrt(L(t, p)) - sqrt(L(x, p))
+//                  > 2*sqrt(distance(x, p)) - sqrt(distance(x, p))
+//
+// and thus distance(x, t) >= L(x, t) > distance(x, p). (Using distance()
+// instead of L for the palette entries, as the original algorithm does,
+// is only correct for the oklab metric, since the rgb_low_cost distance
+// is not a squared norm and violates the triangle inequality.)
+
+
+// Assigns each unique input color to its nearest palette entry, and
+// returns the largest of the distances between the colors and their
+// entries. The previous assignments are the starting points of the
+// searches. Like with graphics::find_nearest_color(), the lowest
+// palette index wins ties. The matrices must have num_palette_entries
+// rows, each with PaletteStride elements.
+template < std::size_t PaletteStride >
+long assign_nearest_palette_entries(
+	graphics::palette const &p_palette,
+	graphics::color_metric const p_color_metric,
+	std::pmr::vector < graphics::color > const &p_unique_input_colors,
+	std::pmr::vector < std::size_t > &p_nearest_palette_indices,
+	std::pmr::vector < long > &p_distance_matrix,
+	std::pmr::vector < std::size_t > &p_permutation_matrix,
+	unsigned long long &p_num_distance_evaluations
+)
+{
+	std::size_t const num_palette_entries = p_palette.size();
+	assert(num_palette_entries <= PaletteStride);
+
+	long *distance_matrix = p_distance_matrix.data();
+	std::size_t *permutation_matrix = p_permutation_matrix.data();
+	long max_distance = -1;
+
+	for (std::size_t i = 0; i < num_palette_entries; ++i)
+	{
+		distance_matrix[i + i*PaletteStride] = 0;
+		for (std::size_t j = i + 1; j < num_palette_entries; ++j)
+		{
+			distance_matrix[i + j*PaletteStride] = distance_matrix[j + i*PaletteStride] = calculate_lower_bound_color_distance(p_palette[i], p_palette[j], p_color_metric);
+		}
+	}
+	p_num_distance_evaluations += num_palette_entries * (num_palette_entries - 1) / 2;
+
+	for (std::size_t i = 0; i < num_palette_entries; ++i)
+	{
+		long const *distance_row = distance_matrix + i*PaletteStride;
+		std::size_t *permutation_row = permutation_matrix + i*PaletteStride;
+
+		for (std::size_t j = 0; j < num_palette_entries; ++j)
+			permutation_row[j] = j;
+
+		std::sort(
+			permutation_row, permutation_row + num_palette_entries,
+			[distance_row](std::size_t p_first, std::size_t p_second) {
+				return distance_row[p_first] < distance_row[p_second];
+			}
+		);
+	}
+
+	for (std::size_t i = 0; i < p_unique_input_colors.size(); ++i)
+	{
+		std::size_t palette_index = p_nearest_palette_indices[i];
+		long const *distance_row = distance_matrix + palette_index*PaletteStride;
+		std::size_t const *permutation_row = permutation_matrix + palette_index*PaletteStride;
+
+		long min_distance, prev_distance;
+		min_distance = prev_distance = calculate_color_distance(p_unique_input_colors[i], p_palette[palette_index], p_color_metric);
+		++p_num_distance_evaluations;
+
+		// The previous entry is not necessarily the first one in its
+		// own row, since duplicate palette entries have a distance of 0
+		// as well.
+		for (std::size_t j = 0; j < num_palette_entries; ++j)
+		{
+			std::size_t t = permutation_row[j];
+			if (distance_row[t] > (4 * prev_distance))
+				break;
+			if (t == palette_index)
+				continue;
+
+			long distance = calculate_color_distance(p_unique_input_colors[i], p_palette[t], p_color_metric);
+			++p_num_distance_evaluations;
+
+			if ((distance < min_distance) || ((distance == min_distance) && (t < p_nearest_palette_indices[i])))
+			{
+				min_distance = distance;
+				p_nearest_palette_indices[i] = t;
+			}
+		}
+
+		max_distance = std::max(max_distance, min_distance);
+	}
+
+	return max_distance;
+}
+
+
+} // unnamed namespace end
+
+
+std::string to_string(k_means_engine const p_engine)
+{
+	switch (p_engine)
+	{
+		case k_means_engine::lloyd: return "lloyd";
+		case k_means_engine::filtering: return "filtering";
+		default: return "<unknown>";
+	}
+}
+
+
+bool parse_k_means_engine(std::string const &p_string, k_means_engine &p_engine)
+{
+	if (p_string == "lloyd")
+		p_engine = k_means_engine::lloyd;
+	else if (p_string == "filtering")
+		p_engine = k_means_engine::filtering;
+	else
+		return false;
+
+	return true;
+}
+
+
+k_means_refiner::stats::stats()
+	: m_num_distance_evaluations(0)
+{
+}
+
+
+k_means_refiner::k_means_refiner(std::pmr::memory_resource *p_memory_resource)
+	: m_distance_matrix(p_memory_resource)
+	, m_permutation_matrix(p_memory_resource)
+	, m_sum_palette(p_memory_resource)
+	, m_sum_weights(p_memory_resource)
+	, m_filtering_tree(p_memory_resource)
+	, m_colors(p_memory_resource)
+	, m_color_weights(p_memory_resource)
+	, m_nearest_palette_indices(p_memory_resource)
+{
+}
+
+
+unsigned int k_means_refiner::run_iterations(
+	context &p_context,
+	k_means_engine const p_engine,
+	std::pmr::vector < graphics::color > const &p_colors,
+	std::pmr::vector < double > const &p_color_weights,
+	std::pmr::vector < std::size_t > &p_nearest_palette_indices,
+	unsigned int const p_max_num_iterations,
+	unsigned int const p_num_unchecked_iterations,
+	stats &p_stats
+)
+{
+	std::size_t const num_palette_entries = p_context.m_palette.size();
+
+	// The rows of the distance and permutation matrices are padded to
+	// the smallest of the common palette sizes 16, 64 and 256 that fits
+	// all entries. The assignment kernel is instantiated for each of
+	// these, so row offsets are multiplications by a constant.
+	std::size_t const palette_stride = (num_palette_entries <= 16) ? 16 : (num_palette_entries <= 64) ? 64 : 256;
+	m_distance_matrix.resize(num_palette_entries * palette_stride);
+	m_permutation_matrix.resize(num_palette_entries * palette_stride);
+	m_sum_palette.resize(num_palette_entries * graphics::color::num_channels);
+	m_sum_weights.resize(num_palette_entries);
+	m_new_palette.m_colors.assign(num_palette_entries, graphics::color{0, 0, 0});
+
+	auto sum_palette_span = nonstd::span < double > (m_sum_palette.data(), m_sum_palette.size());
+	auto sum_weights_span = nonstd::span < double > (m_sum_weights.data(), m_sum_weights.size());
+
+	auto colors_span = nonstd::span < graphics::color const > (p_colors.data(), p_colors.size());
+	auto nearest_palette_indices_span = nonstd::span < std::size_t > (p_nearest_palette_indices.data(), p_nearest_palette_indices.size());
+
+	if (p_engine == k_means_engine::filtering)
+	{
+		base::scoped_stage_timer filtering_tree_stage_timer(p_context.m_instrumentation, "k_means_filtering_tree");
+		m_filtering_tree.build(colors_span, nonstd::span < double const > (p_color_weights.data(), p_color_weights.size()));
+	}
+	else
+	{
+		// The colors are sorted, so the nearest entry of one color
+		// is a good starting point for the search for the next one.
+		// (The filtering engine does not need starting points.)
+		build_palette_index(m_palette_index, p_context.m_palette, p_context.m_color_metric);
+		find_nearest_colors(m_palette_index, colors_span, nearest_palette_indices_span);
+		add_palette_index_counters(p_context, m_palette_index);
+	}
+
+	auto assign_nearest_entries = [&](graphics::palette const &p_palette) -> long {
+		switch (palette_stride)
+		{
+			case 16: return assign_nearest_palette_entries < 16 > (p_palette, p_context.m_color_metric, p_colors, p_nearest_palette_indices, m_distance_matrix, m_permutation_matrix, p_stats.m_num_distance_evaluations);
+			case 64: return assign_nearest_palette_entries < 64 > (p_palette, p_context.m_color_metric, p_colors, p_nearest_palette_indices, m_distance_matrix, m_permutation_matrix, p_stats.m_num_distance_evaluations);
+			default: return assign_nearest_palette_entries < 256 > (p_palette, p_context.m_color_metric, p_colors, p_nearest_palette_indices, m_distance_matrix, m_permutation_matrix, p_stats.m_num_distance_evaluations);
+		}
+	};
+
+	long min_max_distance = -1;
+	unsigned int num_iterations = 0;
+	// Whether the assignment was done with the current palette. This
+	// is not the case if the iterations end with a palette update.
+	bool is_assignment_current = false;
+
+	for (unsigned int iteration = 0; iteration < p_max_num_iterations; ++iteration)
+	{
+		graphics::palette &cur_palette = p_context.m_palette;
+		++num_iterations;
+
+		std::fill(begin(m_sum_palette), end(m_sum_palette), 0.0);
+		std::fill(begin(m_sum_weights), end(m_sum_weights), 0.0);
+		std::fill(begin(m_new_palette), end(m_new_palette), graphics::color{0, 0, 0});
+
+		long max_distance;
+
+		if (p_engine == k_means_engine::filtering)
+		{
+			// The filtering tree sums up the colors of each entry while
+			// assigning them, but leaves the per-color assignments alone.
+			max_distance = m_filtering_tree.assign(cur_palette, p_context.m_color_metric, sum_palette_span, sum_weights_span, nonstd::span < std::size_t > (), p_stats.m_filtering_stats);
+		}
+		else
+		{
+			max_distance = assign_nearest_entries(cur_palette);
+			is_assignment_current = true;
+
+			for (std::size_t i = 0; i < p_colors.size(); ++i)
+			{
+				std::size_t palette_index = p_nearest_palette_indices[i];
+				for (int c = 0; c < graphics::color::num_channels; ++c)
+					m_sum_palette[palette_index * graphics::color::num_channels + c] += p_colors[i][c] * p_color_weights[i];
+				m_sum_weights[palette_index] += p_color_weights[i];
+			}
+		}
+
+		for (unsigned int k = 0; k < num_palette_entries; ++k)
+		{
+			// An entry that got no colors keeps its value. (This can
+			// happen when the palette comes from another set of colors.)
+			if (m_sum_weights[k] <= 0.0)
+			{
+				m_new_palette[k] = cur_palette[k];
+				continue;
+			}
+
+			for (int c = 0; c < graphics::color::alpha_channel; ++c)
+				m_new_palette[k][c] = int(m_sum_palette[k * graphics::color::num_channels + c] / m_sum_weights[k]);
+			// Round alpha instead of truncating it, otherwise clusters
+			// of fully opaque colors could end up with an alpha of 254.
+			m_new_palette[k][graphics::color::alpha_channel] = int(std::lround(m_sum_palette[k * graphics::color::num_channels + graphics::color::alpha_channel] / m_sum_weights[k]));
+		}
+
+		fmt::print(stderr, "Iteration #{}: max distance {}\n", iteration, max_distance);
+
+		if (min_max_distance >= 0)
+		{
+			if (iteration >= p_num_unchecked_iterations)
+			{
+				if (max_distance > min_max_distance)
+					break;
+				else if ((min_max_distance - max_distance) < 5)
+					break;
+			}
+
+			min_max_distance = max_distance;
+		}
+		else
+			min_max_distance = max_distance;
+
+		cur_palette = m_new_palette;
+		is_assignment_current = false;
+	}
+
+	// The assignment is exact (see assign_nearest_palette_entries() and
+	// k_means_filtering_tree), so the mapping can use it instead of
+	// searching again (see set_assigned_palette_indices()).
+	if (p_engine == k_means_engine::filtering)
+		m_filtering_tree.assign(p_context.m_palette, p_context.m_color_metric, sum_palette_span, sum_weights_span, nearest_palette_indices_span, p_stats.m_filtering_stats);
+	else if (!is_assignment_current)
+		assign_nearest_entries(p_context.m_palette);
+
+	return num_iterations;
+}
+
+
+void k_means_refiner::refine_palette(
+	context &p_context,
+	graphics::color_histogram const &p_color_histogram,
+	unsigned int const p_num_iterations,
+	palettized_output_buffers &p_buffers
+)
+{
+	base::scoped_stage_timer stage_timer(p_context.m_instrumentation, "k_means_refinement");
+
+	m_colors.resize(p_color_histogram.size());
+	m_color_weights.resize(p_color_histogram.size());
+	m_nearest_palette_indices.resize(p_color_histogram.size());
+
+	std::size_t i = 0;
+	for (auto iter = p_color_histogram.begin(); iter != p_color_histogram.end(); ++i, ++iter)
+	{
+		m_colors[i] = iter->first;
+		m_color_weights[i] = double(iter->second);
+	}
+
+	// All iterations run, since the max distance is never checked.
+	// They are too few for a filtering tree to pay off, because the
+	// palette is already a good start, so most colors stay with their
+	// entries after the first search.
+	fmt::print(stderr, "Refining palette with {} k-means iterations\n", p_num_iterations);
+	stats refinement_stats;
+	unsigned int num_iterations = run_iterations(p_context, k_means_engine::lloyd, m_colors, m_color_weights, m_nearest_palette_indices, p_num_iterations, p_num_iterations, refinement_stats);
+
+	set_assigned_palette_indices(
+		p_buffers,
+		nonstd::span < graphics::color const > (m_colors.data(), m_colors.size()),
+		nonstd::span < std::size_t const > (m_nearest_palette_indices.data(), m_nearest_palette_indices.size())
+	);
+
+	p_context.m_instrumentation.add_to_counter("k_means_refinement_iterations", num_iterations);
+	p_context.m_instrumentation.add_to_counter("distance_evaluations", refinement_stats.m_num_distance_evaluations);
+}
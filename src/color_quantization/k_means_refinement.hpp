@@ -0,0 +1,96 @@
+#ifndef COLOR_QUANTIZATION_K_MEANS_REFINEMENT_HPP______
+#define COLOR_QUANTIZATION_K_MEANS_REFINEMENT_HPP______
+
+#include <cstddef>
+#include <memory_resource>
+#include <string>
+#include <vector>
+#include "graphics/color.hpp"
+#include "graphics/palette.hpp"
+#include "context.hpp"
+#include "k_means_filtering.hpp"
+#include "palettized_output.hpp"
+
+
+// How the k-means iterations assign the unique colors to their nearest
+// palette entries. Both produce the same assignments.
+enum class k_means_engine
+{
+	// Searches the nearest entry of each color, starting at its
+	// previous one, and skipping entries by the triangle inequality.
+	lloyd,
+	// Assigns whole cells of a kd-tree over the colors at once (see
+	// k_means_filtering.hpp). Faster for images with many colors.
+	filtering
+};
+
+std::string to_string(k_means_engine const p_engine);
+bool parse_k_means_engine(std::string const &p_string, k_means_engine &p_engine);
+
+
+// Weighted k-means (Lloyd) iterations on a palette. This is the core of
+// the k-means quantizer, and is also used by the other quantizers to
+// refine the palettes they computed with a few iterations.
+class k_means_refiner
+{
+public:
+	struct stats
+	{
+		unsigned long long m_num_distance_evaluations;
+		k_means_filtering_tree::stats m_filtering_stats;
+
+		stats();
+	};
+
+	explicit k_means_refiner(std::pmr::memory_resource *p_memory_resource = std::pmr::get_default_resource());
+
+	// Runs up to p_max_num_iterations iterations on p_colors, starting
+	// with the context's palette, and returns the number of iterations.
+	// The iterations stop once the max distance between the colors and
+	// their entries gets worse or only improves slightly, but this is
+	// not checked for the first p_num_unchecked_iterations. Entries that
+	// get no colors keep their value.
+	//
+	// Afterwards, p_nearest_palette_indices has the exact assignments of
+	// the colors to the final palette (see set_assigned_palette_indices()).
+	unsigned int run_iterations(
+		context &p_context,
+		k_means_engine const p_engine,
+		std::pmr::vector < graphics::color > const &p_colors,
+		std::pmr::vector < double > const &p_color_weights,
+		std::pmr::vector < std::size_t > &p_nearest_palette_indices,
+		unsigned int const p_max_num_iterations,
+		unsigned int const p_num_unchecked_iterations,
+		stats &p_stats
+	);
+
+	// Refines the palette that a quantizer computed from p_color_histogram
+	// with exactly p_num_iterations iterations, and hands the assignments
+	// to p_buffers. Entries that are not used by any color stay as they
+	// are. Adds the "k_means_refinement" stage and its counters to the
+	// context's instrumentation.
+	void refine_palette(
+		context &p_context,
+		graphics::color_histogram const &p_color_histogram,
+		unsigned int const p_num_iterations,
+		palettized_output_buffers &p_buffers
+	);
+
+
+private:
+	std::pmr::vector < long > m_distance_matrix;
+	std::pmr::vector < std::size_t > m_permutation_matrix;
+	std::pmr::vector < double > m_sum_palette;
+	std::pmr::vector < double > m_sum_weights;
+	graphics::palette m_new_palette;
+	graphics::palette_index m_palette_index;
+	k_means_filtering_tree m_filtering_tree;
+
+	// Only used by refine_palette().
+	std::pmr::vector < graphics::color > m_colors;
+	std::pmr::vector < double > m_color_weights;
+	std::pmr::vector < std::size_t > m_nearest_palette_indices;
+};
+
+
+#endif // COLOR_QUANTIZATION_K_MEANS_REFINEMENT_HPP______
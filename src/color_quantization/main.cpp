@@ -1,11 +1,22 @@
 #include <assert.h>
+#include <algorithm>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
 #include <FreeImage.h>
 #include <boost/program_options.hpp>
 #include "fmt/format.h"
 #include "fmt/ostream.h"
+#include "base/instrumentation.hpp"
 #include "base/scope_guard.hpp"
 #include "graphics/fi_pixmap.hpp"
-#include "context.hpp"
+#include "graphics/indexed_image_writer.hpp"
+#include "batch_pipeline.hpp"
+#include "frontend.hpp"
+#include "image_files.hpp"
+#include "nearest_color_verification.hpp"
+#include "palette_cache.hpp"
 
 
 void display_help(boost::program_options::options_description const &p_allowed_progopts)
@@ -15,6 +26,55 @@ void display_help(boost::program_options::options_description const &p_allowed_p
 }
 
 
+// The quantizer's name, followed by the effective values of all quantizer
+// options, sorted by name. Options that were not given on the command line
+// are included with their default values, so that giving an option its
+// default value explicitly does not change the cache key.
+std::string make_palette_cache_options(
+	boost::program_options::variables_map const &p_progopts_varmap,
+	boost::program_options::options_description const &p_quantizer_progopts
+)
+{
+	auto to_string = [](boost::any const &p_value) -> std::string {
+		if (auto const *value = boost::any_cast < bool > (&p_value))
+			return *value ? "true" : "false";
+		else if (auto const *value = boost::any_cast < std::size_t > (&p_value))
+			return std::to_string(*value);
+		else if (auto const *value = boost::any_cast < unsigned int > (&p_value))
+			return std::to_string(*value);
+		else if (auto const *value = boost::any_cast < int > (&p_value))
+			return std::to_string(*value);
+		else if (auto const *value = boost::any_cast < std::string > (&p_value))
+			return *value;
+		else
+		{
+			// Catches quantizer options of types that are not handled
+			// above; they would otherwise not be part of the key.
+			assert(false);
+			return "?";
+		}
+	};
+
+	std::vector < std::string > options;
+	for (auto const &option_description : p_quantizer_progopts.options())
+	{
+		std::string const &name = option_description->long_name();
+		auto varmap_iter = p_progopts_varmap.find(name);
+		std::string option = name + "=";
+		if (varmap_iter != p_progopts_varmap.end())
+			option += to_string(varmap_iter->second.value());
+		options.push_back(std::move(option));
+	}
+	std::sort(options.begin(), options.end());
+
+	std::string result = get_quantizer_name();
+	for (std::string const &option : options)
+		result += " " + option;
+
+	return result;
+}
+
+
 int main(int argc, char *argv[])
 {
 	context ctx;
@@ -24,26 +84,74 @@ int main(int argc, char *argv[])
 
 	bool help = false;
 	bool use_dithering = false;
-	std::string input_filename;
-	std::string output_filename;
+	bool no_progress = false;
+	std::string stats_format_name;
+	std::string color_metric_name;
+	int alpha_threshold = 128;
+	int compression_level = graphics::indexed_image_writer::default_compression_level;
+	std::vector < std::string > input_filenames;
+	std::vector < std::string > output_filenames;
+	batch_pipeline_options batch_options;
+	std::string preview_filter_name;
+	std::string palette_cache_directory;
+	bool verify_nearest_color = false;
+	nearest_color_verification_options verification_options;
 
 	boost::program_options::options_description allowed_progopts("Options");
 	allowed_progopts.add_options()
 		("help,h", boost::program_options::bool_switch(&help), "produce help message")
-		("input,i", boost::program_options::value < std::string > (&input_filename), "input image file to color-quantize")
-		("output,o", boost::program_options::value < std::string > (&output_filename), "color-quantized output image file")
+		("input,i", boost::program_options::value < std::vector < std::string > > (&input_filenames), "input image file to color-quantize; can be given multiple times to quantize a batch of images")
+		("output,o", boost::program_options::value < std::vector < std::string > > (&output_filenames), "color-quantized output image file; must be given once for each input image file")
 		("use-dithering,d", boost::program_options::bool_switch(&use_dithering), "use dithering when quantizing the image")
+		("alpha-threshold,a", boost::program_options::value < int > (&alpha_threshold)->default_value(128), "for images with an alpha channel: pixels with an alpha value below this are mapped to a reserved transparent palette entry (valid range: 0-255; 0 disables the reserved entry)")
+		("compression-level,z", boost::program_options::value < int > (&compression_level)->default_value(graphics::indexed_image_writer::default_compression_level), "PNG compression level (valid range: 0-9; lower is faster, higher produces smaller files); GIF output ignores this")
+		("color-metric,c", boost::program_options::value < std::string > (&color_metric_name)->default_value("rgb"), "color metric to use for quantization and nearest color search (rgb: low-cost approximation in gamma-encoded RGB; oklab: perceptual, in the Oklab color space)")
+		("no-progress", boost::program_options::bool_switch(&no_progress), "do not print progress")
+		("stats", boost::program_options::value < std::string > (&stats_format_name), "write stage timings, counters and peak memory usage of each image to stdout (valid formats: json csv)")
+		("palette-cache", boost::program_options::value < std::string > (&palette_cache_directory), "directory for caching computed palettes; images with the same colors and quantizer options reuse the cached palette instead of computing it again (created if it does not exist; can be shared by concurrent runs)")
 		;
 
-	add_program_options(allowed_progopts);
+	boost::program_options::options_description batch_progopts("Batch options (used when quantizing multiple images)");
+	batch_progopts.add_options()
+		("decode-threads", boost::program_options::value < std::size_t > (&batch_options.m_num_decode_threads)->default_value(1), "number of threads that load input images")
+		("quantize-threads", boost::program_options::value < std::size_t > (&batch_options.m_num_quantize_threads)->default_value(1), "number of threads that compute palettes")
+		("map-threads", boost::program_options::value < std::size_t > (&batch_options.m_num_map_threads)->default_value(1), "number of threads that map pixels to palettes (with dithering if enabled)")
+		("encode-threads", boost::program_options::value < std::size_t > (&batch_options.m_num_encode_threads)->default_value(1), "number of threads that write output images")
+		("queue-size", boost::program_options::value < std::size_t > (&batch_options.m_queue_capacity)->default_value(2), "maximum number of images waiting between two stages")
+		;
+	allowed_progopts.add(batch_progopts);
+
+	boost::program_options::options_description preview_progopts("Preview options (for computing palettes of very large images faster)");
+	preview_progopts.add_options()
+		("preview-block-size", boost::program_options::value < std::size_t > (&ctx.m_histogram_preview.m_block_size)->default_value(1), "compute the palette from a preview in which each pixel stands for a block of this many pixels per side (1 disables the preview)")
+		("preview-pixels", boost::program_options::value < std::size_t > (&ctx.m_histogram_preview.m_max_num_pixels)->default_value(0), "compute the palette from a preview with at most this many pixels; overrides --preview-block-size (0 disables this)")
+		("preview-filter", boost::program_options::value < std::string > (&preview_filter_name)->default_value("subsample"), "how preview pixels are computed from their blocks (subsample: top left pixel of the block; box: average of the block)")
+		("preview-edge-weighting", boost::program_options::bool_switch(&ctx.m_histogram_preview.m_use_edge_weighting), "let preview pixels on edges count up to 4 times, so small details keep their colors")
+		;
+	allowed_progopts.add(preview_progopts);
+
+	boost::program_options::options_description verification_progopts("Verification options (for checking and benchmarking the nearest color lookups)");
+	verification_progopts.add_options()
+		("verify-nearest-color", boost::program_options::bool_switch(&verify_nearest_color), "after quantizing, compare all nearest color lookups with a linear scan over the palette, and report mismatches and timings (single images only); fails if a lookup that should be exact is not")
+		("verify-random-colors", boost::program_options::value < std::size_t > (&verification_options.m_num_random_colors)->default_value(verification_options.m_num_random_colors), "number of random colors to look up")
+		("verify-image-colors", boost::program_options::value < std::size_t > (&verification_options.m_max_num_image_colors)->default_value(verification_options.m_max_num_image_colors), "maximum number of image pixels to look up (larger images are sampled)")
+		;
+	allowed_progopts.add(verification_progopts);
+
+	boost::program_options::options_description quantizer_progopts("Quantizer options");
+	add_program_options(quantizer_progopts);
+	allowed_progopts.add(quantizer_progopts);
 
 
 	// Read options from the command line
+	boost::program_options::variables_map progopts_varmap;
+	std::string palette_cache_options;
 	try
 	{
-		boost::program_options::variables_map progopts_varmap;
-		boost::program_options::store(boost::program_options::parse_command_line(argc, argv, allowed_progopts), progopts_varmap);
+		boost::program_options::parsed_options parsed_progopts = boost::program_options::parse_command_line(argc, argv, allowed_progopts);
+		boost::program_options::store(parsed_progopts, progopts_varmap);
 		boost::program_options::notify(progopts_varmap);
+		palette_cache_options = make_palette_cache_options(progopts_varmap, quantizer_progopts);
 	}
 	catch (boost::program_options::invalid_command_line_syntax const &p_invalid_command_line_syntax)
 	{
@@ -71,23 +179,92 @@ int main(int argc, char *argv[])
 	}
 
 	// Do some sanity checks on the command line arguments.
-	if (input_filename.empty())
+	if (input_filenames.empty())
 	{
 		fmt::print(stderr, "Need an input filename\n");
 		return -1;
 	}
 
-	if (output_filename.empty())
+	if (output_filenames.size() != input_filenames.size())
+	{
+		fmt::print(stderr, "Need one output filename for each input filename\n");
+		return -1;
+	}
+
+	if ((batch_options.m_num_decode_threads < 1) || (batch_options.m_num_quantize_threads < 1) || (batch_options.m_num_map_threads < 1) || (batch_options.m_num_encode_threads < 1) || (batch_options.m_queue_capacity < 1))
+	{
+		fmt::print(stderr, "Batch thread counts and queue size must be at least 1\n");
+		return -1;
+	}
+
+	if ((alpha_threshold < 0) || (alpha_threshold > 255))
+	{
+		fmt::print(stderr, "Invalid alpha threshold {}; valid range is 0-255\n", alpha_threshold);
+		return -1;
+	}
+
+	if ((compression_level < 0) || (compression_level > 9))
+	{
+		fmt::print(stderr, "Invalid compression level {}; valid range is 0-9\n", compression_level);
+		return -1;
+	}
+
+	if (!graphics::parse_color_metric(color_metric_name, ctx.m_color_metric))
+	{
+		fmt::print(stderr, "Invalid color metric \"{}\"; valid metrics are: rgb oklab\n", color_metric_name);
+		return -1;
+	}
+
+	if (ctx.m_histogram_preview.m_block_size < 1)
 	{
-		fmt::print(stderr, "Need an output filename\n");
+		fmt::print(stderr, "Invalid preview block size {}; must be at least 1\n", ctx.m_histogram_preview.m_block_size);
 		return -1;
 	}
 
+	if (!graphics::parse_preview_filter(preview_filter_name, ctx.m_histogram_preview.m_filter))
+	{
+		fmt::print(stderr, "Invalid preview filter \"{}\"; valid filters are: subsample box\n", preview_filter_name);
+		return -1;
+	}
+
+	if (verify_nearest_color && (input_filenames.size() > 1))
+	{
+		fmt::print(stderr, "Nearest color verification only works with a single input image\n");
+		return -1;
+	}
+
+	base::stats_format stats_format = base::stats_format::json;
+	bool write_stats = !stats_format_name.empty();
+	if (write_stats && !base::parse_stats_format(stats_format_name, stats_format))
+	{
+		fmt::print(stderr, "Invalid stats format \"{}\"; valid formats are: json csv\n", stats_format_name);
+		return -1;
+	}
+
+	ctx.m_show_progress = !no_progress;
+
+	std::unique_ptr < palette_cache > color_palette_cache;
+	if (!palette_cache_directory.empty())
+	{
+		std::error_code error_code;
+		std::filesystem::create_directories(palette_cache_directory, error_code);
+		if (error_code)
+		{
+			fmt::print(stderr, "Could not create palette cache directory \"{}\": {}\n", palette_cache_directory, error_code.message());
+			return -1;
+		}
+
+		color_palette_cache.reset(new palette_cache(palette_cache_directory));
+		ctx.m_palette_cache = color_palette_cache.get();
+		ctx.m_palette_cache_options = palette_cache_options;
+	}
+
 
 	try
 	{
 		// Set up color quantization.
-		if (!setup_color_quantization(ctx))
+		std::unique_ptr < quantizer > color_quantizer = create_quantizer(progopts_varmap);
+		if (!color_quantizer)
 			return -1;
 
 
@@ -100,87 +277,162 @@ int main(int argc, char *argv[])
 		FreeImage_Initialise();
 
 
-		// Get input image.
+		// Multiple images are quantized in a pipeline.
 
-		FREE_IMAGE_FORMAT input_format = FreeImage_GetFileType(input_filename.c_str());
-		if (input_format == FIF_UNKNOWN)
+		if (input_filenames.size() > 1)
 		{
-			input_format = FreeImage_GetFIFFromFilename(input_filename.c_str());
-			if (input_format == FIF_UNKNOWN)
+			batch_options.m_use_dithering = use_dithering;
+			batch_options.m_color_metric = ctx.m_color_metric;
+			batch_options.m_alpha_threshold = alpha_threshold;
+			batch_options.m_histogram_preview = ctx.m_histogram_preview;
+			batch_options.m_compression_level = compression_level;
+			batch_options.m_show_progress = !no_progress;
+			batch_options.m_palette_cache = ctx.m_palette_cache;
+			batch_options.m_palette_cache_options = ctx.m_palette_cache_options;
+
+			std::vector < batch_pipeline_image_files > image_files(input_filenames.size());
+			for (std::size_t i = 0; i < input_filenames.size(); ++i)
+				image_files[i] = batch_pipeline_image_files { input_filenames[i], output_filenames[i] };
+
+			fmt::print(stderr, "Dithering: {}\n", use_dithering ? "yes" : "no");
+			fmt::print(stderr, "Color metric: {}\n", to_string(ctx.m_color_metric));
+			if (color_palette_cache)
+				fmt::print(stderr, "Palette cache: \"{}\"\n", color_palette_cache->get_directory());
+
+			batch_pipeline_stats batch_stats = run_batch_pipeline(batch_options, image_files, *color_quantizer);
+			print_batch_pipeline_stats(batch_stats);
+
+			if (write_stats)
 			{
-				fmt::print(stderr, "Input image cannot be found, cannot be read, or has unknown file format\n");
-				return -1;
+				base::labelled_instrumentations image_instrumentations;
+				for (std::size_t i = 0; i < input_filenames.size(); ++i)
+					image_instrumentations.emplace_back(input_filenames[i], std::move(batch_stats.m_image_instrumentations[i]));
+				base::write_stats(stdout, stats_format, image_instrumentations);
 			}
-		}
 
-		graphics::fi_pixmap original_input_image = FreeImage_Load(input_format, input_filename.c_str(), 0);
-		if (original_input_image.get_fibitmap() == nullptr)
-		{
-			fmt::print(stderr, "Could not load input image file \"{}\"\n", input_filename);
-			return -1;
+			return (batch_stats.m_num_failed_images == 0) ? 0 : -1;
 		}
 
-		// Convert the image to 24-bit RGB.
 
-		graphics::fi_pixmap converted_input_image = FreeImage_ConvertTo24Bits(original_input_image.get_fibitmap());
-		if (converted_input_image.get_fibitmap() == nullptr)
+		// Get input image.
+
+		std::string const &input_filename = input_filenames[0];
+		std::string const &output_filename = output_filenames[0];
+
+		graphics::fi_pixmap input_image;
+		bool input_has_alpha;
 		{
-			fmt::print(stderr, "Could not convert input image file \"{}\" to 24 bit\n", input_filename);
-			return -1;
+			base::scoped_stage_timer stage_timer(ctx.m_instrumentation, "decode");
+			if (!load_input_image(input_filename, input_image, input_has_alpha))
+				return -1;
 		}
 
-		// We no longer need the original input image, so get rid of it to save some resouces.
-		original_input_image = graphics::fi_pixmap();
+		ctx.m_input_image = make_pixmap_view(input_image);
 
-		ctx.m_input_image = make_pixmap_view(converted_input_image);
+		// If the image has an alpha channel, the quantizer
+		// reserves a palette entry for fully transparent pixels.
+		ctx.m_alpha_threshold = input_has_alpha ? alpha_threshold : 0;
 
 
-		graphics::fi_pixmap output_image = FreeImage_Allocate(graphics::width(ctx.m_input_image), graphics::height(ctx.m_input_image), 8);
-		if (output_image.get_fibitmap() == nullptr)
-		{
-			fmt::print(stderr, "Could not allocate output image\n");
-			return -1;
-		}
+		std::size_t width = graphics::width(ctx.m_input_image);
+		std::size_t height = graphics::height(ctx.m_input_image);
 
-		ctx.m_output_image = make_pixmap_view(output_image);
+		std::vector < std::uint8_t > output_pixels(width * height);
+		ctx.m_output_image = graphics::make_pixmap_view(output_pixels.data(), output_pixels.size(), width, height, width, 1);
 
 		ctx.m_use_dithering = use_dithering;
 
 
+		// Output rows are written as soon as they are produced. The
+		// palette is final by the time the first row is produced.
+
+		graphics::indexed_image_format output_format = get_output_format(output_filename);
+		graphics::indexed_image_writer output_writer;
+		bool output_failed = false;
+
+		auto open_output = [&]() {
+			graphics::palette output_palette = make_output_palette(ctx);
+			output_failed = !output_writer.open(output_filename, output_format, width, height, output_palette, compression_level);
+		};
+
+		ctx.m_output_row_callback = [&](std::size_t p_y) {
+			if (p_y == 0)
+				open_output();
+			if (!output_failed)
+				output_failed = !output_writer.write_row(nonstd::span < std::uint8_t const > (graphics::at(ctx.m_output_image, 0, p_y), width));
+		};
+
+
 		fmt::print(stderr, "Input image: \"{}\"\n", input_filename);
 		fmt::print(stderr, "Output image: \"{}\"\n", output_filename);
-		fmt::print(stderr, "Image size: {} x {}\n", graphics::width(ctx.m_input_image), graphics::height(ctx.m_input_image));
+		fmt::print(stderr, "Output format: {}\n", (output_format == graphics::indexed_image_format::png) ? "PNG" : "GIF");
+		fmt::print(stderr, "Image size: {} x {}\n", width, height);
 		fmt::print(stderr, "Dithering: {}\n", use_dithering ? "yes" : "no");
+		fmt::print(stderr, "Color metric: {}\n", to_string(ctx.m_color_metric));
+		fmt::print(stderr, "Alpha channel: {}\n", input_has_alpha ? "yes" : "no");
+		if (has_transparent_palette_entry(ctx))
+			fmt::print(stderr, "Alpha threshold for transparent palette entry: {}\n", ctx.m_alpha_threshold);
+		if (color_palette_cache)
+			fmt::print(stderr, "Palette cache: \"{}\"\n", color_palette_cache->get_directory());
 
 
-		if (!apply_color_quantization(ctx))
+		if (!color_quantizer->quantize(ctx))
 			return -1;
 
+		bool verification_failed = false;
+		if (verify_nearest_color)
+		{
+			nearest_color_verification_stats verification_stats = verify_nearest_color_lookups(
+				ctx,
+				verification_options,
+				color_quantizer->get_approximate_nearest_color_function(),
+				color_quantizer->is_nearest_color_function_exact()
+			);
+			print_nearest_color_verification_stats(verification_stats);
+			verification_failed = !check_nearest_color_verification_stats(verification_stats);
+		}
 
 		{
-			RGBQUAD *fb_palette = FreeImage_GetPalette(output_image.get_fibitmap());
+			base::allocation_stats const &allocation_stats = color_quantizer->get_allocation_stats();
+			fmt::print(stderr, "Scratch memory: {} heap allocations, {} bytes at peak\n", allocation_stats.m_num_heap_allocations, allocation_stats.m_peak_num_heap_bytes);
+			ctx.m_instrumentation.add_to_counter("scratch_heap_allocations", allocation_stats.m_num_heap_allocations);
+			ctx.m_instrumentation.add_to_counter("scratch_peak_bytes", allocation_stats.m_peak_num_heap_bytes);
+		}
 
-			for (std::size_t i = 0; i < ctx.m_palette.size(); ++i)
+		for (std::size_t i = 0; i < ctx.m_palette.size(); ++i)
+			fmt::print(stderr, "Palette index # {}: {}\n", i, to_string(convert_to_rgb(ctx.m_palette[i], ctx.m_color_metric)));
+		if (has_transparent_palette_entry(ctx))
+			fmt::print(stderr, "Palette index # {}: transparent\n", get_transparent_palette_index(ctx));
+
+		{
+			// Most of the output was already written during the mapping
+			// stage. This covers the rest.
+			base::scoped_stage_timer stage_timer(ctx.m_instrumentation, "encode");
+
+			// Images without rows never invoke the row callback.
+			if (!output_writer.is_open() && !output_failed)
+				open_output();
+
+			if (output_failed || !output_writer.close())
 			{
-				graphics::color const & palette_entry = ctx.m_palette[i];
-				fmt::print(stderr, "Palette index # {}: {}\n", i, to_string(palette_entry));
-				fb_palette[i].rgbRed   = std::min(std::max(int(palette_entry[0]), 0), 255);
-				fb_palette[i].rgbGreen = std::min(std::max(int(palette_entry[1]), 0), 255);
-				fb_palette[i].rgbBlue  = std::min(std::max(int(palette_entry[2]), 0), 255);
+				fmt::print(stderr, "Could not save output image to \"{}\"\n", output_filename);
+				return -1;
 			}
 		}
 
+		if (write_stats)
+		{
+			base::labelled_instrumentations image_instrumentations;
+			image_instrumentations.emplace_back(input_filename, std::move(ctx.m_instrumentation));
+			base::write_stats(stdout, stats_format, image_instrumentations);
+		}
 
-		if (!FreeImage_Save(FIF_GIF, output_image.get_fibitmap(), output_filename.c_str(), 0))
+		if (verification_failed)
 		{
-			fmt::print(stderr, "Could not save output image to \"{}\"\n", output_filename);
+			fmt::print(stderr, "Nearest color verification failed\n");
 			return -1;
 		}
-
-
-		// Cleanup.
-		teardown_color_quantization(ctx);
-	} 
+	}
 	catch (std::exception const &p_exception)
 	{
 		fmt::print(stderr, "Exception caught: {}\n", p_exception.what());
@@ -0,0 +1,358 @@
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include "fmt/format.h"
+#include "graphics/palette.hpp"
+#include "median_cut_quantizer.hpp"
+#include "input_histogram.hpp"
+#include "palette_cache.hpp"
+#include "palettized_output.hpp"
+#include "base/numeric.hpp"
+
+
+namespace
+{
+
+
+typedef median_cut_quantizer::entry median_cut_entry;
+typedef median_cut_quantizer::entries median_cut_vector;
+
+
+int find_largest_rgb_component_index(median_cut_vector::iterator p_begin, median_cut_vector::iterator p_end)
+{
+	graphics::color min_rgb, max_rgb;
+	for (auto iter = p_begin; iter != p_end; ++iter)
+	{
+		if (iter != p_begin)
+		{
+			for (int i = 0; i < graphics::color::num_channels; ++i)
+			{
+				min_rgb[i] = std::min(min_rgb[i], iter->m_color[i]);
+				max_rgb[i] = std::max(max_rgb[i], iter->m_color[i]);
+			}
+		}
+		else
+			min_rgb = max_rgb = iter->m_color;
+	}
+
+	int largest_range = -1;
+	int largest_rgb_component_idx = 0;
+	// Alpha is included, so that semi-transparent colors get their own
+	// boxes. For opaque images, its range is always 0.
+	for (int i = 0; i < graphics::color::num_channels; ++i)
+	{
+		int range = max_rgb[i] - min_rgb[i];
+		if (range > largest_range)
+		{
+			largest_range = range;
+			largest_rgb_component_idx = i;
+		}
+	}
+
+	return largest_rgb_component_idx;
+}
+
+
+void perform_median_cut(context &p_context, graphics::palette::iterator &p_palette_iter, median_cut_vector::iterator p_begin, median_cut_vector::iterator p_end, unsigned int p_level, unsigned int const p_num_levels)
+{
+	if (p_level == p_num_levels)
+	{
+		assert(p_palette_iter != end(p_context.m_palette));
+
+		std::size_t palette_index = std::distance(begin(p_context.m_palette), p_palette_iter);
+
+		graphics::color accumulated_colors { 0, 0, 0, 0 };
+		for (auto iter = p_begin; iter != p_end; ++iter)
+		{
+			accumulated_colors += iter->m_color;
+			iter->m_palette_index = palette_index;
+		}
+		accumulated_colors /= std::distance(p_begin, p_end);
+
+		*p_palette_iter = std::move(accumulated_colors);
+		p_palette_iter++;
+	}
+	else
+	{
+		int largest_rgb_component_idx = find_largest_rgb_component_index(p_begin, p_end);
+
+		std::sort(
+			p_begin, p_end,
+			[largest_rgb_component_idx](median_cut_entry const &p_first, median_cut_entry const &p_second) -> bool {
+				return p_first.m_color[largest_rgb_component_idx] < p_second.m_color[largest_rgb_component_idx];
+			}
+		);
+
+		std::size_t num_values = p_end - p_begin;
+		auto median_value_iter = (p_begin + num_values / 2);
+		int rgb_component_value = median_value_iter->m_color[largest_rgb_component_idx];
+
+		perform_median_cut(p_context, p_palette_iter, p_begin, median_value_iter, p_level + 1, p_num_levels);
+		perform_median_cut(p_context, p_palette_iter, median_value_iter, p_end, p_level + 1, p_num_levels);
+
+		median_value_iter->m_rgb_component_index = largest_rgb_component_idx;
+		median_value_iter->m_rgb_component_value = rgb_component_value;
+	}
+}
+
+
+void perform_median_cut(context &p_context, median_cut_vector::iterator p_begin, median_cut_vector::iterator p_end, unsigned int const p_num_levels)
+{
+	graphics::palette::iterator palette_iter = begin(p_context.m_palette);
+	perform_median_cut(p_context, palette_iter, std::move(p_begin), std::move(p_end), 0, p_num_levels);
+}
+
+
+median_cut_vector::const_iterator find_nearest_color(median_cut_vector::const_iterator p_begin, median_cut_vector::const_iterator p_end, graphics::color const &p_color, unsigned int const p_num_levels, unsigned int p_level = 0)
+{
+	if (p_level == p_num_levels)
+	{
+		return p_begin;
+	}
+	else
+	{
+		std::size_t num_values = p_end - p_begin;
+		auto median_value_iter = (p_begin + num_values / 2);
+
+		if (p_color[median_value_iter->m_rgb_component_index] < median_value_iter->m_rgb_component_value)
+			return find_nearest_color(p_begin, median_value_iter, p_color, p_num_levels, p_level + 1);
+		else
+			return find_nearest_color(median_value_iter, p_end, p_color, p_num_levels, p_level + 1);
+	}
+}
+
+
+// Like find_nearest_color() above, but searches the boxes on the other
+// side of a splitting plane too if they may contain a nearer palette
+// color. The palette color of a box lies within the box, since it is
+// the average of the box's colors. Every color on the other side of a
+// plane is at least as far away as the point where the plane crosses
+// the channel's axis through p_color, so the lower bound distance to
+// that point decides whether that side is searched. Among equally near
+// palette colors, the one with the lowest index is returned, like
+// graphics::find_nearest_color() does.
+void find_nearest_color(
+	median_cut_vector::const_iterator p_begin,
+	median_cut_vector::const_iterator p_end,
+	graphics::color const &p_color,
+	unsigned int const p_num_levels,
+	std::pmr::vector < graphics::color > const &p_palette_colors,
+	graphics::color_metric const p_color_metric,
+	std::size_t &p_nearest_palette_index,
+	long &p_nearest_distance,
+	unsigned int p_level = 0
+)
+{
+	if (p_level == p_num_levels)
+	{
+		std::size_t palette_index = p_begin->m_palette_index;
+		long distance = calculate_color_distance(p_palette_colors[palette_index], p_color, p_color_metric);
+		if ((distance < p_nearest_distance) || ((distance == p_nearest_distance) && (palette_index < p_nearest_palette_index)))
+		{
+			p_nearest_palette_index = palette_index;
+			p_nearest_distance = distance;
+		}
+	}
+	else
+	{
+		std::size_t num_values = p_end - p_begin;
+		auto median_value_iter = (p_begin + num_values / 2);
+		int rgb_component_index = median_value_iter->m_rgb_component_index;
+		int rgb_component_value = median_value_iter->m_rgb_component_value;
+
+		// The sides are split at the median entry, so the lower side has
+		// values up to the median value, and the upper side has values
+		// from it on. Either way, the other side is no closer than the
+		// plane through the median value.
+		bool is_in_lower_side = (p_color[rgb_component_index] < rgb_component_value);
+		graphics::color plane_color = p_color;
+		plane_color[rgb_component_index] = rgb_component_value;
+
+		if (is_in_lower_side)
+			find_nearest_color(p_begin, median_value_iter, p_color, p_num_levels, p_palette_colors, p_color_metric, p_nearest_palette_index, p_nearest_distance, p_level + 1);
+		else
+			find_nearest_color(median_value_iter, p_end, p_color, p_num_levels, p_palette_colors, p_color_metric, p_nearest_palette_index, p_nearest_distance, p_level + 1);
+
+		// Ties are searched too, because of the lowest index rule.
+		if (calculate_lower_bound_color_distance(p_color, plane_color, p_color_metric) > p_nearest_distance)
+			return;
+
+		if (is_in_lower_side)
+			find_nearest_color(median_value_iter, p_end, p_color, p_num_levels, p_palette_colors, p_color_metric, p_nearest_palette_index, p_nearest_distance, p_level + 1);
+		else
+			find_nearest_color(p_begin, median_value_iter, p_color, p_num_levels, p_palette_colors, p_color_metric, p_nearest_palette_index, p_nearest_distance, p_level + 1);
+	}
+}
+
+
+} // unnamed namespace end
+
+
+median_cut_quantizer_options::median_cut_quantizer_options()
+	: m_palette_size(256)
+	, m_use_median_cut_for_nearest_color(false)
+	, m_refine_median_cut_nearest_color(false)
+	, m_num_refinement_iterations(0)
+{
+}
+
+
+bool check_options(median_cut_quantizer_options const &p_options)
+{
+	if ((p_options.m_palette_size < 2) || (p_options.m_palette_size > 256))
+	{
+		fmt::print(stderr, "Invalid palette size {}; valid range is 2-256\n", p_options.m_palette_size);
+		return false;
+	}
+
+	if ((p_options.m_palette_size & (p_options.m_palette_size - 1)) != 0)
+	{
+		fmt::print(stderr, "Invalid palette size {}; must be a power-of-two\n", p_options.m_palette_size);
+		return false;
+	}
+
+	if (p_options.m_refine_median_cut_nearest_color && !p_options.m_use_median_cut_for_nearest_color)
+	{
+		fmt::print(stderr, "Refining the median-cut nearest color search requires using median cut for nearest color\n");
+		return false;
+	}
+
+	if ((p_options.m_num_refinement_iterations > 0) && p_options.m_use_median_cut_for_nearest_color)
+	{
+		fmt::print(stderr, "Refining the palette with k-means cannot be combined with using median cut for nearest color\n");
+		return false;
+	}
+
+	return true;
+}
+
+
+median_cut_quantizer::median_cut_quantizer(median_cut_quantizer_options const &p_options)
+	: m_options(p_options)
+	, m_unique_input_colors(m_scratch_arena.get_memory_resource())
+	, m_num_levels(0)
+	, m_palette_colors(m_scratch_arena.get_memory_resource())
+	, m_color_metric(graphics::color_metric::rgb_low_cost)
+	, m_refiner(m_scratch_arena.get_memory_resource())
+	, m_palettized_output_buffers(m_scratch_arena.get_memory_resource())
+{
+}
+
+
+bool median_cut_quantizer::compute_palette(context &p_context)
+{
+	// Median cut produces a power-of-two number of entries. If palette
+	// entries are reserved for other purposes (like transparency), the
+	// palette shrinks, so round it down to the next power-of-two.
+	// (Lossless palettes are not limited to a power-of-two.)
+	std::size_t const max_num_palette_entries = m_options.m_palette_size - (has_transparent_palette_entry(p_context) ? 1 : 0);
+	std::size_t num_palette_entries = max_num_palette_entries;
+	unsigned int num_levels = base::calculate_num_significant_bits(num_palette_entries) - 1;
+	if (num_palette_entries != (std::size_t(1) << num_levels))
+	{
+		num_palette_entries = std::size_t(1) << num_levels;
+		fmt::print(stderr, "Reduced number of quantized colors to {} to keep it a power-of-two\n", num_palette_entries);
+	}
+
+	p_context.m_palette.m_colors.assign(num_palette_entries, graphics::color{0, 0, 0});
+
+	// This is reused across calls, so its capacity is retained.
+	median_cut_vector &unique_input_colors = m_unique_input_colors;
+	unique_input_colors.clear();
+
+	// The histogram is kept for the k-means refinement.
+	graphics::color_histogram temp_color_histogram(m_scratch_arena.get_memory_resource());
+	if (compute_input_histogram(p_context, temp_color_histogram, max_num_palette_entries, m_palettized_output_buffers))
+		return true;
+
+	unique_input_colors.resize(temp_color_histogram.size());
+
+	std::transform(
+		temp_color_histogram.begin(), temp_color_histogram.end(),
+		unique_input_colors.begin(),
+		[](graphics::color_histogram::value_type const &p_histogram_value) -> median_cut_entry { return median_cut_entry { p_histogram_value.first, 0, 0, 0 }; }
+	);
+
+	base::scoped_stage_timer stage_timer(p_context.m_instrumentation, "palette");
+
+	perform_median_cut(p_context, unique_input_colors.begin(), unique_input_colors.end(), num_levels);
+	m_num_levels = num_levels;
+	m_palette_colors.assign(p_context.m_palette.m_colors.begin(), p_context.m_palette.m_colors.end());
+	m_color_metric = p_context.m_color_metric;
+
+	if (m_options.m_num_refinement_iterations > 0)
+		m_refiner.refine_palette(p_context, temp_color_histogram, m_options.m_num_refinement_iterations, m_palettized_output_buffers);
+
+	store_palette_in_cache(p_context, m_palettized_output_buffers);
+
+
+	return true;
+}
+
+
+bool median_cut_quantizer::map_pixels(context &p_context)
+{
+	base::scoped_stage_timer stage_timer(p_context.m_instrumentation, "mapping");
+
+	std::function < std::size_t(graphics::color const &p_color) > find_nearest_color_func;
+	if (m_options.m_use_median_cut_for_nearest_color)
+		find_nearest_color_func = get_approximate_nearest_color_function();
+
+
+	auto output_stats = produce_palettized_output(
+		p_context,
+		m_palettized_output_buffers,
+		make_progress_report(p_context, "Determining pixels of output image"),
+		std::move(find_nearest_color_func)
+	);
+	if (p_context.m_show_progress)
+		fmt::print(stderr, "\n");
+	print_palettized_output_stats(output_stats);
+
+
+	return true;
+}
+
+
+bool median_cut_quantizer::is_nearest_color_function_exact() const
+{
+	// The refined search visits every side that may hold a color at
+	// least as near as the nearest one found so far.
+	return m_options.m_refine_median_cut_nearest_color;
+}
+
+
+std::function < std::size_t(graphics::color const &p_color) > median_cut_quantizer::get_approximate_nearest_color_function() const
+{
+	// The partitioned colors from compute_palette(). They are
+	// empty if the image got a lossless palette instead.
+	median_cut_vector const &unique_input_colors = m_unique_input_colors;
+	unsigned int const num_levels = m_num_levels;
+
+	// The partitioning does not match a refined palette.
+	if (unique_input_colors.empty() || (m_options.m_num_refinement_iterations > 0))
+		return std::function < std::size_t(graphics::color const &p_color) > ();
+
+	if (m_options.m_refine_median_cut_nearest_color)
+	{
+		// Only this is captured, so that the lambda fits into the small
+		// buffer of std::function, and mapping an image does not allocate.
+		return [this](graphics::color const &p_color) -> std::size_t {
+			std::size_t nearest_palette_index = 0;
+			long nearest_distance = std::numeric_limits < long > ::max();
+			find_nearest_color(m_unique_input_colors.cbegin(), m_unique_input_colors.cend(), p_color, m_num_levels, m_palette_colors, m_color_metric, nearest_palette_index, nearest_distance);
+			return nearest_palette_index;
+		};
+	}
+
+	return [&unique_input_colors, num_levels](graphics::color const &p_color) -> std::size_t {
+		auto iter = find_nearest_color(unique_input_colors.cbegin(), unique_input_colors.cend(), p_color, num_levels);
+		return iter->m_palette_index;
+	};
+}
+
+
+std::unique_ptr < quantizer > median_cut_quantizer::clone() const
+{
+	return std::unique_ptr < quantizer > (new median_cut_quantizer(m_options));
+}
@@ -0,0 +1,75 @@
+#ifndef COLOR_QUANTIZATION_MEDIAN_CUT_QUANTIZER_HPP______
+#define COLOR_QUANTIZATION_MEDIAN_CUT_QUANTIZER_HPP______
+
+#include <cstddef>
+#include <memory_resource>
+#include <vector>
+#include "graphics/color.hpp"
+#include "graphics/color_metric.hpp"
+#include "k_means_refinement.hpp"
+#include "palettized_output.hpp"
+#include "quantizer.hpp"
+
+
+struct median_cut_quantizer_options
+{
+	// Valid range: 2-256. Must be a power-of-two.
+	std::size_t m_palette_size;
+	// Reuse the median-cut partitioning for determining the nearest
+	// color. Faster, but less accurate than the default method.
+	bool m_use_median_cut_for_nearest_color;
+	// Makes the median-cut partitioning find the actual nearest color:
+	// after the box that contains the color, the boxes on the other
+	// side of each splitting plane are searched too, unless the plane
+	// is further away than the nearest color found so far. Requires
+	// m_use_median_cut_for_nearest_color.
+	bool m_refine_median_cut_nearest_color;
+	// Number of k-means iterations that refine the median-cut palette
+	// (see k_means_refiner::refine_palette()). 0 disables refinement.
+	// The median-cut partitioning does not match the refined palette,
+	// so this cannot be combined with m_use_median_cut_for_nearest_color.
+	unsigned int m_num_refinement_iterations;
+
+	median_cut_quantizer_options();
+};
+
+
+bool check_options(median_cut_quantizer_options const &p_options);
+
+
+class median_cut_quantizer
+	: public quantizer
+{
+public:
+	struct entry
+	{
+		graphics::color m_color;
+		int m_rgb_component_index;
+		int m_rgb_component_value;
+		int m_palette_index;
+	};
+
+	typedef std::pmr::vector < entry > entries;
+
+	explicit median_cut_quantizer(median_cut_quantizer_options const &p_options = median_cut_quantizer_options());
+
+	bool compute_palette(context &p_context) override;
+	bool map_pixels(context &p_context) override;
+	std::function < std::size_t(graphics::color const &p_color) > get_approximate_nearest_color_function() const override;
+	bool is_nearest_color_function_exact() const override;
+	std::unique_ptr < quantizer > clone() const override;
+
+
+private:
+	median_cut_quantizer_options m_options;
+
+	entries m_unique_input_colors;
+	unsigned int m_num_levels;
+	std::pmr::vector < graphics::color > m_palette_colors;
+	graphics::color_metric m_color_metric;
+	k_means_refiner m_refiner;
+	palettized_output_buffers m_palettized_output_buffers;
+};
+
+
+#endif // COLOR_QUANTIZATION_MEDIAN_CUT_QUANTIZER_HPP______
@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include "fmt/format.h"
+#include "graphics/color_metric.hpp"
+#include "graphics/palette.hpp"
+#include "nearest_color_verification.hpp"
+
+
+namespace
+{
+
+
+typedef std::function < std::size_t(graphics::color const &p_color) > lookup_function;
+
+
+double get_seconds_since(std::chrono::steady_clock::time_point const &p_start_time_point)
+{
+	return std::chrono::duration < double > (std::chrono::steady_clock::now() - p_start_time_point).count();
+}
+
+
+// Random colors in RGB, converted to the color space of the metric, so
+// that they cover the same range as the image colors. Images without a
+// transparent palette entry are treated as opaque.
+void generate_random_colors(context const &p_context, std::size_t const p_num_colors, unsigned int const p_random_seed, std::vector < graphics::color > &p_colors)
+{
+	std::mt19937 random_generator(p_random_seed);
+	std::uniform_int_distribution < int > channel_distribution(0, 255);
+	std::uniform_int_distribution < int > alpha_distribution(p_context.m_alpha_threshold, 255);
+	bool has_alpha = has_transparent_palette_entry(p_context);
+
+	p_colors.resize(p_num_colors);
+	for (auto &test_color : p_colors)
+	{
+		int r = channel_distribution(random_generator);
+		int g = channel_distribution(random_generator);
+		int b = channel_distribution(random_generator);
+		int a = has_alpha ? alpha_distribution(random_generator) : 255;
+		test_color = convert_from_rgb(graphics::color{r, g, b, a}, p_context.m_color_metric);
+	}
+}
+
+
+// Pixels that the mapping assigns to the transparent palette
+// entry are skipped, since no nearest color is looked up for them.
+template < std::size_t NumChannels, graphics::channel_order ChannelOrder >
+void read_image_colors_for_layout(context const &p_context, std::size_t const p_max_num_colors, std::vector < graphics::color > &p_colors)
+{
+	std::size_t width = graphics::width(p_context.m_input_image);
+	std::size_t height = graphics::height(p_context.m_input_image);
+	std::size_t num_pixels = width * height;
+	std::size_t step = (p_max_num_colors > 0) ? std::max((num_pixels + p_max_num_colors - 1) / p_max_num_colors, std::size_t(1)) : (num_pixels + 1);
+
+	p_colors.clear();
+	for (std::size_t i = 0; i < num_pixels; i += step)
+	{
+		std::uint8_t const *pixel_data = graphics::at(p_context.m_input_image, i % width, i / width);
+		graphics::color pixel_color = graphics::read_pixel_color < NumChannels, ChannelOrder > (pixel_data);
+		if (pixel_color.alpha() < p_context.m_alpha_threshold)
+			continue;
+
+		p_colors.push_back(convert_from_rgb(pixel_color, p_context.m_color_metric));
+	}
+}
+
+
+void read_image_colors(context const &p_context, std::size_t const p_max_num_colors, std::vector < graphics::color > &p_colors)
+{
+	graphics::dispatch_pixel_layout(p_context.m_input_image, [&](auto p_num_channels, auto p_channel_order) {
+		read_image_colors_for_layout < decltype(p_num_channels)::value, decltype(p_channel_order)::value > (p_context, p_max_num_colors, p_colors);
+	});
+}
+
+
+nearest_color_lookup_stats compare_with_reference(
+	context const &p_context,
+	char const *p_lookup_name,
+	char const *p_test_colors_name,
+	bool const p_is_exact,
+	std::vector < graphics::color > const &p_test_colors,
+	std::vector < std::size_t > const &p_reference_palette_indices,
+	std::vector < std::size_t > const &p_palette_indices,
+	double const p_time
+)
+{
+	nearest_color_lookup_stats stats { p_lookup_name, p_test_colors_name, p_is_exact, (unsigned long)(p_test_colors.size()), 0, 0, p_time };
+
+	for (std::size_t i = 0; i < p_test_colors.size(); ++i)
+	{
+		std::size_t reference_palette_index = p_reference_palette_indices[i];
+		std::size_t palette_index = p_palette_indices[i];
+		if (palette_index == reference_palette_index)
+			continue;
+
+		++stats.m_num_mismatches;
+
+		long reference_distance = calculate_color_distance(p_context.m_palette[reference_palette_index], p_test_colors[i], p_context.m_color_metric);
+		long distance = calculate_color_distance(p_context.m_palette[palette_index], p_test_colors[i], p_context.m_color_metric);
+		if (distance == reference_distance)
+			++stats.m_num_tie_mismatches;
+	}
+
+	return stats;
+}
+
+
+void verify_lookups(
+	context const &p_context,
+	graphics::palette_index const &p_palette_index,
+	lookup_function const &p_approximate_lookup,
+	bool const p_is_approximate_lookup_exact,
+	char const *p_test_colors_name,
+	std::vector < graphics::color > const &p_test_colors,
+	nearest_color_verification_stats &p_stats
+)
+{
+	std::size_t const num_test_colors = p_test_colors.size();
+	std::vector < std::size_t > reference_palette_indices(num_test_colors);
+	std::vector < std::size_t > palette_indices(num_test_colors);
+
+	auto run_lookups = [&](char const *p_lookup_name, bool const p_is_exact, std::vector < std::size_t > &p_palette_indices, auto const &p_lookup) {
+		auto start_time_point = std::chrono::steady_clock::now();
+		p_lookup(p_palette_indices);
+		double time = get_seconds_since(start_time_point);
+		p_stats.push_back(compare_with_reference(p_context, p_lookup_name, p_test_colors_name, p_is_exact, p_test_colors, reference_palette_indices, p_palette_indices, time));
+	};
+
+	run_lookups("linear scan", true, reference_palette_indices, [&](std::vector < std::size_t > &p_palette_indices) {
+		for (std::size_t i = 0; i < num_test_colors; ++i)
+			p_palette_indices[i] = find_nearest_color(p_context.m_palette, p_test_colors[i], p_context.m_color_metric);
+	});
+
+	run_lookups("palette index", true, palette_indices, [&](std::vector < std::size_t > &p_palette_indices) {
+		for (std::size_t i = 0; i < num_test_colors; ++i)
+			p_palette_indices[i] = find_nearest_color(p_palette_index, p_test_colors[i]);
+	});
+
+	// Like the mapping does it, each lookup starts at the previous result.
+	run_lookups("palette index, seeded", true, palette_indices, [&](std::vector < std::size_t > &p_palette_indices) {
+		std::size_t prev_palette_index = 0;
+		for (std::size_t i = 0; i < num_test_colors; ++i)
+			p_palette_indices[i] = prev_palette_index = find_nearest_color(p_palette_index, p_test_colors[i], prev_palette_index);
+	});
+
+	run_lookups("palette index, batch", true, palette_indices, [&](std::vector < std::size_t > &p_palette_indices) {
+		find_nearest_colors(p_palette_index, p_test_colors, p_palette_indices);
+	});
+
+	if (p_approximate_lookup)
+	{
+		run_lookups("quantizer", p_is_approximate_lookup_exact, palette_indices, [&](std::vector < std::size_t > &p_palette_indices) {
+			for (std::size_t i = 0; i < num_test_colors; ++i)
+				p_palette_indices[i] = p_approximate_lookup(p_test_colors[i]);
+		});
+	}
+}
+
+
+std::string make_counter_name(nearest_color_lookup_stats const &p_lookup_stats, char const *p_suffix)
+{
+	std::string name = fmt::format("verify_{}_{}_{}", p_lookup_stats.m_lookup_name, p_lookup_stats.m_test_colors_name, p_suffix);
+	name.erase(std::remove(name.begin(), name.end(), ','), name.end());
+	std::replace(name.begin(), name.end(), ' ', '_');
+
+	return name;
+}
+
+
+} // unnamed namespace end
+
+
+nearest_color_verification_options::nearest_color_verification_options()
+	: m_num_random_colors(100000)
+	, m_max_num_image_colors(1000000)
+	, m_random_seed(1)
+{
+}
+
+
+nearest_color_verification_stats verify_nearest_color_lookups(
+	context &p_context,
+	nearest_color_verification_options const &p_options,
+	std::function < std::size_t(graphics::color const &p_color) > const &p_approximate_lookup,
+	bool const p_is_approximate_lookup_exact
+)
+{
+	nearest_color_verification_stats stats;
+	if (p_context.m_palette.size() == 0)
+		return stats;
+
+	graphics::palette_index palette_index(p_context.m_palette, p_context.m_color_metric);
+	std::vector < graphics::color > test_colors;
+
+	generate_random_colors(p_context, p_options.m_num_random_colors, p_options.m_random_seed, test_colors);
+	verify_lookups(p_context, palette_index, p_approximate_lookup, p_is_approximate_lookup_exact, "random", test_colors, stats);
+
+	read_image_colors(p_context, p_options.m_max_num_image_colors, test_colors);
+	verify_lookups(p_context, palette_index, p_approximate_lookup, p_is_approximate_lookup_exact, "image", test_colors, stats);
+
+	for (auto const &lookup_stats : stats)
+	{
+		p_context.m_instrumentation.add_to_counter(make_counter_name(lookup_stats, "lookups").c_str(), lookup_stats.m_num_lookups);
+		p_context.m_instrumentation.add_to_counter(make_counter_name(lookup_stats, "mismatches").c_str(), lookup_stats.m_num_mismatches);
+		p_context.m_instrumentation.add_to_counter(make_counter_name(lookup_stats, "tie_mismatches").c_str(), lookup_stats.m_num_tie_mismatches);
+		p_context.m_instrumentation.add_to_counter(make_counter_name(lookup_stats, "nanoseconds").c_str(), (unsigned long long)(lookup_stats.m_time * 1e9));
+	}
+
+	return stats;
+}
+
+
+void print_nearest_color_verification_stats(nearest_color_verification_stats const &p_stats)
+{
+	fmt::print(stderr, "Nearest color lookups, compared with the linear scan:\n");
+
+	for (auto const &lookup_stats : p_stats)
+	{
+		unsigned long num_lookups = lookup_stats.m_num_lookups;
+		double mismatch_rate = (num_lookups > 0) ? (double(lookup_stats.m_num_mismatches) * 100.0 / num_lookups) : 0.0;
+		double nanoseconds_per_lookup = (num_lookups > 0) ? (lookup_stats.m_time * 1e9 / num_lookups) : 0.0;
+
+		fmt::print(
+			stderr,
+			"  {} ({} colors): {} lookups, {:.1f} ns per lookup, {} mismatches ({:.3f}%, {} of them ties){}\n",
+			lookup_stats.m_lookup_name,
+			lookup_stats.m_test_colors_name,
+			num_lookups,
+			nanoseconds_per_lookup,
+			lookup_stats.m_num_mismatches,
+			mismatch_rate,
+			lookup_stats.m_num_tie_mismatches,
+			(lookup_stats.m_is_exact && (lookup_stats.m_num_mismatches > 0)) ? "  <-- NOT EXACT" : ""
+		);
+	}
+}
+
+
+bool check_nearest_color_verification_stats(nearest_color_verification_stats const &p_stats)
+{
+	for (auto const &lookup_stats : p_stats)
+	{
+		if (lookup_stats.m_is_exact && (lookup_stats.m_num_mismatches > 0))
+			return false;
+	}
+
+	return true;
+}
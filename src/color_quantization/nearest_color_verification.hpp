@@ -0,0 +1,80 @@
+#ifndef COLOR_QUANTIZATION_NEAREST_COLOR_VERIFICATION_HPP______
+#define COLOR_QUANTIZATION_NEAREST_COLOR_VERIFICATION_HPP______
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+#include "graphics/color.hpp"
+#include "context.hpp"
+
+
+// Verification and benchmark mode for the nearest color lookups.
+//
+// The reference is graphics::find_nearest_color(palette, color, metric),
+// a linear scan over the palette in which the lowest palette index wins
+// ties. Every other lookup is run on the same test colors, and its
+// results are compared with those of the reference.
+//
+// There are two sets of test colors: uniformly random colors, and
+// colors of the input image's pixels, in raster order. The latter are
+// what the mapping actually looks up; they are coherent and cluster
+// around the palette entries, which is where the fast paths and their
+// pruning behave differently than with random colors.
+//
+// A mismatch is a result with a different palette index than that of
+// the reference. It is a tie if its distance is the same as that of the
+// reference's result; otherwise, the lookup returned a color that is
+// actually further away.
+
+
+struct nearest_color_verification_options
+{
+	// Number of random test colors.
+	std::size_t m_num_random_colors;
+	// Maximum number of image test colors. If the image has more
+	// pixels, they are sampled at regular intervals.
+	std::size_t m_max_num_image_colors;
+	unsigned int m_random_seed;
+
+	nearest_color_verification_options();
+};
+
+
+struct nearest_color_lookup_stats
+{
+	char const *m_lookup_name;
+	char const *m_test_colors_name;
+	// Lookups that claim to be exact must not have any mismatches,
+	// not even ties.
+	bool m_is_exact;
+	unsigned long m_num_lookups;
+	unsigned long m_num_mismatches;
+	unsigned long m_num_tie_mismatches;
+	// In seconds, for all lookups.
+	double m_time;
+};
+
+typedef std::vector < nearest_color_lookup_stats > nearest_color_verification_stats;
+
+
+// Runs all nearest color lookups on the test colors, using the palette
+// and the color metric of p_context. This must be called after the
+// palette was computed. p_approximate_lookup is the quantizer's own
+// approximate lookup, if it has one (see quantizer), and
+// p_is_approximate_lookup_exact tells whether that lookup has to match
+// the exact one (see nearest_color_lookup_stats). The results are
+// also added as counters to the context's instrumentation.
+nearest_color_verification_stats verify_nearest_color_lookups(
+	context &p_context,
+	nearest_color_verification_options const &p_options,
+	std::function < std::size_t(graphics::color const &p_color) > const &p_approximate_lookup,
+	bool const p_is_approximate_lookup_exact
+);
+
+void print_nearest_color_verification_stats(nearest_color_verification_stats const &p_stats);
+
+// Returns false if an exact lookup had mismatches.
+bool check_nearest_color_verification_stats(nearest_color_verification_stats const &p_stats);
+
+
+#endif // COLOR_QUANTIZATION_NEAREST_COLOR_VERIFICATION_HPP______
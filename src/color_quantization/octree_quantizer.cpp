@@ -0,0 +1,680 @@
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include "fmt/format.h"
+#include "octree_quantizer.hpp"
+#include "input_histogram.hpp"
+#include "palette_cache.hpp"
+#include "palettized_output.hpp"
+#include "base/numeric.hpp"
+
+
+namespace
+{
+
+
+typedef octree_quantizer::octree octree;
+
+
+typedef octree_quantizer::morton_entry morton_entry;
+typedef octree_quantizer::morton_entries morton_entries;
+
+
+unsigned int const num_octree_levels = 8;
+unsigned int const num_octants = 8;
+
+
+// Array index of the first node of each level. The children of the
+// node at index i are at 8*i+1 to 8*i+8, so the nodes of level l
+// start at (8^l - 1) / 7, and a node's index within its level is
+// the Morton key prefix of its path.
+std::size_t get_level_offset(unsigned int const p_level)
+{
+	return ((std::size_t(1) << (3 * p_level)) - 1) / 7;
+}
+
+
+// Morton key prefix of the node that contains p_key at p_level.
+std::uint32_t get_key_prefix(std::uint32_t const p_key, unsigned int const p_level)
+{
+	return p_key >> (3 * (num_octree_levels - p_level));
+}
+
+
+// Spreads the 8 bits of a channel value 3 bits apart.
+std::uint32_t spread_bits(int const p_value)
+{
+	std::uint32_t spread_value = 0;
+	for (unsigned int bit = 0; bit < 8; ++bit)
+		spread_value |= std::uint32_t((p_value >> bit) & 0x1) << (3 * bit);
+	return spread_value;
+}
+
+
+// Interleaves the red, green and blue bits, with red as the most
+// significant bit of each level's child index. Alpha is not part of
+// the octree.
+std::uint32_t make_morton_key(graphics::color const &p_color)
+{
+	return (spread_bits(p_color[0]) << 2) | (spread_bits(p_color[1]) << 1) | spread_bits(p_color[2]);
+}
+
+
+// Stable LSD radix sort of p_entries by the lower 21 bits of their keys
+// (the top 3 bits, the octant, are the same for all entries), in three
+// passes of 7 bits. p_temp_entries must be as large as p_entries. The
+// sorted entries end up in p_temp_entries.
+void sort_octant_entries(morton_entry *p_entries, morton_entry *p_temp_entries, std::size_t const p_num_entries)
+{
+	unsigned int const num_pass_bits = 7;
+	std::size_t const num_buckets = std::size_t(1) << num_pass_bits;
+
+	morton_entry *source = p_entries;
+	morton_entry *destination = p_temp_entries;
+
+	for (unsigned int shift = 0; shift < (3 * num_pass_bits); shift += num_pass_bits)
+	{
+		std::size_t bucket_offsets[num_buckets] = { 0 };
+		for (std::size_t i = 0; i < p_num_entries; ++i)
+			++bucket_offsets[(source[i].m_key >> shift) & (num_buckets - 1)];
+
+		std::size_t offset = 0;
+		for (std::size_t bucket = 0; bucket < num_buckets; ++bucket)
+		{
+			std::size_t bucket_size = bucket_offsets[bucket];
+			bucket_offsets[bucket] = offset;
+			offset += bucket_size;
+		}
+
+		for (std::size_t i = 0; i < p_num_entries; ++i)
+			destination[bucket_offsets[(source[i].m_key >> shift) & (num_buckets - 1)]++] = source[i];
+
+		std::swap(source, destination);
+	}
+
+	// Three passes leave the result in the temporary entries.
+	assert(source == p_temp_entries);
+}
+
+
+// Where the nodes of an octant are written, and how many were written.
+struct octant_nodes
+{
+	std::size_t m_first_node_index;
+	std::size_t m_num_nodes;
+	std::size_t m_first_child_index;
+	std::size_t m_num_child_indices;
+	// The node that the root's child for this octant collapsed into,
+	// or invalid_node_index if the octant is empty.
+	std::uint32_t m_top_node_index;
+};
+
+
+// Builds the nodes of levels 1 to 8 for the sorted entries of one
+// octant, bottom-up: the entries are swept once, and whenever the
+// key prefix of a level changes, the node of that level is complete,
+// and is added to its parent node.
+//
+// A complete node is only written to the tree if it is a leaf or has
+// more than one child. A node with one child is the same as its child,
+// so it is left out, which collapses chains of such nodes. Written
+// nodes are pushed on a stack until their parent is written; since
+// the entries are sorted, the children of a node are the topmost ones
+// on the stack when it is complete, in the order of their keys.
+//
+// The nodes and child indices are written to the ranges given by
+// p_octant_nodes, which must already be allocated.
+void build_octant_nodes(octree &p_octree, morton_entry const *p_entries, std::size_t const p_num_entries, octant_nodes &p_octant_nodes)
+{
+	struct node_accumulator
+	{
+		std::uint32_t m_key_prefix;
+		std::size_t m_num_references;
+		graphics::color m_color;
+		unsigned int m_num_children;
+	};
+
+	p_octant_nodes.m_num_nodes = 0;
+	p_octant_nodes.m_num_child_indices = 0;
+	p_octant_nodes.m_top_node_index = octree::invalid_node_index;
+
+	if (p_num_entries == 0)
+		return;
+
+	node_accumulator accumulators[num_octree_levels + 1];
+	for (unsigned int level = 1; level <= num_octree_levels; ++level)
+		accumulators[level] = node_accumulator { get_key_prefix(p_entries[0].m_key, level), 0, graphics::color{0, 0, 0, 0}, 0 };
+
+	// At most 7 complete children per level wait for their parent,
+	// plus the leaf.
+	std::uint32_t pending_node_indices[(num_octants - 1) * num_octree_levels + 1];
+	std::size_t num_pending_nodes = 0;
+
+	auto complete_node = [&](unsigned int p_level) {
+		node_accumulator &accumulator = accumulators[p_level];
+		bool is_leaf = (p_level == num_octree_levels);
+
+		if (is_leaf || (accumulator.m_num_children > 1))
+		{
+			std::uint32_t node_index = std::uint32_t(p_octant_nodes.m_first_node_index + p_octant_nodes.m_num_nodes++);
+			octree::node &node = p_octree.m_nodes[node_index];
+			node.m_num_references = accumulator.m_num_references;
+			node.m_color = accumulator.m_color;
+			node.m_key_prefix = accumulator.m_key_prefix;
+			node.m_parent_node_index = octree::invalid_node_index;
+			node.m_first_child_index = std::uint32_t(p_octant_nodes.m_first_child_index + p_octant_nodes.m_num_child_indices);
+			node.m_level = std::uint8_t(p_level);
+			node.m_num_children = std::uint8_t(accumulator.m_num_children);
+			node.m_is_leaf = is_leaf;
+			node.m_palette_index = 0;
+
+			num_pending_nodes -= accumulator.m_num_children;
+			for (unsigned int i = 0; i < accumulator.m_num_children; ++i)
+			{
+				std::uint32_t child_node_index = pending_node_indices[num_pending_nodes + i];
+				p_octree.m_nodes[child_node_index].m_parent_node_index = node_index;
+				p_octree.m_child_node_indices[p_octant_nodes.m_first_child_index + p_octant_nodes.m_num_child_indices++] = child_node_index;
+			}
+
+			pending_node_indices[num_pending_nodes++] = node_index;
+		}
+
+		if (p_level > 1)
+		{
+			accumulators[p_level - 1].m_num_references += accumulator.m_num_references;
+			accumulators[p_level - 1].m_color += accumulator.m_color;
+			++accumulators[p_level - 1].m_num_children;
+		}
+	};
+
+	for (std::size_t i = 0; i < p_num_entries; ++i)
+	{
+		morton_entry const &entry = p_entries[i];
+
+		// If the node of a level changes, so do the nodes of all levels
+		// below it. These are completed from the bottom up, so that each
+		// one is added to its parent before the parent is completed.
+		unsigned int first_changed_level = 1;
+		while ((first_changed_level <= num_octree_levels) && (get_key_prefix(entry.m_key, first_changed_level) == accumulators[first_changed_level].m_key_prefix))
+			++first_changed_level;
+
+		for (unsigned int level = num_octree_levels; level >= first_changed_level; --level)
+		{
+			complete_node(level);
+			accumulators[level] = node_accumulator { get_key_prefix(entry.m_key, level), 0, graphics::color{0, 0, 0, 0}, 0 };
+		}
+
+		// Entries that only differ in alpha share their leaf.
+		accumulators[num_octree_levels].m_num_references += entry.m_weight;
+		accumulators[num_octree_levels].m_color += entry.m_color * int(entry.m_weight);
+	}
+
+	for (unsigned int level = num_octree_levels; level >= 1; --level)
+		complete_node(level);
+
+	assert(num_pending_nodes == 1);
+	p_octant_nodes.m_top_node_index = pending_node_indices[0];
+}
+
+
+std::size_t get_num_build_threads(std::size_t const p_num_requested_threads)
+{
+	std::size_t num_threads = p_num_requested_threads;
+	if (num_threads == 0)
+		num_threads = std::thread::hardware_concurrency();
+
+	return std::min(std::max(num_threads, std::size_t(1)), std::size_t(num_octants));
+}
+
+
+// Moves the nodes and child indices of the octants next to each other,
+// right after the root, and adjusts the node indices accordingly. All
+// node indices of an octant refer to nodes of the same octant, so they
+// all move by the same distance.
+void compact_octants(octree &p_octree, octant_nodes (&p_octant_nodes)[num_octants])
+{
+	std::size_t node_index = 1;
+	std::size_t child_index = 0;
+
+	for (auto &octant : p_octant_nodes)
+	{
+		std::uint32_t node_index_delta = std::uint32_t(octant.m_first_node_index - node_index);
+		std::uint32_t child_index_delta = std::uint32_t(octant.m_first_child_index - child_index);
+
+		for (std::size_t i = 0; i < octant.m_num_nodes; ++i)
+		{
+			octree::node node = p_octree.m_nodes[octant.m_first_node_index + i];
+			if (node.m_parent_node_index != octree::invalid_node_index)
+				node.m_parent_node_index -= node_index_delta;
+			node.m_first_child_index -= child_index_delta;
+			p_octree.m_nodes[node_index + i] = node;
+		}
+
+		for (std::size_t i = 0; i < octant.m_num_child_indices; ++i)
+			p_octree.m_child_node_indices[child_index + i] = p_octree.m_child_node_indices[octant.m_first_child_index + i] - node_index_delta;
+
+		if (octant.m_top_node_index != octree::invalid_node_index)
+			octant.m_top_node_index -= node_index_delta;
+
+		octant.m_first_node_index = node_index;
+		octant.m_first_child_index = child_index;
+		node_index += octant.m_num_nodes;
+		child_index += octant.m_num_child_indices;
+	}
+
+	p_octree.m_nodes.resize(node_index);
+	p_octree.m_child_node_indices.resize(child_index);
+}
+
+
+// Builds the octree from the histogram. The entries are sorted by their
+// Morton keys, first into their top-level octants, then within each
+// octant. Each octant is then built bottom-up. The octants do not share
+// any nodes except for the root, so they are sorted and built by
+// multiple threads. Only the main thread allocates memory, since the
+// scratch arena is not thread safe.
+void build_octree(
+	octree &p_octree,
+	graphics::color_histogram const &p_color_histogram,
+	morton_entries &p_entries,
+	morton_entries &p_temp_entries,
+	std::size_t const p_num_build_threads
+)
+{
+	p_octree.m_nodes.clear();
+	p_octree.m_child_node_indices.clear();
+	p_octree.m_num_leaves = 0;
+
+	if (p_color_histogram.empty())
+		return;
+
+	// Compute the keys, and distribute the entries to their octants.
+
+	std::size_t const num_entries = p_color_histogram.size();
+	p_entries.resize(num_entries);
+	p_temp_entries.resize(num_entries);
+
+	std::size_t octant_offsets[num_octants + 1] = { 0 };
+	{
+		std::size_t i = 0;
+		for (auto const &histogram_entry : p_color_histogram)
+		{
+			std::uint32_t key = make_morton_key(histogram_entry.first);
+			p_temp_entries[i++] = morton_entry { key, histogram_entry.first, histogram_entry.second };
+			++octant_offsets[get_key_prefix(key, 1) + 1];
+		}
+	}
+
+	for (std::size_t octant = 0; octant < num_octants; ++octant)
+		octant_offsets[octant + 1] += octant_offsets[octant];
+
+	{
+		std::size_t octant_positions[num_octants];
+		std::copy(octant_offsets, octant_offsets + num_octants, octant_positions);
+		for (auto const &entry : p_temp_entries)
+			p_entries[octant_positions[get_key_prefix(entry.m_key, 1)]++] = entry;
+	}
+
+	// An octant with n entries has at most n leaves, and since all other
+	// nodes have at least two children, less than n other nodes. Each
+	// octant gets room for 2n nodes and child indices; the root is
+	// the first node.
+	p_octree.m_nodes.resize(1 + 2 * num_entries);
+	p_octree.m_child_node_indices.resize(2 * num_entries);
+
+	octant_nodes octants[num_octants];
+	for (std::size_t octant = 0; octant < num_octants; ++octant)
+		octants[octant] = octant_nodes { 1 + 2 * octant_offsets[octant], 0, 2 * octant_offsets[octant], 0, octree::invalid_node_index };
+
+	// Sort and build the octants.
+
+	std::atomic < std::size_t > next_octant(0);
+	auto build_octants = [&]() {
+		while (true)
+		{
+			std::size_t octant = next_octant++;
+			if (octant >= num_octants)
+				break;
+
+			std::size_t begin = octant_offsets[octant];
+			std::size_t num_octant_entries = octant_offsets[octant + 1] - begin;
+			sort_octant_entries(&(p_entries[begin]), &(p_temp_entries[begin]), num_octant_entries);
+			build_octant_nodes(p_octree, &(p_temp_entries[begin]), num_octant_entries, octants[octant]);
+		}
+	};
+
+	std::size_t num_threads = std::min(get_num_build_threads(p_num_build_threads), num_entries);
+	std::vector < std::thread > threads;
+	for (std::size_t i = 1; i < num_threads; ++i)
+		threads.emplace_back(build_octants);
+	build_octants();
+	for (auto &thread : threads)
+		thread.join();
+
+	compact_octants(p_octree, octants);
+
+	// The root combines the octants. It is the only node that may have
+	// just one child.
+
+	octree::node &root_node = p_octree.m_nodes[0];
+	root_node = octree::node { 0, graphics::color{0, 0, 0, 0}, 0, octree::invalid_node_index, std::uint32_t(p_octree.m_child_node_indices.size()), 0, 0, false, 0 };
+	for (auto const &octant : octants)
+	{
+		if (octant.m_top_node_index == octree::invalid_node_index)
+			continue;
+
+		octree::node &top_node = p_octree.m_nodes[octant.m_top_node_index];
+		top_node.m_parent_node_index = 0;
+		root_node.m_num_references += top_node.m_num_references;
+		root_node.m_color += top_node.m_color;
+		++root_node.m_num_children;
+		p_octree.m_child_node_indices.push_back(octant.m_top_node_index);
+	}
+
+	for (auto const &node : p_octree.m_nodes)
+	{
+		if (node.m_is_leaf)
+			++p_octree.m_num_leaves;
+	}
+}
+
+
+// Reduces nodes until there are no more than p_max_num_leaves leaves.
+// A reduced node becomes a leaf that replaces its children. Deeper
+// nodes are reduced first, and of those, the ones with fewer references.
+// Since a node's children are deeper than the node, they are leaves
+// by the time the node is reduced.
+//
+// Returns the number of reduced nodes.
+std::size_t reduce_tree(octree &p_octree, std::pmr::vector < std::uint32_t > &p_node_indices, std::size_t const p_max_num_leaves, bool const p_show_progress)
+{
+	p_node_indices.clear();
+	for (std::size_t node_index = 0; node_index < p_octree.m_nodes.size(); ++node_index)
+	{
+		if (!p_octree.m_nodes[node_index].m_is_leaf)
+			p_node_indices.push_back(std::uint32_t(node_index));
+	}
+
+	std::sort(p_node_indices.begin(), p_node_indices.end(),
+		[&p_octree](std::uint32_t p_first, std::uint32_t p_second) -> bool {
+			octree::node const &first_node = p_octree.m_nodes[p_first];
+			octree::node const &second_node = p_octree.m_nodes[p_second];
+
+			if (first_node.m_level != second_node.m_level)
+				return (first_node.m_level > second_node.m_level);
+			if (first_node.m_num_references != second_node.m_num_references)
+				return (first_node.m_num_references < second_node.m_num_references);
+
+			return (first_node.m_key_prefix < second_node.m_key_prefix);
+		}
+	);
+
+	std::size_t num_reductions = 0;
+
+	std::chrono::steady_clock::time_point last_report_time_point;
+	while ((p_octree.m_num_leaves > p_max_num_leaves) && (num_reductions < p_node_indices.size()))
+	{
+		octree::node &node = p_octree.m_nodes[p_node_indices[num_reductions]];
+		assert(!node.m_is_leaf);
+
+		node.m_is_leaf = true;
+		p_octree.m_num_leaves -= node.m_num_children - 1;
+		++num_reductions;
+
+		if (!p_show_progress)
+			continue;
+
+		auto now = std::chrono::steady_clock::now();
+		auto time_since_last_report = now - last_report_time_point;
+
+		if ((time_since_last_report >= std::chrono::milliseconds{50}))
+		{
+			fmt::print(stderr, "remaining non-leaf nodes: {} remaining leaves: {}\n", p_node_indices.size() - num_reductions, p_octree.m_num_leaves);
+			last_report_time_point = now;
+		}
+	}
+
+	fmt::print(stderr, "remaining non-leaf nodes: {} remaining leaves: {}\n", p_node_indices.size() - num_reductions, p_octree.m_num_leaves);
+
+	return num_reductions;
+}
+
+
+// The leaves that remain after the reduction (the ones whose parent was
+// not reduced). They are ordered like in an uncompressed octree, level
+// by level, with the level of a collapsed node being that of the top of
+// its chain.
+void get_remaining_leaves(octree const &p_octree, std::pmr::vector < std::uint32_t > &p_node_indices)
+{
+	auto get_array_index = [&p_octree](std::uint32_t p_node_index) -> std::size_t {
+		octree::node const &node = p_octree.m_nodes[p_node_index];
+		unsigned int top_level = (node.m_parent_node_index == octree::invalid_node_index) ? 0 : (p_octree.m_nodes[node.m_parent_node_index].m_level + 1);
+		return get_level_offset(top_level) + (node.m_key_prefix >> (3 * (node.m_level - top_level)));
+	};
+
+	p_node_indices.clear();
+	for (std::size_t node_index = 0; node_index < p_octree.m_nodes.size(); ++node_index)
+	{
+		octree::node const &node = p_octree.m_nodes[node_index];
+		if (node.m_is_leaf && ((node.m_parent_node_index == octree::invalid_node_index) || !p_octree.m_nodes[node.m_parent_node_index].m_is_leaf))
+			p_node_indices.push_back(std::uint32_t(node_index));
+	}
+
+	std::sort(p_node_indices.begin(), p_node_indices.end(),
+		[&](std::uint32_t p_first, std::uint32_t p_second) -> bool {
+			return get_array_index(p_first) < get_array_index(p_second);
+		}
+	);
+}
+
+
+// Descends from the root to the leaf that contains p_color, and returns
+// its palette index. A node's child contains the color if its key prefix
+// matches that of the color; this also covers the levels that the child's
+// chain skips. If no child contains the color, it lies in a part of the
+// color space that had no input colors, and the descent continues with
+// the child whose average color is nearest instead.
+std::size_t find_nearest_color(octree const &p_octree, graphics::color const &p_color, graphics::color_metric const p_color_metric)
+{
+	std::uint32_t key = make_morton_key(p_color);
+	octree::node const *node = &(p_octree.m_nodes[0]);
+	bool is_key_in_node = true;
+
+	while (!node->m_is_leaf)
+	{
+		std::uint32_t const *child_node_indices = &(p_octree.m_child_node_indices[node->m_first_child_index]);
+		octree::node const *next_node = nullptr;
+
+		if (is_key_in_node)
+		{
+			for (unsigned int i = 0; i < node->m_num_children; ++i)
+			{
+				octree::node const &child_node = p_octree.m_nodes[child_node_indices[i]];
+				if (child_node.m_key_prefix == get_key_prefix(key, child_node.m_level))
+				{
+					next_node = &child_node;
+					break;
+				}
+			}
+		}
+
+		if (next_node == nullptr)
+		{
+			is_key_in_node = false;
+
+			long min_distance = 0;
+			for (unsigned int i = 0; i < node->m_num_children; ++i)
+			{
+				octree::node const &child_node = p_octree.m_nodes[child_node_indices[i]];
+				long distance = calculate_color_distance(child_node.m_color / int(child_node.m_num_references), p_color, p_color_metric);
+				if ((next_node == nullptr) || (distance < min_distance))
+				{
+					next_node = &child_node;
+					min_distance = distance;
+				}
+			}
+		}
+
+		node = next_node;
+	}
+
+	return node->m_palette_index;
+}
+
+
+} // unnamed namespace end
+
+
+octree_quantizer_options::octree_quantizer_options()
+	: m_palette_size(256)
+	, m_num_build_threads(0)
+	, m_use_octree_for_nearest_color(false)
+	, m_num_refinement_iterations(0)
+{
+}
+
+
+bool check_options(octree_quantizer_options const &p_options)
+{
+	if ((p_options.m_palette_size < 2) || (p_options.m_palette_size > 256))
+	{
+		fmt::print(stderr, "Invalid palette size {}; valid range is 2-256\n", p_options.m_palette_size);
+		return false;
+	}
+
+	if ((p_options.m_num_refinement_iterations > 0) && p_options.m_use_octree_for_nearest_color)
+	{
+		fmt::print(stderr, "Refining the palette with k-means cannot be combined with using the octree for nearest color\n");
+		return false;
+	}
+
+	return true;
+}
+
+
+octree_quantizer::octree_quantizer(octree_quantizer_options const &p_options)
+	: m_options(p_options)
+	, m_octree(m_scratch_arena.get_memory_resource())
+	, m_color_metric(graphics::color_metric::rgb_low_cost)
+	, m_morton_entries(m_scratch_arena.get_memory_resource())
+	, m_temp_morton_entries(m_scratch_arena.get_memory_resource())
+	, m_node_indices(m_scratch_arena.get_memory_resource())
+	, m_refiner(m_scratch_arena.get_memory_resource())
+	, m_palettized_output_buffers(m_scratch_arena.get_memory_resource())
+{
+}
+
+
+bool octree_quantizer::compute_palette(context &p_context)
+{
+	// This may be less than the palette size if palette entries
+	// are reserved for other purposes (like transparency).
+	std::size_t const num_palette_entries = m_options.m_palette_size - (has_transparent_palette_entry(p_context) ? 1 : 0);
+	p_context.m_palette.m_colors.assign(num_palette_entries, graphics::color{0, 0, 0});
+
+	// The octree is reused across calls, so its capacity is retained.
+	// It stays empty if the image gets a lossless palette.
+	octree &color_octree = m_octree;
+	color_octree.m_nodes.clear();
+	color_octree.m_child_node_indices.clear();
+	m_color_metric = p_context.m_color_metric;
+
+	// The histogram is kept for the k-means refinement.
+	graphics::color_histogram temp_color_histogram(m_scratch_arena.get_memory_resource());
+	if (compute_input_histogram(p_context, temp_color_histogram, num_palette_entries, m_palettized_output_buffers))
+		return true;
+
+	{
+		base::scoped_stage_timer stage_timer(p_context.m_instrumentation, "octree_build");
+		build_octree(color_octree, temp_color_histogram, m_morton_entries, m_temp_morton_entries, m_options.m_num_build_threads);
+	}
+
+	fmt::print(stderr, "{} source pixel entries\n", temp_color_histogram.size());
+	fmt::print(stderr, "{} octree nodes\n", color_octree.m_nodes.size());
+	fmt::print(stderr, "{} octree leaves\n", color_octree.m_num_leaves);
+	p_context.m_instrumentation.add_to_counter("octree_nodes", color_octree.m_nodes.size());
+
+
+	base::scoped_stage_timer stage_timer(p_context.m_instrumentation, "palette");
+
+	std::size_t num_reductions = reduce_tree(color_octree, m_node_indices, num_palette_entries, p_context.m_show_progress);
+	p_context.m_instrumentation.add_to_counter("octree_reductions", num_reductions);
+
+
+	get_remaining_leaves(color_octree, m_node_indices);
+
+	std::size_t i = 0;
+	for (std::uint32_t node_index : m_node_indices)
+	{
+		octree::node &leaf = color_octree.m_nodes[node_index];
+
+		if (leaf.m_num_references > 0)
+		{
+			p_context.m_palette[i] = leaf.m_color / leaf.m_num_references;
+			leaf.m_palette_index = std::uint8_t(i);
+			++i;
+		}
+	}
+
+	// A reduction can remove more than one leaf, so there may be fewer
+	// leaves than palette entries. The palette is shrunk to the leaves
+	// instead of padding it with black, which would not even be black
+	// in color metrics other than RGB.
+	p_context.m_palette.m_colors.resize(i);
+
+	if (m_options.m_num_refinement_iterations > 0)
+		m_refiner.refine_palette(p_context, temp_color_histogram, m_options.m_num_refinement_iterations, m_palettized_output_buffers);
+
+	store_palette_in_cache(p_context, m_palettized_output_buffers);
+
+
+	return true;
+}
+
+
+bool octree_quantizer::map_pixels(context &p_context)
+{
+	base::scoped_stage_timer stage_timer(p_context.m_instrumentation, "mapping");
+
+	std::function < std::size_t(graphics::color const &p_color) > find_nearest_color_func;
+	if (m_options.m_use_octree_for_nearest_color)
+		find_nearest_color_func = get_approximate_nearest_color_function();
+
+
+	auto output_stats = produce_palettized_output(
+		p_context,
+		m_palettized_output_buffers,
+		make_progress_report(p_context, "Determining pixels of output image"),
+		std::move(find_nearest_color_func)
+	);
+	if (p_context.m_show_progress)
+		fmt::print(stderr, "\n");
+	print_palettized_output_stats(output_stats);
+
+
+	return true;
+}
+
+
+std::function < std::size_t(graphics::color const &p_color) > octree_quantizer::get_approximate_nearest_color_function() const
+{
+	// The reduced octree from compute_palette(). It is
+	// empty if the image got a lossless palette instead.
+	octree const &color_octree = m_octree;
+	graphics::color_metric const color_metric = m_color_metric;
+
+	// The octree does not match a refined palette.
+	if (color_octree.m_nodes.empty() || (m_options.m_num_refinement_iterations > 0))
+		return std::function < std::size_t(graphics::color const &p_color) > ();
+
+	return [&color_octree, color_metric](graphics::color const &p_color) -> std::size_t {
+		return find_nearest_color(color_octree, p_color, color_metric);
+	};
+}
+
+
+std::unique_ptr < quantizer > octree_quantizer::clone() const
+{
+	return std::unique_ptr < quantizer > (new octree_quantizer(m_options));
+}
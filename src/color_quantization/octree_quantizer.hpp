@@ -0,0 +1,124 @@
+#ifndef COLOR_QUANTIZATION_OCTREE_QUANTIZER_HPP______
+#define COLOR_QUANTIZATION_OCTREE_QUANTIZER_HPP______
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <vector>
+#include "graphics/color.hpp"
+#include "graphics/color_metric.hpp"
+#include "k_means_refinement.hpp"
+#include "palettized_output.hpp"
+#include "quantizer.hpp"
+
+
+struct octree_quantizer_options
+{
+	// Valid range: 2-256.
+	std::size_t m_palette_size;
+	// Number of threads that build the octree. Each thread builds
+	// whole top-level octants, so more than 8 threads do not help.
+	// 0 means one thread per processor core (up to 8).
+	std::size_t m_num_build_threads;
+	// Reuse the reduced octree for determining the nearest color.
+	// Faster, but less accurate than the default method.
+	bool m_use_octree_for_nearest_color;
+	// Number of k-means iterations that refine the octree palette (see
+	// k_means_refiner::refine_palette()). 0 disables refinement. The
+	// octree does not match the refined palette, so this cannot be
+	// combined with m_use_octree_for_nearest_color.
+	unsigned int m_num_refinement_iterations;
+
+	octree_quantizer_options();
+};
+
+
+bool check_options(octree_quantizer_options const &p_options);
+
+
+class octree_quantizer
+	: public quantizer
+{
+public:
+	// Path-compressed octree. Chains of nodes with only one child are
+	// collapsed into the node at their bottom end, so apart from the
+	// root, every node is either a leaf (a unique RGB color at level 8)
+	// or has at least two children. A node's level is the level of its
+	// bottom end; its parent can be several levels above it. On sparse
+	// histograms (like those of photos), most of a plain octree's nodes
+	// are such chains.
+	//
+	// The root is always the first node. The children of a node are
+	// listed in m_child_node_indices, in the order of their keys.
+	struct octree
+	{
+		struct node
+		{
+			std::size_t m_num_references;
+			// Sum of the colors of all references.
+			graphics::color m_color;
+			// Morton key prefix of the node's path, 3 bits per level
+			// (see morton_entry).
+			std::uint32_t m_key_prefix;
+			std::uint32_t m_parent_node_index;
+			std::uint32_t m_first_child_index;
+			std::uint8_t m_level;
+			std::uint8_t m_num_children;
+			// Leaves at level 8, and nodes that were reduced.
+			bool m_is_leaf;
+			// Only valid in the leaves that became palette entries.
+			std::uint8_t m_palette_index;
+		};
+
+		enum : std::uint32_t { invalid_node_index = 0xFFFFFFFFu };
+
+		typedef std::pmr::vector < node > nodes;
+		nodes m_nodes;
+		std::pmr::vector < std::uint32_t > m_child_node_indices;
+		std::size_t m_num_leaves;
+
+		explicit octree(std::pmr::memory_resource *p_memory_resource = std::pmr::get_default_resource())
+			: m_nodes(p_memory_resource)
+			, m_child_node_indices(p_memory_resource)
+			, m_num_leaves(0)
+		{
+		}
+	};
+
+	// A histogram entry, along with the Morton key of its color: the
+	// child indices along the path from the root to the color's leaf,
+	// 3 bits per level, with the root's child index in the top bits.
+	// Sorting the entries by their keys puts the entries of every node
+	// next to each other, so the tree can be built bottom-up in one
+	// pass over the sorted entries.
+	struct morton_entry
+	{
+		std::uint32_t m_key;
+		graphics::color m_color;
+		std::size_t m_weight;
+	};
+
+	typedef std::pmr::vector < morton_entry > morton_entries;
+
+	explicit octree_quantizer(octree_quantizer_options const &p_options = octree_quantizer_options());
+
+	bool compute_palette(context &p_context) override;
+	bool map_pixels(context &p_context) override;
+	std::function < std::size_t(graphics::color const &p_color) > get_approximate_nearest_color_function() const override;
+	std::unique_ptr < quantizer > clone() const override;
+
+
+private:
+	octree_quantizer_options m_options;
+
+	octree m_octree;
+	graphics::color_metric m_color_metric;
+	morton_entries m_morton_entries;
+	morton_entries m_temp_morton_entries;
+	std::pmr::vector < std::uint32_t > m_node_indices;
+	k_means_refiner m_refiner;
+	palettized_output_buffers m_palettized_output_buffers;
+};
+
+
+#endif // COLOR_QUANTIZATION_OCTREE_QUANTIZER_HPP______
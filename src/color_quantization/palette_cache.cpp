@@ -0,0 +1,332 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <utility>
+#include "fmt/format.h"
+#include "base/sha256.hpp"
+#include "palette_cache.hpp"
+
+
+namespace
+{
+
+
+char const magic_bytes[4] = { 'C', 'Q', 'P', 'C' };
+std::size_t const header_size = 24;
+std::size_t const palette_entry_size = graphics::color::num_channels * 4;
+
+
+void write_uint32(std::uint8_t *p_destination, std::uint32_t const p_value)
+{
+	for (unsigned int i = 0; i < 4; ++i)
+		p_destination[i] = std::uint8_t(p_value >> (i * 8));
+}
+
+
+std::uint32_t read_uint32(std::uint8_t const *p_source)
+{
+	std::uint32_t value = 0;
+	for (unsigned int i = 0; i < 4; ++i)
+		value |= std::uint32_t(p_source[i]) << (i * 8);
+	return value;
+}
+
+
+std::uint32_t pack_color(graphics::color const &p_color)
+{
+	return (std::uint32_t(p_color[3]) << 24) | (std::uint32_t(p_color[0]) << 16) | (std::uint32_t(p_color[1]) << 8) | std::uint32_t(p_color[2]);
+}
+
+
+graphics::color unpack_color(std::uint32_t const p_packed_color)
+{
+	return graphics::color(int((p_packed_color >> 16) & 0xFF), int((p_packed_color >> 8) & 0xFF), int(p_packed_color & 0xFF), int(p_packed_color >> 24));
+}
+
+
+std::string compute_cache_key(context const &p_context, graphics::color_histogram const &p_color_histogram, std::size_t const p_max_num_palette_entries)
+{
+	base::sha256 hash;
+
+	hash.update_string("color_quantization palette cache");
+	hash.update_uint64(palette_cache::format_version);
+	hash.update_string(p_context.m_palette_cache_options);
+	hash.update_string(to_string(p_context.m_color_metric));
+	hash.update_uint64(std::uint64_t(p_context.m_alpha_threshold));
+	hash.update_uint64(p_max_num_palette_entries);
+	hash.update_uint64(graphics::width(p_context.m_input_image));
+	hash.update_uint64(graphics::height(p_context.m_input_image));
+	hash.update_uint64(p_color_histogram.size());
+
+	// The histogram is ordered by color, so the same colors always give
+	// the same key. Entries are added in chunks to keep the per-call
+	// overhead of the hash low.
+	enum { entry_size = 12, num_chunk_entries = 256 };
+	std::uint8_t chunk[entry_size * num_chunk_entries];
+	std::size_t num_chunk_bytes = 0;
+	for (auto const &histogram_entry : p_color_histogram)
+	{
+		std::uint64_t count = histogram_entry.second;
+		write_uint32(&chunk[num_chunk_bytes], pack_color(histogram_entry.first));
+		write_uint32(&chunk[num_chunk_bytes + 4], std::uint32_t(count));
+		write_uint32(&chunk[num_chunk_bytes + 8], std::uint32_t(count >> 32));
+		num_chunk_bytes += entry_size;
+
+		if (num_chunk_bytes == sizeof(chunk))
+		{
+			hash.update(chunk, num_chunk_bytes);
+			num_chunk_bytes = 0;
+		}
+	}
+	hash.update(chunk, num_chunk_bytes);
+
+	return base::to_hex_string(hash.finish());
+}
+
+
+} // unnamed namespace end
+
+
+palette_cache_record::palette_cache_record()
+	: m_color_metric(graphics::color_metric::rgb_low_cost)
+{
+}
+
+
+palette_cache::palette_cache(std::string const &p_directory)
+	: m_directory(p_directory)
+{
+}
+
+
+std::string palette_cache::get_entry_filename(std::string const &p_key) const
+{
+	return m_directory + "/" + p_key + ".cqpc";
+}
+
+
+bool palette_cache::load(std::string const &p_key, palette_cache_record &p_record) const
+{
+	std::string filename = get_entry_filename(p_key);
+
+	std::ifstream file(filename, std::ios::binary);
+	if (!file)
+		return false;
+
+	std::vector < std::uint8_t > contents((std::istreambuf_iterator < char > (file)), std::istreambuf_iterator < char > ());
+
+	auto report_invalid_entry = [&filename]() {
+		fmt::print(stderr, "Ignoring invalid palette cache entry \"{}\"\n", filename);
+		return false;
+	};
+
+	if ((contents.size() < header_size) || !std::equal(std::begin(magic_bytes), std::end(magic_bytes), contents.begin()))
+		return report_invalid_entry();
+
+	std::uint32_t version = read_uint32(&contents[4]);
+	std::uint32_t color_metric = read_uint32(&contents[8]);
+	std::size_t num_palette_entries = read_uint32(&contents[12]);
+	std::size_t num_inverse_colormap_entries = read_uint32(&contents[16]);
+
+	if ((version != format_version) || (color_metric > std::uint32_t(graphics::color_metric::oklab)) || (num_palette_entries < 1) || (num_palette_entries > 256))
+		return report_invalid_entry();
+	if (contents.size() != (header_size + num_palette_entries * palette_entry_size + num_inverse_colormap_entries * 5))
+		return report_invalid_entry();
+
+	p_record.m_color_metric = graphics::color_metric(color_metric);
+
+	std::uint8_t const *data = &contents[header_size];
+
+	p_record.m_palette_colors.resize(num_palette_entries);
+	for (graphics::color &palette_color : p_record.m_palette_colors)
+	{
+		for (std::size_t channel = 0; channel < graphics::color::num_channels; ++channel, data += 4)
+			palette_color[channel] = int(std::int32_t(read_uint32(data)));
+	}
+
+	p_record.m_inverse_colormap_colors.resize(num_inverse_colormap_entries);
+	for (std::uint32_t &packed_color : p_record.m_inverse_colormap_colors)
+	{
+		packed_color = read_uint32(data);
+		data += 4;
+	}
+
+	p_record.m_inverse_colormap_palette_indices.assign(data, data + num_inverse_colormap_entries);
+	for (std::uint8_t palette_index : p_record.m_inverse_colormap_palette_indices)
+	{
+		if (palette_index >= num_palette_entries)
+			return report_invalid_entry();
+	}
+
+	return true;
+}
+
+
+bool palette_cache::store(std::string const &p_key, palette_cache_record const &p_record) const
+{
+	std::size_t num_palette_entries = p_record.m_palette_colors.size();
+	std::size_t num_inverse_colormap_entries = p_record.m_inverse_colormap_colors.size();
+
+	std::vector < std::uint8_t > contents(header_size + num_palette_entries * palette_entry_size + num_inverse_colormap_entries * 5);
+
+	std::copy(std::begin(magic_bytes), std::end(magic_bytes), contents.begin());
+	write_uint32(&contents[4], format_version);
+	write_uint32(&contents[8], std::uint32_t(p_record.m_color_metric));
+	write_uint32(&contents[12], std::uint32_t(num_palette_entries));
+	write_uint32(&contents[16], std::uint32_t(num_inverse_colormap_entries));
+	write_uint32(&contents[20], 0);
+
+	std::uint8_t *data = &contents[header_size];
+
+	for (graphics::color const &palette_color : p_record.m_palette_colors)
+	{
+		for (std::size_t channel = 0; channel < graphics::color::num_channels; ++channel, data += 4)
+			write_uint32(data, std::uint32_t(std::int32_t(palette_color[channel])));
+	}
+
+	for (std::uint32_t packed_color : p_record.m_inverse_colormap_colors)
+	{
+		write_uint32(data, packed_color);
+		data += 4;
+	}
+
+	std::copy(p_record.m_inverse_colormap_palette_indices.begin(), p_record.m_inverse_colormap_palette_indices.end(), data);
+
+	// The temporary file gets a random name, so that processes
+	// that store the same entry do not write into the same file.
+	std::string filename = get_entry_filename(p_key);
+	std::random_device random_device;
+	std::uint64_t random_value = (std::uint64_t(random_device()) << 32) | std::uint64_t(random_device());
+	std::string temp_filename = fmt::format("{}.{:016x}.tmp", filename, random_value);
+
+	{
+		std::ofstream file(temp_filename, std::ios::binary | std::ios::trunc);
+		file.write(reinterpret_cast < char const * > (contents.data()), contents.size());
+		file.close();
+		if (!file)
+		{
+			fmt::print(stderr, "Could not write palette cache entry \"{}\"\n", temp_filename);
+			std::remove(temp_filename.c_str());
+			return false;
+		}
+	}
+
+	if (std::rename(temp_filename.c_str(), filename.c_str()) != 0)
+	{
+		std::remove(temp_filename.c_str());
+
+		// Renaming onto an existing file fails on some platforms.
+		// Then another process has stored the same entry already.
+		if (std::ifstream(filename, std::ios::binary))
+			return true;
+
+		fmt::print(stderr, "Could not rename palette cache entry \"{}\" to \"{}\"\n", temp_filename, filename);
+		return false;
+	}
+
+	return true;
+}
+
+
+bool load_palette_from_cache(
+	context &p_context,
+	graphics::color_histogram const &p_color_histogram,
+	std::size_t const p_max_num_palette_entries,
+	palettized_output_buffers &p_buffers
+)
+{
+	p_context.m_palette_cache_key.clear();
+
+	if (p_context.m_palette_cache == nullptr)
+		return false;
+
+	palette_cache const &cache = *(p_context.m_palette_cache);
+	palette_cache_record record;
+	std::string key;
+	bool is_hit;
+
+	{
+		base::scoped_stage_timer stage_timer(p_context.m_instrumentation, "palette_cache_lookup");
+
+		key = compute_cache_key(p_context, p_color_histogram, p_max_num_palette_entries);
+		is_hit = cache.load(key, record)
+			&& (record.m_color_metric == p_context.m_color_metric)
+			&& (record.m_palette_colors.size() <= p_max_num_palette_entries);
+
+		if (is_hit)
+		{
+			p_context.m_palette.m_colors.assign(record.m_palette_colors.begin(), record.m_palette_colors.end());
+
+			std::size_t num_inverse_colormap_entries = record.m_inverse_colormap_colors.size();
+			std::vector < graphics::color > colors(num_inverse_colormap_entries);
+			std::vector < std::size_t > palette_indices(num_inverse_colormap_entries);
+			for (std::size_t i = 0; i < num_inverse_colormap_entries; ++i)
+			{
+				colors[i] = unpack_color(record.m_inverse_colormap_colors[i]);
+				palette_indices[i] = record.m_inverse_colormap_palette_indices[i];
+			}
+
+			if (num_inverse_colormap_entries > 0)
+			{
+				set_assigned_palette_indices(
+					p_buffers,
+					nonstd::span < graphics::color const > (colors.data(), colors.size()),
+					nonstd::span < std::size_t const > (palette_indices.data(), palette_indices.size())
+				);
+			}
+		}
+	}
+
+	if (is_hit)
+	{
+		fmt::print(stderr, "Palette cache hit: \"{}\" ({} palette entries, {} inverse colormap entries)\n", cache.get_entry_filename(key), record.m_palette_colors.size(), record.m_inverse_colormap_colors.size());
+		p_context.m_instrumentation.add_to_counter("palette_cache_hits", 1);
+		p_context.m_instrumentation.add_to_counter("palette_cache_misses", 0);
+	}
+	else
+	{
+		fmt::print(stderr, "Palette cache miss: \"{}\"\n", cache.get_entry_filename(key));
+		p_context.m_instrumentation.add_to_counter("palette_cache_hits", 0);
+		p_context.m_instrumentation.add_to_counter("palette_cache_misses", 1);
+		p_context.m_palette_cache_key = std::move(key);
+	}
+
+	return is_hit;
+}
+
+
+void store_palette_in_cache(context &p_context, palettized_output_buffers const &p_buffers)
+{
+	if ((p_context.m_palette_cache == nullptr) || p_context.m_palette_cache_key.empty())
+		return;
+
+	base::scoped_stage_timer stage_timer(p_context.m_instrumentation, "palette_cache_store");
+
+	palette_cache_record record;
+	record.m_color_metric = p_context.m_color_metric;
+	record.m_palette_colors.assign(p_context.m_palette.m_colors.begin(), p_context.m_palette.m_colors.end());
+
+	// The inverse colormap is sorted, so that readers
+	// can binary-search it in a memory-mapped entry.
+	std::vector < std::pair < std::uint32_t, std::uint8_t > > inverse_colormap;
+	inverse_colormap.reserve(p_buffers.m_assigned_color_map.size());
+	p_buffers.m_assigned_color_map.for_each([&inverse_colormap](graphics::color const &p_color, std::size_t const p_palette_index) {
+		inverse_colormap.emplace_back(pack_color(p_color), std::uint8_t(p_palette_index));
+	});
+	std::sort(inverse_colormap.begin(), inverse_colormap.end());
+
+	record.m_inverse_colormap_colors.resize(inverse_colormap.size());
+	record.m_inverse_colormap_palette_indices.resize(inverse_colormap.size());
+	for (std::size_t i = 0; i < inverse_colormap.size(); ++i)
+	{
+		record.m_inverse_colormap_colors[i] = inverse_colormap[i].first;
+		record.m_inverse_colormap_palette_indices[i] = inverse_colormap[i].second;
+	}
+
+	if (p_context.m_palette_cache->store(p_context.m_palette_cache_key, record))
+		p_context.m_instrumentation.add_to_counter("palette_cache_stores", 1);
+
+	p_context.m_palette_cache_key.clear();
+}
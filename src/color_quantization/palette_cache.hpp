@@ -0,0 +1,124 @@
+#ifndef COLOR_QUANTIZATION_PALETTE_CACHE_HPP______
+#define COLOR_QUANTIZATION_PALETTE_CACHE_HPP______
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "graphics/color.hpp"
+#include "graphics/color_metric.hpp"
+#include "context.hpp"
+#include "palettized_output.hpp"
+
+
+// On-disk cache of computed palettes, for pipelines that quantize the
+// same images (or images with the same colors) over and over.
+//
+// The key of an entry is a SHA-256 hash of everything that the palette
+// depends on: the histogram that the quantizer computes the palette
+// from, the image size, the color metric, the number of palette entries,
+// and the quantizer and its options (context::m_palette_cache_options).
+// Each entry is a file in the cache directory, named after its key.
+//
+// Entries are written to a temporary file first, which is then renamed
+// to the entry's name. Renaming replaces an existing file atomically, so
+// multiple processes can share a cache directory: readers either see a
+// complete entry or none at all. If two processes compute the same
+// entry, the last one to finish wins, and both entries are the same.
+//
+// An entry file has this layout, with all values in little-endian
+// order. Every array starts at an offset that is a multiple of its
+// element size, so the file can also be memory-mapped and used as is.
+//
+//   offset  size      content
+//   0       4         magic bytes "CQPC"
+//   4       4         format version (palette_cache::format_version)
+//   8       4         color metric
+//   12      4         number of palette entries (P)
+//   16      4         number of inverse colormap entries (N)
+//   20      4         reserved, 0
+//   24      16 * P    palette colors, as 4 int32 channels (RGBA) each
+//   24+16P  4 * N     inverse colormap colors, ascending (see below)
+//   24+16P+4N  N      inverse colormap palette indices
+//
+// The inverse colormap is optional. It has the palette indices that the
+// quantizer assigned to the colors of its histogram (see
+// set_assigned_palette_indices()), so that these do not have to be
+// searched for again. Its colors are packed into 32 bits as
+// (alpha << 24) | (red << 16) | (green << 8) | blue. All colors are in
+// the color space of the entry's metric.
+
+
+struct palette_cache_record
+{
+	graphics::color_metric m_color_metric;
+	std::vector < graphics::color > m_palette_colors;
+	// The inverse colormap; both are empty if there is none.
+	std::vector < std::uint32_t > m_inverse_colormap_colors;
+	std::vector < std::uint8_t > m_inverse_colormap_palette_indices;
+
+	palette_cache_record();
+};
+
+
+// The cache itself only knows its directory, so a single instance
+// can be used by multiple threads at once.
+class palette_cache
+{
+public:
+	enum : std::uint32_t { format_version = 1 };
+
+	// The directory must exist.
+	explicit palette_cache(std::string const &p_directory);
+
+	std::string const & get_directory() const
+	{
+		return m_directory;
+	}
+
+	std::string get_entry_filename(std::string const &p_key) const;
+
+	// Returns false if there is no entry for the key. Entries that
+	// cannot be read are reported, and are treated as missing.
+	bool load(std::string const &p_key, palette_cache_record &p_record) const;
+
+	// Prints an error and returns false if the entry could not be
+	// written. The cache is left unchanged in that case.
+	bool store(std::string const &p_key, palette_cache_record const &p_record) const;
+
+
+private:
+	std::string m_directory;
+};
+
+
+// Looks up the palette for p_color_histogram (which must be in the color
+// space of the context's metric) in the context's palette cache. This is
+// done by compute_input_histogram(); see there.
+//
+// On a hit, the context's palette is set to the cached one, the inverse
+// colormap (if the entry has one) is handed to p_buffers, and true is
+// returned. The quantizer then must not compute a palette of its own.
+// Its map_pixels() uses the exact nearest color search in that case,
+// since its approximate lookups need the state of a palette computation.
+//
+// On a miss, the key is kept in the context for store_palette_in_cache().
+// Adds the "palette_cache_lookup" stage and the palette_cache_hits and
+// palette_cache_misses counters to the context's instrumentation.
+bool load_palette_from_cache(
+	context &p_context,
+	graphics::color_histogram const &p_color_histogram,
+	std::size_t const p_max_num_palette_entries,
+	palettized_output_buffers &p_buffers
+);
+
+
+// Stores the context's palette in its palette cache, along with the
+// palette indices that the quantizer assigned (if any) as the inverse
+// colormap. The quantizers call this at the end of compute_palette().
+// Does nothing unless the histogram missed the cache before (so
+// lossless palettes and cached palettes are not stored again).
+void store_palette_in_cache(context &p_context, palettized_output_buffers const &p_buffers);
+
+
+#endif // COLOR_QUANTIZATION_PALETTE_CACHE_HPP______
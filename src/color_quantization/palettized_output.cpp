@@ -1,74 +1,360 @@
-#include "base/kd_tree.hpp"
+#include <algorithm>
+#include <assert.h>
+#include <cstdint>
+#include "fmt/format.h"
 #include "palettized_output.hpp"
 
 
-void produce_palettized_output(
+namespace
+{
+
+
+// Try to resolve the palette index of a pixel without searching:
+// transparent pixels go to the transparent palette entry, otherwise
+// check the upper neighbour for the same color, then consult the
+// cache. (Runs along the row are checked by the callers, since the
+// left neighbour may not be resolved yet. They check the alpha value
+// first too, so that transparent runs count as transparent.)
+bool find_known_palette_index(
+	context const &p_context,
+	graphics::color const &p_pixel_color,
+	std::size_t p_x,
+	std::pmr::vector < graphics::color > const &p_prev_row_colors,
+	std::pmr::vector < std::size_t > const &p_prev_row_palette_indices,
+	bool p_has_prev_row,
+	nearest_color_cache const &p_cache,
+	palettized_output_stats &p_stats,
+	std::size_t &p_palette_index
+)
+{
+	if (p_pixel_color.alpha() < p_context.m_alpha_threshold)
+	{
+		p_palette_index = get_transparent_palette_index(p_context);
+		++p_stats.m_num_transparent;
+		return true;
+	}
+
+	if (p_has_prev_row && (p_prev_row_colors[p_x] == p_pixel_color))
+	{
+		p_palette_index = p_prev_row_palette_indices[p_x];
+		++p_stats.m_num_run_hits;
+		return true;
+	}
+
+	if (p_cache.find(p_pixel_color, p_palette_index))
+	{
+		++p_stats.m_num_cache_hits;
+		return true;
+	}
+
+	return false;
+}
+
+
+void add_output_counters(context &p_context, palettized_output_stats const &p_stats)
+{
+	base::instrumentation &instrumentation = p_context.m_instrumentation;
+	instrumentation.add_to_counter("output_pixels", p_stats.m_num_pixels);
+	instrumentation.add_to_counter("output_transparent_pixels", p_stats.m_num_transparent);
+	instrumentation.add_to_counter("output_run_hits", p_stats.m_num_run_hits);
+	instrumentation.add_to_counter("output_cache_hits", p_stats.m_num_cache_hits);
+	instrumentation.add_to_counter("output_searches", p_stats.m_num_searches);
+	instrumentation.add_to_counter("output_exact_lookups", p_stats.m_num_exact_lookups);
+	instrumentation.add_to_counter("output_assigned_lookups", p_stats.m_num_assigned_lookups);
+	if (p_stats.m_has_squared_error)
+		instrumentation.add_to_counter("output_squared_error", p_stats.m_squared_error);
+}
+
+
+unsigned long long calculate_squared_error(graphics::color const &p_first, graphics::color const &p_second)
+{
+	unsigned long long squared_error = 0;
+	for (int c = 0; c < graphics::color::num_channels; ++c)
+	{
+		long diff = p_first[c] - p_second[c];
+		squared_error += diff * diff;
+	}
+
+	return squared_error;
+}
+
+
+// Maps every pixel to its own color in a lossless palette. Every opaque
+// enough pixel color is in the exact color map, so there is no search,
+// and no quantization error to dither with.
+template < std::size_t NumChannels, graphics::channel_order ChannelOrder >
+palettized_output_stats produce_lossless_palettized_output_for_layout(
 	context &p_context,
-	base::progress_report_callback const &p_progress_report_callback,
-	std::function < std::size_t(graphics::color const &p_color) > p_find_nearest_color_callback
+	color_index_map const &p_exact_color_map,
+	base::progress_report &p_progress_report
 )
 {
-	graphics::palette &output_palette = p_context.m_palette;
+	std::size_t width = graphics::width(p_context.m_input_image);
+	std::size_t height = graphics::height(p_context.m_input_image);
+	std::size_t transparent_palette_index = get_transparent_palette_index(p_context);
+	unsigned long num_pixels_processed = 0;
+	unsigned long total_num_pixels = width * height;
+
+	palettized_output_stats stats;
+	stats.m_num_pixels = total_num_pixels;
+	// Every pixel gets its own color.
+	stats.m_has_squared_error = true;
+
+	for (unsigned long y = 0; y < height; ++y)
+	{
+		std::uint8_t const *row_data = graphics::at(p_context.m_input_image, 0, y);
+		std::uint8_t *output_row_data = graphics::at(p_context.m_output_image, 0, y);
+
+		for (unsigned long x = 0; x < width; ++x)
+		{
+			graphics::color pixel_color = graphics::read_pixel_color < NumChannels, ChannelOrder > (row_data + x * NumChannels);
 
-	std::vector < std::size_t > palette_indices(output_palette.size());
-	for (int i = 0; i < int(palette_indices.size()); ++i)
-		palette_indices[i] = i;
-
-	base::kd_tree < std::size_t > palette_kd_tree;
-	fill(
-		palette_kd_tree,
-		palette_indices.begin(), palette_indices.end(),
-		[&output_palette](std::size_t p_first, std::size_t p_second, unsigned int p_level) -> bool {
-			unsigned int dimension = p_level % 3;
-			return output_palette[p_first][dimension] < output_palette[p_second][dimension];
+			std::size_t palette_index;
+			if (pixel_color.alpha() < p_context.m_alpha_threshold)
+			{
+				palette_index = transparent_palette_index;
+				++stats.m_num_transparent;
+			}
+			else
+			{
+				bool found = p_exact_color_map.find(pixel_color, palette_index);
+				assert(found);
+				(void)found;
+				++stats.m_num_exact_lookups;
+			}
+
+			output_row_data[x] = palette_index;
 		}
-	);
 
+		if (p_context.m_output_row_callback)
+			p_context.m_output_row_callback(y);
+
+		num_pixels_processed += width;
+		p_progress_report(num_pixels_processed, total_num_pixels);
+	}
+
+	add_output_counters(p_context, stats);
+	return stats;
+}
+
+
+template < std::size_t NumChannels, graphics::channel_order ChannelOrder >
+palettized_output_stats produce_palettized_output_for_layout(
+	context &p_context,
+	palettized_output_buffers &p_buffers,
+	base::progress_report &p_progress_report,
+	std::function < std::size_t(graphics::color const &p_color) > &p_find_nearest_color_callback
+)
+{
+	graphics::palette &output_palette = p_context.m_palette;
+	graphics::color_metric const color_metric = p_context.m_color_metric;
+
+	// Built once here, and used by all lookups below. This gives the
+	// same results as a linear scan over the palette.
+	graphics::palette_index &output_palette_index = p_buffers.m_palette_index;
+	build_palette_index(output_palette_index, output_palette, color_metric);
+
+	// The palette and the lookups are in the color space of the metric,
+	// while the image pixels are RGB. Pixels are converted only when
+	// they actually need to be looked up. The quantization error for
+	// dithering is computed in RGB, so an RGB copy of the palette is
+	// needed for that.
+	graphics::palette &rgb_output_palette = p_buffers.m_rgb_palette;
+	rgb_output_palette = output_palette;
+	for (auto &palette_entry : rgb_output_palette.m_colors)
+		palette_entry = convert_to_rgb(palette_entry, color_metric);
+
+	// Without dithering, the pixels of a row do not depend on each
+	// other, so an entire row can be looked up with one batch query.
+	// (With dithering, the quantization error of one pixel modifies
+	// its right neighbour, so this is not possible there.)
+	bool use_batch_queries = !p_find_nearest_color_callback && !p_context.m_use_dithering;
+
+	std::size_t prev_nearest_palette_index = 0;
 	if (!p_find_nearest_color_callback)
 	{
-		p_find_nearest_color_callback = [&output_palette, &palette_kd_tree](graphics::color const &p_color) -> std::size_t {
-			auto nearest_iter = find_nearest(
-				palette_kd_tree,
-				p_color,
-				[&output_palette](std::size_t output_palette_index, graphics::color const &p_color) -> long {
-					graphics::color const &palette_color = output_palette[output_palette_index];
-					return calculate_color_distance(palette_color, p_color);
-				},
-				[&output_palette](std::size_t output_palette_index, graphics::color const &p_color, unsigned int p_level) -> long {
-					graphics::color const &palette_color = output_palette[output_palette_index];
-					unsigned int dimension = p_level % 3;
-					graphics::color color1 { 0, 0, 0 };
-					graphics::color color2 { 0, 0, 0 };
-					color1[dimension] = palette_color[dimension];
-					color2[dimension] = p_color[dimension];
-
-					long sign = (color2[dimension] >= color1[dimension]) ? 1.0f : -1.0f;
-					return calculate_color_distance(color1, color2) * sign;
-				}
-			);
-			return nearest_iter->m_value;
+		p_find_nearest_color_callback = [&output_palette_index, &prev_nearest_palette_index](graphics::color const &p_color) -> std::size_t {
+			prev_nearest_palette_index = find_nearest_color(output_palette_index, p_color, prev_nearest_palette_index);
+			return prev_nearest_palette_index;
 		};
 	}
 
 	std::size_t width = graphics::width(p_context.m_input_image);
 	std::size_t height = graphics::height(p_context.m_input_image);
+	std::size_t hstride = graphics::hstride(p_context.m_input_image);
 	unsigned long num_pixels_processed = 0;
 	unsigned long total_num_pixels = width * height;
 
+	palettized_output_stats stats;
+	stats.m_num_pixels = total_num_pixels;
+
+	// Flat regions are common in many images, so before searching,
+	// check if the color of the left or upper neighbour is the same,
+	// and check the cache for recently seen colors. In the dithered
+	// case, the colors are read after the quantization error of the
+	// previous pixels was applied to them, so the cache is keyed on
+	// the post-error colors, which are what is actually looked up.
+	nearest_color_cache &cache = p_buffers.m_cache;
+	auto &row_colors = p_buffers.m_row_colors;
+	auto &prev_row_colors = p_buffers.m_prev_row_colors;
+	auto &row_palette_indices = p_buffers.m_row_palette_indices;
+	auto &prev_row_palette_indices = p_buffers.m_prev_row_palette_indices;
+	cache.clear();
+	row_colors.resize(width);
+	prev_row_colors.resize(width);
+	row_palette_indices.resize(width);
+	prev_row_palette_indices.resize(width);
+
+	if (use_batch_queries)
+	{
+		auto &miss_colors = p_buffers.m_miss_colors;
+		auto &miss_x_positions = p_buffers.m_miss_x_positions;
+		auto &miss_palette_indices = p_buffers.m_miss_palette_indices;
+		auto &copy_from_left = p_buffers.m_copy_from_left;
+		// The quantizer's assignment replaces most of the searches, if
+		// it has one. Only colors that were not in its histogram (like
+		// those missing from a preview) still need to be searched for.
+		color_index_map const &assigned_color_map = p_buffers.m_assigned_color_map;
+		stats.m_has_squared_error = true;
+		copy_from_left.resize(width);
+		miss_colors.reserve(width);
+		miss_x_positions.reserve(width);
+		miss_palette_indices.reserve(width);
+
+		for (unsigned long y = 0; y < height; ++y)
+		{
+			std::uint8_t const *row_data = graphics::at(p_context.m_input_image, 0, y);
+			std::uint8_t *output_row_data = graphics::at(p_context.m_output_image, 0, y);
+
+			for (unsigned long x = 0; x < width; ++x)
+				row_colors[x] = graphics::read_pixel_color < NumChannels, ChannelOrder > (row_data + x * NumChannels);
+
+			miss_colors.clear();
+			miss_x_positions.clear();
+
+			for (unsigned long x = 0; x < width; ++x)
+			{
+				// Pixels that continue a run are resolved after the
+				// search, once the start of their run is known.
+				bool is_opaque = (row_colors[x].alpha() >= p_context.m_alpha_threshold);
+				copy_from_left[x] = is_opaque && (x > 0) && (row_colors[x - 1] == row_colors[x]);
+				if (copy_from_left[x])
+				{
+					++stats.m_num_run_hits;
+					continue;
+				}
+
+				if (!find_known_palette_index(p_context, row_colors[x], x, prev_row_colors, prev_row_palette_indices, y > 0, cache, stats, row_palette_indices[x]))
+				{
+					miss_colors.push_back(convert_from_rgb(row_colors[x], color_metric));
+					miss_x_positions.push_back(x);
+				}
+			}
+
+			if (!assigned_color_map.empty())
+			{
+				// The lookups are spread over a large table, so its
+				// slots are prefetched a few lookups ahead.
+				std::size_t const prefetch_distance = 8;
+				std::size_t num_remaining_misses = 0;
+				for (std::size_t i = 0; i < miss_colors.size(); ++i)
+				{
+					if ((i + prefetch_distance) < miss_colors.size())
+						assigned_color_map.prefetch(miss_colors[i + prefetch_distance]);
+
+					std::size_t x = miss_x_positions[i];
+					if (assigned_color_map.find(miss_colors[i], row_palette_indices[x]))
+					{
+						cache.store(row_colors[x], row_palette_indices[x]);
+						++stats.m_num_assigned_lookups;
+					}
+					else
+					{
+						miss_colors[num_remaining_misses] = miss_colors[i];
+						miss_x_positions[num_remaining_misses] = x;
+						++num_remaining_misses;
+					}
+				}
+
+				miss_colors.resize(num_remaining_misses);
+				miss_x_positions.resize(num_remaining_misses);
+			}
+
+			miss_palette_indices.resize(miss_colors.size());
+			find_nearest_colors(
+				output_palette_index,
+				nonstd::span < graphics::color const > (miss_colors.data(), miss_colors.size()),
+				nonstd::span < std::size_t > (miss_palette_indices.data(), miss_palette_indices.size())
+			);
+
+			for (std::size_t i = 0; i < miss_colors.size(); ++i)
+			{
+				row_palette_indices[miss_x_positions[i]] = miss_palette_indices[i];
+				cache.store(row_colors[miss_x_positions[i]], miss_palette_indices[i]);
+			}
+			stats.m_num_searches += miss_colors.size();
+
+			for (unsigned long x = 1; x < width; ++x)
+			{
+				if (copy_from_left[x])
+					row_palette_indices[x] = row_palette_indices[x - 1];
+			}
+
+			for (unsigned long x = 0; x < width; ++x)
+			{
+				output_row_data[x] = row_palette_indices[x];
+				if (row_colors[x].alpha() >= p_context.m_alpha_threshold)
+					stats.m_squared_error += calculate_squared_error(row_colors[x], rgb_output_palette[row_palette_indices[x]]);
+			}
+
+			if (p_context.m_output_row_callback)
+				p_context.m_output_row_callback(y);
+
+			row_colors.swap(prev_row_colors);
+			row_palette_indices.swap(prev_row_palette_indices);
+
+			num_pixels_processed += width;
+			p_progress_report(num_pixels_processed, total_num_pixels);
+		}
+
+		add_output_counters(p_context, stats);
+		add_palette_index_counters(p_context, output_palette_index);
+		return stats;
+	}
+
 	for (unsigned long y = 0; y < height; ++y)
 	{
+		std::uint8_t *row_data = graphics::at(p_context.m_input_image, 0, y);
+		std::uint8_t *output_row_data = graphics::at(p_context.m_output_image, 0, y);
+
 		for (unsigned long x = 0; x < width; ++x)
 		{
-			std::uint8_t const *pixel_data = graphics::at(p_context.m_input_image, x, y);
+			std::uint8_t *pixel_data = row_data + x * NumChannels;
 
-			graphics::color pixel_color(pixel_data[2], pixel_data[1], pixel_data[0]);
+			graphics::color pixel_color = graphics::read_pixel_color < NumChannels, ChannelOrder > (pixel_data);
+			row_colors[x] = pixel_color;
+
+			std::size_t nearest_palette_index;
+			bool is_opaque = (pixel_color.alpha() >= p_context.m_alpha_threshold);
+			if (is_opaque && (x > 0) && (row_colors[x - 1] == pixel_color))
+			{
+				nearest_palette_index = row_palette_indices[x - 1];
+				++stats.m_num_run_hits;
+			}
+			else if (!find_known_palette_index(p_context, pixel_color, x, prev_row_colors, prev_row_palette_indices, y > 0, cache, stats, nearest_palette_index))
+			{
+				nearest_palette_index = p_find_nearest_color_callback(convert_from_rgb(pixel_color, color_metric));
+				cache.store(pixel_color, nearest_palette_index);
+				++stats.m_num_searches;
+			}
+			row_palette_indices[x] = nearest_palette_index;
 
-			std::size_t nearest_palette_index = p_find_nearest_color_callback(pixel_color);
-			graphics::color const & nearest_palette_color = output_palette[nearest_palette_index];
-			graphics::at < std::uint8_t > (p_context.m_output_image, x, y)[0] = nearest_palette_index;
+			output_row_data[x] = nearest_palette_index;
 
-			if (p_context.m_use_dithering)
+			// Transparent pixels have no meaningful quantization error.
+			if (p_context.m_use_dithering && is_opaque)
 			{
+				graphics::color const & nearest_palette_color = rgb_output_palette[nearest_palette_index];
 				graphics::color quantization_error = pixel_color - nearest_palette_color;
 
 				int const chroma_weights[3] = { 299, 587, 114 };
@@ -89,22 +375,151 @@ void produce_palettized_output(
 					if ((floyd_steinberg_y_offset[idx] > 0) && (y == (height - 1)))
 						continue;
 
-					unsigned long x_with_offset = x + floyd_steinberg_x_offset[idx];
-					unsigned long y_with_offset = y + floyd_steinberg_y_offset[idx];
+					std::uint8_t *neighbour_pixel_data = pixel_data + floyd_steinberg_x_offset[idx] * long(NumChannels) + floyd_steinberg_y_offset[idx] * long(hstride);
 
+					// The error and the weights are in RGB order, the
+					// pixel data is in the image's channel order.
 					for (int rgb_idx = 0; rgb_idx < 3; ++rgb_idx)
 					{
-						int rgb_value = graphics::at(p_context.m_input_image, x_with_offset, y_with_offset)[rgb_idx];
+						std::size_t const channel_offset = graphics::get_pixel_channel_offset < ChannelOrder > (rgb_idx);
+						int rgb_value = neighbour_pixel_data[channel_offset];
 						rgb_value += quantization_error[rgb_idx] * floyd_steinberg_weight[idx] * chroma_weights[rgb_idx] / floyd_steinberg_total_weight	 / 1000;
 						rgb_value = std::max(std::min(rgb_value, 255), 0);
-						graphics::at(p_context.m_input_image, x_with_offset, y_with_offset)[rgb_idx] = rgb_value;
+						neighbour_pixel_data[channel_offset] = rgb_value;
 					}
 				}
 			}
-
-			++num_pixels_processed;
-			if (p_progress_report_callback)
-				p_progress_report_callback(num_pixels_processed, total_num_pixels);
 		}
+
+		// Dithering only modifies the input pixels of the following
+		// rows, so this output row is final now.
+		if (p_context.m_output_row_callback)
+			p_context.m_output_row_callback(y);
+
+		row_colors.swap(prev_row_colors);
+		row_palette_indices.swap(prev_row_palette_indices);
+
+		num_pixels_processed += width;
+		p_progress_report(num_pixels_processed, total_num_pixels);
+	}
+
+	add_output_counters(p_context, stats);
+	add_palette_index_counters(p_context, output_palette_index);
+	return stats;
+}
+
+
+} // unnamed namespace end
+
+
+void add_palette_index_counters(context &p_context, graphics::palette_index const &p_palette_index)
+{
+	base::instrumentation &instrumentation = p_context.m_instrumentation;
+	instrumentation.add_to_counter("palette_index_lookups", p_palette_index.m_stats.m_num_lookups);
+	instrumentation.add_to_counter("palette_index_early_accepts", p_palette_index.m_stats.m_num_early_accepts);
+	instrumentation.add_to_counter("palette_index_visited_entries", p_palette_index.m_stats.m_num_visited_entries);
+}
+
+
+bool compute_lossless_palette(
+	context &p_context,
+	graphics::color_histogram const &p_color_histogram,
+	std::size_t const p_max_num_palette_entries,
+	palettized_output_buffers &p_buffers
+)
+{
+	color_index_map &color_map = p_buffers.m_exact_color_map;
+	color_map.clear();
+
+	// An empty histogram (all pixels are transparent) does not get a
+	// lossless palette. compute_input_histogram() gives it a palette
+	// of its own instead, since the quantizers cannot handle it.
+	if (p_color_histogram.empty() || (p_color_histogram.size() > p_max_num_palette_entries))
+		return false;
+
+	color_map.reset(p_color_histogram.size());
+
+	graphics::palette &palette = p_context.m_palette;
+	palette.m_colors.clear();
+	for (auto const &histogram_entry : p_color_histogram)
+	{
+		color_map.insert(histogram_entry.first, palette.size());
+		palette.m_colors.push_back(histogram_entry.first);
+	}
+
+	p_context.m_color_metric = graphics::color_metric::rgb_low_cost;
+	p_context.m_instrumentation.add_to_counter("lossless_palette", 1);
+
+	fmt::print(stderr, "Image has {} colors, which all fit in the palette; using them as they are\n", palette.size());
+
+	return true;
+}
+
+
+void set_assigned_palette_indices(
+	palettized_output_buffers &p_buffers,
+	nonstd::span < graphics::color const > p_colors,
+	nonstd::span < std::size_t const > p_palette_indices
+)
+{
+	assert(p_colors.size() == p_palette_indices.size());
+
+	color_index_map &color_map = p_buffers.m_assigned_color_map;
+	color_map.reset(p_colors.size());
+	for (std::size_t i = 0; i < std::size_t(p_colors.size()); ++i)
+		color_map.insert(p_colors[i], p_palette_indices[i]);
+}
+
+
+palettized_output_stats produce_palettized_output(
+	context &p_context,
+	palettized_output_buffers &p_buffers,
+	base::progress_report p_progress_report,
+	std::function < std::size_t(graphics::color const &p_color) > p_find_nearest_color_callback
+)
+{
+	if (!p_buffers.m_exact_color_map.empty())
+	{
+		return graphics::dispatch_pixel_layout(p_context.m_input_image, [&](auto p_num_channels, auto p_channel_order) {
+			return produce_lossless_palettized_output_for_layout < decltype(p_num_channels)::value, decltype(p_channel_order)::value > (
+				p_context,
+				p_buffers.m_exact_color_map,
+				p_progress_report
+			);
+		});
+	}
+
+	return graphics::dispatch_pixel_layout(p_context.m_input_image, [&](auto p_num_channels, auto p_channel_order) {
+		return produce_palettized_output_for_layout < decltype(p_num_channels)::value, decltype(p_channel_order)::value > (
+			p_context,
+			p_buffers,
+			p_progress_report,
+			p_find_nearest_color_callback
+		);
+	});
+}
+
+
+void print_palettized_output_stats(palettized_output_stats const &p_stats)
+{
+	auto percentage = [&p_stats](unsigned long p_value) -> double {
+		return (p_stats.m_num_pixels > 0) ? (double(p_value) * 100.0 / p_stats.m_num_pixels) : 0.0;
+	};
+
+	fmt::print(stderr, "Output pixels: {}\n", p_stats.m_num_pixels);
+	fmt::print(stderr, "  transparent: {} ({:.1f}%)\n", p_stats.m_num_transparent, percentage(p_stats.m_num_transparent));
+	fmt::print(stderr, "  resolved by runs of identical colors: {} ({:.1f}%)\n", p_stats.m_num_run_hits, percentage(p_stats.m_num_run_hits));
+	fmt::print(stderr, "  resolved by nearest color cache: {} ({:.1f}%)\n", p_stats.m_num_cache_hits, percentage(p_stats.m_num_cache_hits));
+	fmt::print(stderr, "  resolved by nearest color search: {} ({:.1f}%)\n", p_stats.m_num_searches, percentage(p_stats.m_num_searches));
+	if (p_stats.m_num_exact_lookups > 0)
+		fmt::print(stderr, "  resolved by exact color map (lossless palette): {} ({:.1f}%)\n", p_stats.m_num_exact_lookups, percentage(p_stats.m_num_exact_lookups));
+	if (p_stats.m_num_assigned_lookups > 0)
+		fmt::print(stderr, "  resolved by the quantizer's color assignment: {} ({:.1f}%)\n", p_stats.m_num_assigned_lookups, percentage(p_stats.m_num_assigned_lookups));
+
+	if (p_stats.m_has_squared_error)
+	{
+		unsigned long num_opaque_pixels = p_stats.m_num_pixels - p_stats.m_num_transparent;
+		double mean_squared_error = (num_opaque_pixels > 0) ? (double(p_stats.m_squared_error) / num_opaque_pixels) : 0.0;
+		fmt::print(stderr, "Mean squared error per pixel (sum over R, G, B, A): {:.2f}\n", mean_squared_error);
 	}
 }
@@ -1,16 +1,354 @@
 #ifndef COLOR_QUANTIZATION_PALETTIZED_OUTPUT_HPP
 #define COLOR_QUANTIZATION_PALETTIZED_OUTPUT_HPP
 
+#include <algorithm>
+#include <assert.h>
+#include <cstdint>
+#include <memory_resource>
+#include <vector>
+#include "base/custom_span.hpp"
+#include "graphics/color.hpp"
 #include "graphics/palette.hpp"
 #include "graphics/pixmap_view.hpp"
 #include "context.hpp"
 
 
-void produce_palettized_output(
+// Small direct-mapped cache for color -> palette index results.
+// Each color maps to exactly one slot; a newer color that maps to
+// the same slot simply replaces the older one.
+class nearest_color_cache
+{
+public:
+	enum { num_slot_bits = 12, num_slots = 1u << num_slot_bits };
+
+	explicit nearest_color_cache(std::pmr::memory_resource *p_memory_resource = std::pmr::get_default_resource())
+		: m_slots(num_slots, slot { 0, invalid_palette_index }, p_memory_resource)
+	{
+	}
+
+	// Empties the cache. Needed when the palette changes.
+	void clear()
+	{
+		std::fill(m_slots.begin(), m_slots.end(), slot { 0, invalid_palette_index });
+	}
+
+	bool find(graphics::color const &p_color, std::size_t &p_palette_index) const
+	{
+		std::uint32_t key = make_key(p_color);
+		slot const &s = m_slots[slot_index(key)];
+
+		if ((s.m_key != key) || (s.m_palette_index == invalid_palette_index))
+			return false;
+
+		p_palette_index = s.m_palette_index;
+		return true;
+	}
+
+	void store(graphics::color const &p_color, std::size_t p_palette_index)
+	{
+		std::uint32_t key = make_key(p_color);
+		m_slots[slot_index(key)] = slot { key, std::uint32_t(p_palette_index) };
+	}
+
+
+private:
+	// All 32-bit keys are valid RGBA colors, so empty
+	// slots are marked by their palette index instead.
+	static constexpr std::uint32_t invalid_palette_index = 0xFFFFFFFFu;
+
+	struct slot
+	{
+		std::uint32_t m_key;
+		std::uint32_t m_palette_index;
+	};
+
+	static std::uint32_t make_key(graphics::color const &p_color)
+	{
+		return (std::uint32_t(p_color[3]) << 24) | (std::uint32_t(p_color[0]) << 16) | (std::uint32_t(p_color[1]) << 8) | std::uint32_t(p_color[2]);
+	}
+
+	static std::size_t slot_index(std::uint32_t p_key)
+	{
+		// Fibonacci hashing, to spread similar colors across the slots.
+		return (p_key * 2654435761u) >> (32 - num_slot_bits);
+	}
+
+	std::pmr::vector < slot > m_slots;
+};
+
+
+// Exact color -> palette index map. This is a hash table with open
+// addressing. reset() sets the number of colors it has room for, and
+// the table is kept at most half full, so lookups rarely need more
+// than one or two probes.
+class color_index_map
+{
+public:
+	explicit color_index_map(std::pmr::memory_resource *p_memory_resource = std::pmr::get_default_resource())
+		: m_slots(p_memory_resource)
+		, m_num_slot_bits(0)
+		, m_num_colors(0)
+		, m_max_num_colors(0)
+	{
+	}
+
+	// Empties the map, and makes room for p_max_num_colors colors.
+	// The memory of the table is reused if it is large enough.
+	void reset(std::size_t const p_max_num_colors)
+	{
+		unsigned int num_slot_bits = 1;
+		while ((std::size_t(1) << num_slot_bits) < (p_max_num_colors * 2))
+			++num_slot_bits;
+
+		m_slots.assign(std::size_t(1) << num_slot_bits, slot { 0, invalid_palette_index });
+		m_num_slot_bits = num_slot_bits;
+		m_num_colors = 0;
+		m_max_num_colors = p_max_num_colors;
+	}
+
+	void clear()
+	{
+		reset(0);
+	}
+
+	bool empty() const
+	{
+		return m_num_colors == 0;
+	}
+
+	std::size_t size() const
+	{
+		return m_num_colors;
+	}
+
+	// Calls p_function(color, palette index) for each color in the
+	// map, in no particular order.
+	template < typename Function >
+	void for_each(Function &&p_function) const
+	{
+		for (slot const &s : m_slots)
+		{
+			if (s.m_palette_index != invalid_palette_index)
+				p_function(make_color(s.m_key), std::size_t(s.m_palette_index));
+		}
+	}
+
+	// p_color must not be in the map yet, and the map must contain
+	// less colors than reset() made room for.
+	void insert(graphics::color const &p_color, std::size_t p_palette_index)
+	{
+		assert(m_num_colors < m_max_num_colors);
+
+		std::uint32_t key = make_key(p_color);
+		std::size_t const slot_mask = m_slots.size() - 1;
+		std::size_t index = slot_index(key);
+		while (m_slots[index].m_palette_index != invalid_palette_index)
+			index = (index + 1) & slot_mask;
+
+		m_slots[index] = slot { key, std::uint32_t(p_palette_index) };
+		++m_num_colors;
+	}
+
+	// Hint for large maps: starts loading the slot of a color that
+	// is going to be looked up soon. Does nothing if the compiler
+	// has no prefetch intrinsic.
+	void prefetch(graphics::color const &p_color) const
+	{
+#if defined(__GNUC__)
+		__builtin_prefetch(&(m_slots[slot_index(make_key(p_color))]));
+#else
+		(void)p_color;
+#endif
+	}
+
+	bool find(graphics::color const &p_color, std::size_t &p_palette_index) const
+	{
+		if (m_num_colors == 0)
+			return false;
+
+		std::uint32_t key = make_key(p_color);
+		std::size_t const slot_mask = m_slots.size() - 1;
+
+		for (std::size_t index = slot_index(key); m_slots[index].m_palette_index != invalid_palette_index; index = (index + 1) & slot_mask)
+		{
+			if (m_slots[index].m_key == key)
+			{
+				p_palette_index = m_slots[index].m_palette_index;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+
+private:
+	static constexpr std::uint32_t invalid_palette_index = 0xFFFFFFFFu;
+
+	struct slot
+	{
+		std::uint32_t m_key;
+		std::uint32_t m_palette_index;
+	};
+
+	static std::uint32_t make_key(graphics::color const &p_color)
+	{
+		return (std::uint32_t(p_color[3]) << 24) | (std::uint32_t(p_color[0]) << 16) | (std::uint32_t(p_color[1]) << 8) | std::uint32_t(p_color[2]);
+	}
+
+	static graphics::color make_color(std::uint32_t p_key)
+	{
+		return graphics::color(int((p_key >> 16) & 0xFF), int((p_key >> 8) & 0xFF), int(p_key & 0xFF), int(p_key >> 24));
+	}
+
+	std::size_t slot_index(std::uint32_t p_key) const
+	{
+		return (p_key * 2654435761u) >> (32 - m_num_slot_bits);
+	}
+
+	std::pmr::vector < slot > m_slots;
+	unsigned int m_num_slot_bits;
+	std::size_t m_num_colors;
+	std::size_t m_max_num_colors;
+};
+
+
+// Working memory of produce_palettized_output(). Passing the same
+// buffers to each call avoids allocating them again every time.
+struct palettized_output_buffers
+{
+	graphics::palette_index m_palette_index;
+	graphics::palette m_rgb_palette;
+	nearest_color_cache m_cache;
+
+	// Filled by compute_lossless_palette(). If this is not empty,
+	// produce_palettized_output() maps the pixels through it.
+	color_index_map m_exact_color_map;
+
+	// Filled by set_assigned_palette_indices(). Cleared by
+	// compute_input_histogram(), so that it never refers to the
+	// palette of a previous image.
+	color_index_map m_assigned_color_map;
+
+	std::pmr::vector < graphics::color > m_row_colors, m_prev_row_colors;
+	std::pmr::vector < std::size_t > m_row_palette_indices, m_prev_row_palette_indices;
+
+	std::pmr::vector < graphics::color > m_miss_colors;
+	std::pmr::vector < std::size_t > m_miss_x_positions;
+	std::pmr::vector < std::size_t > m_miss_palette_indices;
+	std::pmr::vector < bool > m_copy_from_left;
+
+	explicit palettized_output_buffers(std::pmr::memory_resource *p_memory_resource = std::pmr::get_default_resource())
+		: m_cache(p_memory_resource)
+		, m_exact_color_map(p_memory_resource)
+		, m_assigned_color_map(p_memory_resource)
+		, m_row_colors(p_memory_resource)
+		, m_prev_row_colors(p_memory_resource)
+		, m_row_palette_indices(p_memory_resource)
+		, m_prev_row_palette_indices(p_memory_resource)
+		, m_miss_colors(p_memory_resource)
+		, m_miss_x_positions(p_memory_resource)
+		, m_miss_palette_indices(p_memory_resource)
+		, m_copy_from_left(p_memory_resource)
+	{
+	}
+};
+
+
+struct palettized_output_stats
+{
+	unsigned long m_num_pixels;
+	unsigned long m_num_transparent;
+	// Pixels whose palette index was taken from the left or upper
+	// neighbour, since these have the exact same color.
+	unsigned long m_num_run_hits;
+	unsigned long m_num_cache_hits;
+	unsigned long m_num_searches;
+	// Pixels that were looked up in the exact color map of a lossless palette.
+	unsigned long m_num_exact_lookups;
+	// Pixels whose colors the quantizer had already assigned to
+	// palette entries (see set_assigned_palette_indices()).
+	unsigned long m_num_assigned_lookups;
+	// Sum of the squared RGBA differences between the pixels that are
+	// not transparent and their palette entries. This measures the
+	// quality of the palette. It is not computed with dithering, which
+	// modifies the pixels as it goes.
+	bool m_has_squared_error;
+	unsigned long long m_squared_error;
+
+	palettized_output_stats()
+		: m_num_pixels(0)
+		, m_num_transparent(0)
+		, m_num_run_hits(0)
+		, m_num_cache_hits(0)
+		, m_num_searches(0)
+		, m_num_exact_lookups(0)
+		, m_num_assigned_lookups(0)
+		, m_has_squared_error(false)
+		, m_squared_error(0)
+	{
+	}
+};
+
+
+// Adds the lookup statistics of a palette index to the counters
+// of the context's instrumentation.
+void add_palette_index_counters(context &p_context, graphics::palette_index const &p_palette_index);
+
+
+// Lossless fast path for images that already have few enough colors,
+// like icons and other images that were paletted before.
+//
+// p_color_histogram must be the histogram of the context's input image,
+// in RGB (that is, before convert_color_histogram()). If it has at most
+// p_max_num_palette_entries colors, the context's palette is set to
+// exactly these colors, the exact color map of p_buffers is filled, and
+// true is returned. The quantizer can then skip its own palette
+// computation, and produce_palettized_output() maps every pixel to its
+// own color without any search. The output is thus bit-exact.
+//
+// Since the palette colors are taken as they are, the context's color
+// metric is set to rgb_low_cost in that case. (Converting them to
+// another color space and back would not give the same colors.)
+//
+// Otherwise, the exact color map is cleared, and false is returned.
+bool compute_lossless_palette(
+	context &p_context,
+	graphics::color_histogram const &p_color_histogram,
+	std::size_t const p_max_num_palette_entries,
+	palettized_output_buffers &p_buffers
+);
+
+
+// Hands the palette indices that a quantizer assigned to the colors of
+// its histogram over to produce_palettized_output(). Without dithering,
+// pixels with these colors are then looked up instead of searched for.
+//
+// The colors must be in the color space of the context's metric, and
+// the palette indices must be exactly what find_nearest_color() returns
+// for them with the final palette, including its tie-breaking. The
+// output is then the same as with searching.
+void set_assigned_palette_indices(
+	palettized_output_buffers &p_buffers,
+	nonstd::span < graphics::color const > p_colors,
+	nonstd::span < std::size_t const > p_palette_indices
+);
+
+
+// Also adds the stats to the counters of the context's instrumentation.
+//
+// p_find_nearest_color_callback, if set, replaces the default nearest
+// color search. It gets colors in the color space of the context's metric.
+// It is not used if the buffers have a lossless palette's exact color map.
+palettized_output_stats produce_palettized_output(
 	context &p_context,
-	base::progress_report_callback const &p_progress_report_callback = base::progress_report_callback(),
+	palettized_output_buffers &p_buffers,
+	base::progress_report p_progress_report = base::progress_report(),
 	std::function < std::size_t(graphics::color const &p_color) > p_find_nearest_color_callback = std::function < std::size_t(graphics::color const &p_color) > ()
 );
 
 
+void print_palettized_output_stats(palettized_output_stats const &p_stats);
+
+
 #endif // COLOR_QUANTIZATION_PALETTIZED_OUTPUT_HPP
@@ -0,0 +1,93 @@
+#ifndef COLOR_QUANTIZATION_QUANTIZER_HPP______
+#define COLOR_QUANTIZATION_QUANTIZER_HPP______
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include "base/scratch_arena.hpp"
+#include "context.hpp"
+
+
+// Common interface of the color quantizers.
+//
+// A quantizer holds its options and the working memory of its algorithm.
+// It does not use any global state, so different quantizer instances can
+// be used concurrently by different threads. A single instance must only
+// be used by one thread at a time. Reusing an instance for multiple
+// images avoids reallocating its working memory every time.
+//
+// The working memory comes from a scratch arena that is owned by the
+// quantizer. Once the arena has grown large enough for the images
+// that are processed, quantizing further images of up to that size
+// and number of colors does not allocate from the heap anymore. The
+// arena's allocation statistics show whether this is the case.
+//
+// Quantizing happens in two steps, compute_palette() and map_pixels().
+// They are separate so that they can run in different pipeline stages
+// when processing multiple images. quantize() runs both.
+class quantizer
+{
+public:
+	virtual ~quantizer()
+	{
+	}
+
+	base::allocation_stats const & get_allocation_stats() const
+	{
+		return m_scratch_arena.get_stats();
+	}
+
+	// Computes a palette for p_context.m_input_image, stores it in
+	// p_context.m_palette, and writes the palettized version of the
+	// input image into p_context.m_output_image.
+	//
+	// Returns false if the image could not be quantized.
+	bool quantize(context &p_context)
+	{
+		return compute_palette(p_context) && map_pixels(p_context);
+	}
+
+	// Computes a palette for p_context.m_input_image and stores it in
+	// p_context.m_palette. If the context has a transparent palette
+	// entry, m_palette gets one entry less than the configured palette
+	// size.
+	virtual bool compute_palette(context &p_context) = 0;
+
+	// Writes the palettized version of p_context.m_input_image into
+	// p_context.m_output_image. The mapping may use the state that
+	// compute_palette() left behind, so this must be called with the
+	// same context, after compute_palette() and before the next
+	// compute_palette() call.
+	virtual bool map_pixels(context &p_context) = 0;
+
+	// Returns the quantizer's own approximate nearest color lookup, or
+	// an empty function if it does not have one. Like map_pixels(), the
+	// lookup uses the state that compute_palette() left behind. Colors
+	// are in the color space of the context's metric. This is used for
+	// comparing the lookup with the exact one (see
+	// nearest_color_verification.hpp).
+	virtual std::function < std::size_t(graphics::color const &p_color) > get_approximate_nearest_color_function() const
+	{
+		return std::function < std::size_t(graphics::color const &p_color) > ();
+	}
+
+	// Returns true if the lookup from get_approximate_nearest_color_function()
+	// always finds the same palette index as the exact search, ties included.
+	virtual bool is_nearest_color_function_exact() const
+	{
+		return false;
+	}
+
+	// Creates a new quantizer with the same options, but with its own
+	// working memory.
+	virtual std::unique_ptr < quantizer > clone() const = 0;
+
+
+protected:
+	// Declared here so that it is constructed before, and destroyed
+	// after, the buffers of the derived classes that use it.
+	base::scratch_arena m_scratch_arena;
+};
+
+
+#endif // COLOR_QUANTIZATION_QUANTIZER_HPP______
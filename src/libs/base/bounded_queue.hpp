@@ -0,0 +1,182 @@
+#ifndef BOUNDED_QUEUE_HPP_________
+#define BOUNDED_QUEUE_HPP_________
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+
+namespace base
+{
+
+
+struct bounded_queue_stats
+{
+	std::size_t m_capacity;
+	unsigned long m_num_pushes;
+	// Number of push() calls that had to wait because the queue was
+	// full, and of pop() calls that had to wait because it was empty.
+	unsigned long m_num_full_waits;
+	unsigned long m_num_empty_waits;
+	// Largest number of queued items, and the number of queued items
+	// averaged over the lifetime of the queue.
+	std::size_t m_max_size;
+	double m_average_size;
+};
+
+
+/**
+ * FIFO queue with a fixed capacity for passing items between threads.
+ *
+ * push() blocks while the queue is full, and pop() blocks while it is
+ * empty. A full queue thus slows down its producers to the speed of its
+ * consumers (backpressure), and the memory held by queued items stays
+ * bounded.
+ *
+ * After close() was called, push() fails, and pop() fails once the
+ * remaining items are consumed. This is how consumers learn that
+ * nothing more is going to come.
+ *
+ * The statistics show how full the queue is on average. A queue that
+ * is mostly full has a slow consumer, one that is mostly empty has a
+ * slow producer.
+ */
+template < typename T >
+class bounded_queue
+{
+public:
+	explicit bounded_queue(std::size_t const p_capacity)
+		: m_capacity(std::max(p_capacity, std::size_t(1)))
+		, m_closed(false)
+		, m_num_pushes(0)
+		, m_num_full_waits(0)
+		, m_num_empty_waits(0)
+		, m_max_size(0)
+		, m_creation_time_point(clock::now())
+		, m_last_size_change_time_point(m_creation_time_point)
+		, m_size_time_integral(0.0)
+	{
+	}
+
+	bounded_queue(bounded_queue const &) = delete;
+	bounded_queue& operator = (bounded_queue const &) = delete;
+
+	// Returns false if the queue is closed. p_item is not
+	// queued then.
+	bool push(T p_item)
+	{
+		std::unique_lock < std::mutex > lock(m_mutex);
+
+		if (!m_closed && (m_items.size() >= m_capacity))
+		{
+			++m_num_full_waits;
+			m_not_full.wait(lock, [this]() { return m_closed || (m_items.size() < m_capacity); });
+		}
+
+		if (m_closed)
+			return false;
+
+		record_size_change();
+		m_items.push_back(std::move(p_item));
+		m_max_size = std::max(m_max_size, m_items.size());
+		++m_num_pushes;
+
+		lock.unlock();
+		m_not_empty.notify_one();
+
+		return true;
+	}
+
+	// Returns false if the queue is closed and empty.
+	bool pop(T &p_item)
+	{
+		std::unique_lock < std::mutex > lock(m_mutex);
+
+		if (!m_closed && m_items.empty())
+		{
+			++m_num_empty_waits;
+			m_not_empty.wait(lock, [this]() { return m_closed || !m_items.empty(); });
+		}
+
+		if (m_items.empty())
+			return false;
+
+		record_size_change();
+		p_item = std::move(m_items.front());
+		m_items.pop_front();
+
+		lock.unlock();
+		m_not_full.notify_one();
+
+		return true;
+	}
+
+	void close()
+	{
+		{
+			std::lock_guard < std::mutex > lock(m_mutex);
+			m_closed = true;
+		}
+
+		m_not_full.notify_all();
+		m_not_empty.notify_all();
+	}
+
+	bounded_queue_stats get_stats() const
+	{
+		std::lock_guard < std::mutex > lock(m_mutex);
+
+		clock::time_point now = clock::now();
+		double lifetime = std::chrono::duration < double > (now - m_creation_time_point).count();
+		double size_time_integral = m_size_time_integral + m_items.size() * std::chrono::duration < double > (now - m_last_size_change_time_point).count();
+
+		bounded_queue_stats stats;
+		stats.m_capacity = m_capacity;
+		stats.m_num_pushes = m_num_pushes;
+		stats.m_num_full_waits = m_num_full_waits;
+		stats.m_num_empty_waits = m_num_empty_waits;
+		stats.m_max_size = m_max_size;
+		stats.m_average_size = (lifetime > 0.0) ? (size_time_integral / lifetime) : 0.0;
+
+		return stats;
+	}
+
+
+private:
+	typedef std::chrono::steady_clock clock;
+
+	// Must be called with the mutex locked, before the size changes.
+	void record_size_change()
+	{
+		clock::time_point now = clock::now();
+		m_size_time_integral += m_items.size() * std::chrono::duration < double > (now - m_last_size_change_time_point).count();
+		m_last_size_change_time_point = now;
+	}
+
+	std::size_t const m_capacity;
+	bool m_closed;
+	std::deque < T > m_items;
+
+	mutable std::mutex m_mutex;
+	std::condition_variable m_not_full;
+	std::condition_variable m_not_empty;
+
+	unsigned long m_num_pushes;
+	unsigned long m_num_full_waits;
+	unsigned long m_num_empty_waits;
+	std::size_t m_max_size;
+	clock::time_point m_creation_time_point;
+	clock::time_point m_last_size_change_time_point;
+	// Sum of queue sizes multiplied by the time they lasted, in seconds.
+	double m_size_time_integral;
+};
+
+
+} // namespace base end
+
+
+#endif // BOUNDED_QUEUE_HPP_________
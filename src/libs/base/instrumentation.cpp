@@ -0,0 +1,217 @@
+#include <algorithm>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+#include "fmt/format.h"
+#include "instrumentation.hpp"
+
+
+namespace base
+{
+
+
+namespace
+{
+
+
+std::string escape_json_string(std::string const &p_string)
+{
+	std::string escaped;
+	escaped.reserve(p_string.size());
+
+	for (char c : p_string)
+	{
+		switch (c)
+		{
+			case '"': escaped += "\\\""; break;
+			case '\\': escaped += "\\\\"; break;
+			case '\n': escaped += "\\n"; break;
+			case '\r': escaped += "\\r"; break;
+			case '\t': escaped += "\\t"; break;
+			default:
+				if (static_cast < unsigned char > (c) < 0x20)
+					escaped += fmt::format("\\u{:04x}", int(c));
+				else
+					escaped += c;
+		}
+	}
+
+	return escaped;
+}
+
+
+std::string escape_csv_field(std::string const &p_string)
+{
+	if (p_string.find_first_of(",\"\r\n") == std::string::npos)
+		return p_string;
+
+	std::string escaped = "\"";
+	for (char c : p_string)
+	{
+		if (c == '"')
+			escaped += '"';
+		escaped += c;
+	}
+	escaped += '"';
+
+	return escaped;
+}
+
+
+void write_json(std::FILE *p_file, labelled_instrumentations const &p_instrumentations)
+{
+	fmt::print(p_file, "[\n");
+
+	for (std::size_t i = 0; i < p_instrumentations.size(); ++i)
+	{
+		instrumentation const &cur_instrumentation = p_instrumentations[i].second;
+		instrumentation::stages const &stages = cur_instrumentation.get_stages();
+		instrumentation::counters const &counters = cur_instrumentation.get_counters();
+
+		fmt::print(p_file, "  {{\n");
+		fmt::print(p_file, "    \"label\": \"{}\",\n", escape_json_string(p_instrumentations[i].first));
+
+		fmt::print(p_file, "    \"stages\": [");
+		for (std::size_t j = 0; j < stages.size(); ++j)
+		{
+			fmt::print(
+				p_file, "{}\n      {{ \"name\": \"{}\", \"seconds\": {:.6f}, \"peak_memory_bytes\": {} }}",
+				(j > 0) ? "," : "", escape_json_string(stages[j].m_name), stages[j].m_duration, stages[j].m_peak_memory_usage
+			);
+		}
+		fmt::print(p_file, "{}],\n", stages.empty() ? "" : "\n    ");
+
+		fmt::print(p_file, "    \"counters\": {{");
+		for (std::size_t j = 0; j < counters.size(); ++j)
+			fmt::print(p_file, "{}\n      \"{}\": {}", (j > 0) ? "," : "", escape_json_string(counters[j].m_name), counters[j].m_value);
+		fmt::print(p_file, "{}}}\n", counters.empty() ? "" : "\n    ");
+
+		fmt::print(p_file, "  }}{}\n", ((i + 1) < p_instrumentations.size()) ? "," : "");
+	}
+
+	fmt::print(p_file, "]\n");
+}
+
+
+void write_csv(std::FILE *p_file, labelled_instrumentations const &p_instrumentations)
+{
+	fmt::print(p_file, "label,type,name,value\n");
+
+	for (auto const &labelled_instrumentation : p_instrumentations)
+	{
+		std::string label = escape_csv_field(labelled_instrumentation.first);
+
+		for (auto const &stage : labelled_instrumentation.second.get_stages())
+		{
+			fmt::print(p_file, "{},stage_seconds,{},{:.6f}\n", label, escape_csv_field(stage.m_name), stage.m_duration);
+			fmt::print(p_file, "{},stage_peak_memory,{},{}\n", label, escape_csv_field(stage.m_name), stage.m_peak_memory_usage);
+		}
+
+		for (auto const &counter : labelled_instrumentation.second.get_counters())
+			fmt::print(p_file, "{},counter,{},{}\n", label, escape_csv_field(counter.m_name), counter.m_value);
+	}
+}
+
+
+} // unnamed namespace end
+
+
+instrumentation::instrumentation()
+{
+	// Enough for the stages and counters of a typical work item.
+	m_stages.reserve(32);
+	m_counters.reserve(64);
+}
+
+
+void instrumentation::add_stage(char const *p_name, double const p_duration)
+{
+	m_stages.push_back(stage { p_name, p_duration, get_peak_memory_usage() });
+}
+
+
+void instrumentation::add_to_counter(char const *p_name, unsigned long long const p_value)
+{
+	auto iter = std::find_if(m_counters.begin(), m_counters.end(), [p_name](counter const &p_counter) { return p_counter.m_name == p_name; });
+	if (iter != m_counters.end())
+		iter->m_value += p_value;
+	else
+		m_counters.push_back(counter { p_name, p_value });
+}
+
+
+unsigned long long instrumentation::get_counter(char const *p_name) const
+{
+	auto iter = std::find_if(m_counters.begin(), m_counters.end(), [p_name](counter const &p_counter) { return p_counter.m_name == p_name; });
+	return (iter != m_counters.end()) ? iter->m_value : 0;
+}
+
+
+void instrumentation::clear()
+{
+	m_stages.clear();
+	m_counters.clear();
+}
+
+
+scoped_stage_timer::scoped_stage_timer(instrumentation &p_instrumentation, char const *p_name)
+	: m_instrumentation(p_instrumentation)
+	, m_name(p_name)
+	, m_start_time_point(std::chrono::steady_clock::now())
+{
+}
+
+
+scoped_stage_timer::~scoped_stage_timer()
+{
+	std::chrono::duration < double > duration = std::chrono::steady_clock::now() - m_start_time_point;
+	m_instrumentation.add_stage(m_name, duration.count());
+}
+
+
+std::size_t get_peak_memory_usage()
+{
+#if defined(__unix__) || defined(__APPLE__)
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+
+#if defined(__APPLE__)
+	// Bytes on macOS.
+	return std::size_t(usage.ru_maxrss);
+#else
+	// Kilobytes elsewhere.
+	return std::size_t(usage.ru_maxrss) * 1024;
+#endif
+#else
+	return 0;
+#endif
+}
+
+
+bool parse_stats_format(std::string const &p_name, stats_format &p_format)
+{
+	if (p_name == "json")
+		p_format = stats_format::json;
+	else if (p_name == "csv")
+		p_format = stats_format::csv;
+	else
+		return false;
+
+	return true;
+}
+
+
+void write_stats(std::FILE *p_file, stats_format const p_format, labelled_instrumentations const &p_instrumentations)
+{
+	switch (p_format)
+	{
+		case stats_format::json: write_json(p_file, p_instrumentations); break;
+		case stats_format::csv: write_csv(p_file, p_instrumentations); break;
+	}
+
+	std::fflush(p_file);
+}
+
+
+} // namespace base end
@@ -0,0 +1,139 @@
+#ifndef INSTRUMENTATION_HPP_________
+#define INSTRUMENTATION_HPP_________
+
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+namespace base
+{
+
+
+/**
+ * Timings, counters and memory usage of one work item (like one image).
+ *
+ * Stages are timed with scoped_stage_timer, which records the duration
+ * of a stage along with the peak memory usage of the process at the
+ * end of the stage. Counters are identified by name, and values added
+ * to the same counter are summed up.
+ *
+ * Adding counter values looks up the counter by name. In hot loops,
+ * count into local variables instead, and add the totals afterwards.
+ *
+ * Stage names are not copied, so they must outlive the instrumentation
+ * (they typically are string literals). Together with the room that is
+ * reserved up front, recording stages and adding to existing counters
+ * does not allocate memory, so the instrumentation does not show up in
+ * the heap allocations of the work that it measures.
+ *
+ * Instances are not thread safe. Use one instance per work item.
+ */
+class instrumentation
+{
+public:
+	struct stage
+	{
+		char const *m_name;
+		// In seconds.
+		double m_duration;
+		// Peak resident memory usage of the whole process at the end
+		// of the stage, in bytes. 0 if it is not known.
+		std::size_t m_peak_memory_usage;
+	};
+
+	struct counter
+	{
+		std::string m_name;
+		unsigned long long m_value;
+	};
+
+	typedef std::vector < stage > stages;
+	typedef std::vector < counter > counters;
+
+	instrumentation();
+
+	void add_stage(char const *p_name, double const p_duration);
+	void add_to_counter(char const *p_name, unsigned long long const p_value);
+
+	// Returns 0 for counters that were never added to.
+	unsigned long long get_counter(char const *p_name) const;
+
+	stages const & get_stages() const
+	{
+		return m_stages;
+	}
+
+	counters const & get_counters() const
+	{
+		return m_counters;
+	}
+
+	void clear();
+
+
+private:
+	stages m_stages;
+	counters m_counters;
+};
+
+
+// Measures the time from its construction to its destruction, and adds
+// it to an instrumentation as a stage.
+class scoped_stage_timer
+{
+public:
+	explicit scoped_stage_timer(instrumentation &p_instrumentation, char const *p_name);
+	~scoped_stage_timer();
+
+	scoped_stage_timer(scoped_stage_timer const &) = delete;
+	scoped_stage_timer& operator = (scoped_stage_timer const &) = delete;
+
+
+private:
+	instrumentation &m_instrumentation;
+	char const *m_name;
+	std::chrono::steady_clock::time_point m_start_time_point;
+};
+
+
+// Peak resident memory usage of the process so far, in bytes.
+// Returns 0 on platforms where this is not available.
+std::size_t get_peak_memory_usage();
+
+
+enum class stats_format
+{
+	json,
+	csv
+};
+
+// Returns false if p_name is neither "json" nor "csv".
+bool parse_stats_format(std::string const &p_name, stats_format &p_format);
+
+
+// Instrumentations of several work items, each with a label
+// that identifies the item in the output (like a filename).
+typedef std::vector < std::pair < std::string, instrumentation > > labelled_instrumentations;
+
+/**
+ * Writes instrumentations to a file.
+ *
+ * JSON output is an array with one object per instrumentation, with
+ * the label, the stages (in the order they were recorded) and the
+ * counters.
+ *
+ * CSV output has one line per value, with the columns label, type,
+ * name and value. The type is "stage_seconds" or "stage_peak_memory"
+ * for stages, and "counter" for counters.
+ */
+void write_stats(std::FILE *p_file, stats_format const p_format, labelled_instrumentations const &p_instrumentations);
+
+
+} // namespace base end
+
+
+#endif // INSTRUMENTATION_HPP_________
@@ -5,8 +5,10 @@
 #include <vector>
 #include <iterator>
 #include <limits>
+#include <memory_resource>
 #include <type_traits>
 #include <assert.h>
+#include "custom_span.hpp"
 
 
 namespace base
@@ -31,10 +33,15 @@ struct kd_tree
 		}
 	};
 
-	typedef std::vector < node > nodes;
+	typedef std::pmr::vector < node > nodes;
 	typedef typename nodes::const_iterator const_iterator;
 	typedef typename nodes::iterator iterator;
 
+	explicit kd_tree(std::pmr::memory_resource *p_memory_resource = std::pmr::get_default_resource())
+		: m_nodes(p_memory_resource)
+	{
+	}
+
 	nodes m_nodes;
 };
 
@@ -57,11 +64,16 @@ void fill_node(kd_tree < Value > &p_kd_tree, std::size_t p_array_index, Iterator
 	typename std::iterator_traits < Iterator > ::difference_type num_values = std::distance(p_begin, p_end);
 	assert(num_values > 0);
 
+	auto median_value_iter = p_begin;
+	std::advance(median_value_iter, num_values / 2);
+
+	// Only the median needs to be in its sorted position, with
+	// the values on either side of it partitioned accordingly.
 	// NOTE: We assume here that the iterators themselves
-	// are not invalidated by std::sort(). The standard
-	// seems to guarantee this: https://stackoverflow.com/questions/3885482/does-a-vector-sort-invalidate-iterators/3885638#3885638
-	std::sort(
-		p_begin, p_end,
+	// are not invalidated by std::nth_element(). The standard
+	// seems to guarantee this (like for std::sort()): https://stackoverflow.com/questions/3885482/does-a-vector-sort-invalidate-iterators/3885638#3885638
+	std::nth_element(
+		p_begin, median_value_iter, p_end,
 		[p_level, &p_compare_predicate](Value const &p_first, Value const &p_second) -> bool {
 			return p_compare_predicate(p_first, p_second, p_level);
 		}
@@ -70,9 +82,6 @@ void fill_node(kd_tree < Value > &p_kd_tree, std::size_t p_array_index, Iterator
 	alloc_node(p_kd_tree, p_array_index);
 	auto &cur_node = p_kd_tree.m_nodes[p_array_index];
 
-	auto median_value_iter = p_begin;
-	std::advance(median_value_iter, num_values / 2);
-
 	cur_node.m_value = p_assign_from_input(*median_value_iter);
 	cur_node.m_level = p_level;
 	cur_node.m_occupied = true;
@@ -132,6 +141,75 @@ void find_nearest_node(kd_tree < Value > const &p_kd_tree, SearchValue const &p_
 }
 
 
+template < typename Value, typename SearchValue, typename CalcDistanceFunc, typename CalcPlaneDistanceFunc >
+void find_nearest_node_seeded(kd_tree < Value > const &p_kd_tree, SearchValue const &p_search_value, std::size_t &p_nearest_node_index, CalcDistanceFunc &p_calc_distance_func, CalcPlaneDistanceFunc &p_calc_plane_distance_func)
+{
+	// Start with the node given by p_nearest_node_index (typically the
+	// result of a previous search). Its distance is an upper bound for
+	// the nearest distance, and for coherent searches, usually a tight
+	// one. The root is skipped by find_nearest_node(), so check it here.
+	auto cur_min_kd_distance = p_calc_distance_func(p_kd_tree.m_nodes[p_nearest_node_index].m_value, p_search_value);
+	if (p_nearest_node_index != 0)
+	{
+		auto root_kd_distance = p_calc_distance_func(p_kd_tree.m_nodes[0].m_value, p_search_value);
+		if (root_kd_distance < cur_min_kd_distance)
+		{
+			cur_min_kd_distance = root_kd_distance;
+			p_nearest_node_index = 0;
+		}
+	}
+
+	find_nearest_node(p_kd_tree, p_search_value, 0, p_nearest_node_index, cur_min_kd_distance, p_calc_distance_func, p_calc_plane_distance_func);
+}
+
+
+template < typename Value, typename SearchValue, typename Distance, typename CalcDistanceFunc, typename CalcPlaneDistanceFunc >
+void find_k_nearest_nodes(kd_tree < Value > const &p_kd_tree, SearchValue const &p_search_value, size_t p_array_index, nonstd::span < std::size_t > p_nearest_node_indices, nonstd::span < Distance > p_nearest_distances, std::size_t &p_num_found, CalcDistanceFunc &p_calc_distance_func, CalcPlaneDistanceFunc &p_calc_plane_distance_func)
+{
+	auto const &cur_node = p_kd_tree.m_nodes[p_array_index];
+	std::size_t k = p_nearest_node_indices.size();
+
+	// The k nearest nodes found so far are kept sorted by
+	// distance, in ascending order. k is expected to be small,
+	// so a plain insertion is cheaper than a heap here.
+	Distance kd_distance = p_calc_distance_func(cur_node.m_value, p_search_value);
+	if ((p_num_found < k) || (kd_distance < p_nearest_distances[k - 1]))
+	{
+		std::size_t insert_pos = std::min(p_num_found, k - 1);
+		while ((insert_pos > 0) && (kd_distance < p_nearest_distances[insert_pos - 1]))
+		{
+			p_nearest_distances[insert_pos] = p_nearest_distances[insert_pos - 1];
+			p_nearest_node_indices[insert_pos] = p_nearest_node_indices[insert_pos - 1];
+			--insert_pos;
+		}
+
+		p_nearest_distances[insert_pos] = kd_distance;
+		p_nearest_node_indices[insert_pos] = p_array_index;
+
+		if (p_num_found < k)
+			++p_num_found;
+	}
+
+	Distance kd_plane_distance = p_calc_plane_distance_func(cur_node.m_value, p_search_value, cur_node.m_level);
+
+	std::size_t child0_array_index = 2 * p_array_index + 1;
+	std::size_t child1_array_index = 2 * p_array_index + 2;
+	bool has_child0 = (child0_array_index < p_kd_tree.m_nodes.size()) && p_kd_tree.m_nodes[child0_array_index].m_occupied;
+	bool has_child1 = (child1_array_index < p_kd_tree.m_nodes.size()) && p_kd_tree.m_nodes[child1_array_index].m_occupied;
+
+	std::size_t near_child_array_index = (kd_plane_distance >= 0) ? child1_array_index : child0_array_index;
+	std::size_t far_child_array_index  = (kd_plane_distance >= 0) ? child0_array_index : child1_array_index;
+	bool has_near_child = (kd_plane_distance >= 0) ? has_child1 : has_child0;
+	bool has_far_child  = (kd_plane_distance >= 0) ? has_child0 : has_child1;
+	Distance abs_kd_plane_distance = (kd_plane_distance >= 0) ? kd_plane_distance : -kd_plane_distance;
+
+	if (has_near_child)
+		find_k_nearest_nodes(p_kd_tree, p_search_value, near_child_array_index, p_nearest_node_indices, p_nearest_distances, p_num_found, p_calc_distance_func, p_calc_plane_distance_func);
+	if (has_far_child && ((p_num_found < k) || (abs_kd_plane_distance < p_nearest_distances[k - 1])))
+		find_k_nearest_nodes(p_kd_tree, p_search_value, far_child_array_index, p_nearest_node_indices, p_nearest_distances, p_num_found, p_calc_distance_func, p_calc_plane_distance_func);
+}
+
+
 template < typename InputValue, typename OutputValue >
 struct default_assign_from_input
 {
@@ -225,6 +303,203 @@ auto find_nearest(kd_tree < Value > &p_kd_tree, SearchValue const &p_search_valu
 }
 
 
+/**
+ * Find the nearest nodes for a batch of search values.
+ *
+ * The search values are processed in the order they are given in.
+ * Each search is seeded with the result of the previous one, so
+ * coherent batches (like a row of neighbouring pixels) prune most of
+ * the tree right away instead of starting at the root's distance.
+ * Use the overload with a sort key to reorder incoherent batches.
+ *
+ * @param p_kd_tree kd-tree to search in.
+ * @param p_search_values Values to find the nearest nodes for.
+ * @param p_nearest_node_indices Output span for the array indices of the
+ *        nearest nodes (see kd_tree::m_nodes). Must have the same size as
+ *        p_search_values. If the tree is empty, all indices are set to
+ *        the size of kd_tree::m_nodes.
+ * @param p_calc_distance_func Distance function, same as in find_nearest().
+ * @param p_calc_plane_distance_func Plane distance function, same as in find_nearest().
+ */
+template < typename Value, typename SearchValue, typename CalcDistanceFunc, typename CalcPlaneDistanceFunc >
+void find_nearest_batch(kd_tree < Value > const &p_kd_tree, nonstd::span < SearchValue const > p_search_values, nonstd::span < std::size_t > p_nearest_node_indices, CalcDistanceFunc p_calc_distance_func, CalcPlaneDistanceFunc p_calc_plane_distance_func)
+{
+	assert(p_search_values.size() == p_nearest_node_indices.size());
+
+	if (p_kd_tree.m_nodes.empty())
+	{
+		std::fill(p_nearest_node_indices.begin(), p_nearest_node_indices.end(), p_kd_tree.m_nodes.size());
+		return;
+	}
+
+	std::size_t nearest_node_index = 0;
+
+	for (std::size_t i = 0; i < std::size_t(p_search_values.size()); ++i)
+	{
+		detail::find_nearest_node_seeded(p_kd_tree, p_search_values[i], nearest_node_index, p_calc_distance_func, p_calc_plane_distance_func);
+		p_nearest_node_indices[i] = nearest_node_index;
+	}
+}
+
+
+/**
+ * Find the nearest nodes for a batch of search values, in sort key order.
+ *
+ * This is like the other find_nearest_batch() overload, except that
+ * the search values are visited in the order of their sort keys. This
+ * is useful for batches that are not spatially coherent by themselves.
+ * The results are still written in the original order.
+ *
+ * @param p_sort_key_func Function that returns a sort key (anything
+ *        that is comparable with operator <) for a search value.
+ * @param p_permutation Scratch span for the visiting order. Must have
+ *        the same size as p_search_values.
+ */
+template < typename Value, typename SearchValue, typename CalcDistanceFunc, typename CalcPlaneDistanceFunc, typename SortKeyFunc >
+void find_nearest_batch(kd_tree < Value > const &p_kd_tree, nonstd::span < SearchValue const > p_search_values, nonstd::span < std::size_t > p_nearest_node_indices, nonstd::span < std::size_t > p_permutation, CalcDistanceFunc p_calc_distance_func, CalcPlaneDistanceFunc p_calc_plane_distance_func, SortKeyFunc p_sort_key_func)
+{
+	assert(p_search_values.size() == p_nearest_node_indices.size());
+	assert(p_search_values.size() == p_permutation.size());
+
+	for (std::size_t i = 0; i < std::size_t(p_permutation.size()); ++i)
+		p_permutation[i] = i;
+
+	std::sort(
+		p_permutation.begin(), p_permutation.end(),
+		[&](std::size_t p_first, std::size_t p_second) -> bool {
+			return p_sort_key_func(p_search_values[p_first]) < p_sort_key_func(p_search_values[p_second]);
+		}
+	);
+
+	if (p_kd_tree.m_nodes.empty())
+	{
+		std::fill(p_nearest_node_indices.begin(), p_nearest_node_indices.end(), p_kd_tree.m_nodes.size());
+		return;
+	}
+
+	std::size_t nearest_node_index = 0;
+
+	for (std::size_t i = 0; i < std::size_t(p_permutation.size()); ++i)
+	{
+		std::size_t search_value_index = p_permutation[i];
+		detail::find_nearest_node_seeded(p_kd_tree, p_search_values[search_value_index], nearest_node_index, p_calc_distance_func, p_calc_plane_distance_func);
+		p_nearest_node_indices[search_value_index] = nearest_node_index;
+	}
+}
+
+
+/**
+ * Find the k nearest nodes for a search value.
+ *
+ * k is given by the size of p_nearest_node_indices. The results are
+ * sorted by distance in ascending order, so the first entry is the
+ * same node find_nearest() would return (up to ties), and k = 2 yields
+ * the nearest pair of candidates.
+ *
+ * @param p_nearest_node_indices Output span for the array indices of the
+ *        k nearest nodes.
+ * @param p_nearest_distances Output span for the distances of the k
+ *        nearest nodes. Must have the same size as p_nearest_node_indices.
+ * @return Number of nodes found. This is less than k if the tree
+ *         contains less than k nodes. Unfilled entries are set to the
+ *         size of kd_tree::m_nodes.
+ */
+template < typename Value, typename SearchValue, typename Distance, typename CalcDistanceFunc, typename CalcPlaneDistanceFunc >
+std::size_t find_k_nearest(kd_tree < Value > const &p_kd_tree, SearchValue const &p_search_value, nonstd::span < std::size_t > p_nearest_node_indices, nonstd::span < Distance > p_nearest_distances, CalcDistanceFunc p_calc_distance_func, CalcPlaneDistanceFunc p_calc_plane_distance_func)
+{
+	assert(p_nearest_node_indices.size() == p_nearest_distances.size());
+
+	std::fill(p_nearest_node_indices.begin(), p_nearest_node_indices.end(), p_kd_tree.m_nodes.size());
+
+	if (p_kd_tree.m_nodes.empty() || p_nearest_node_indices.empty())
+		return 0;
+
+	std::size_t num_found = 0;
+	detail::find_k_nearest_nodes(p_kd_tree, p_search_value, 0, p_nearest_node_indices, p_nearest_distances, num_found, p_calc_distance_func, p_calc_plane_distance_func);
+
+	return num_found;
+}
+
+
+/**
+ * Find the k nearest nodes for a batch of search values.
+ *
+ * The output spans are laid out as consecutive groups of k entries,
+ * one group per search value. Within each group, entries are sorted
+ * like in find_k_nearest().
+ *
+ * @param p_k Number of nearest nodes to find per search value.
+ * @param p_nearest_node_indices Output span for the node array indices.
+ *        Must have p_search_values.size() * p_k entries.
+ * @param p_nearest_distances Output span for the distances. Must have
+ *        p_search_values.size() * p_k entries.
+ */
+template < typename Value, typename SearchValue, typename Distance, typename CalcDistanceFunc, typename CalcPlaneDistanceFunc >
+void find_k_nearest_batch(kd_tree < Value > const &p_kd_tree, nonstd::span < SearchValue const > p_search_values, std::size_t p_k, nonstd::span < std::size_t > p_nearest_node_indices, nonstd::span < Distance > p_nearest_distances, CalcDistanceFunc p_calc_distance_func, CalcPlaneDistanceFunc p_calc_plane_distance_func)
+{
+	assert(std::size_t(p_nearest_node_indices.size()) == std::size_t(p_search_values.size()) * p_k);
+	assert(std::size_t(p_nearest_distances.size()) == std::size_t(p_search_values.size()) * p_k);
+
+	for (std::size_t i = 0; i < std::size_t(p_search_values.size()); ++i)
+	{
+		find_k_nearest(
+			p_kd_tree,
+			p_search_values[i],
+			p_nearest_node_indices.subspan(i * p_k, p_k),
+			p_nearest_distances.subspan(i * p_k, p_k),
+			p_calc_distance_func,
+			p_calc_plane_distance_func
+		);
+	}
+}
+
+
+/**
+ * Compute an aggregate of the values in each node's subtree.
+ *
+ * This is for algorithms that process whole subtrees at once, like
+ * filtering k-means, which needs the sum, the count and the bounding
+ * box of the values in a subtree. The children of a node have larger
+ * array indices than the node, so the nodes are visited in reverse
+ * array order, and each subtree is only aggregated once.
+ *
+ * @param p_aggregates Output vector (a std::vector or a std::pmr::vector
+ *        of aggregates). It is resized to the size of
+ *        kd_tree::m_nodes, and has the aggregate of the subtree of
+ *        each occupied node at the node's array index.
+ * @param p_make_aggregate_func Function that returns the aggregate
+ *        of a single node value.
+ * @param p_combine_aggregates_func Function that adds the aggregate
+ *        given as second argument to the one given as first argument.
+ */
+template < typename Value, typename Aggregates, typename MakeAggregateFunc, typename CombineAggregatesFunc >
+void compute_subtree_aggregates(kd_tree < Value > const &p_kd_tree, Aggregates &p_aggregates, MakeAggregateFunc p_make_aggregate_func, CombineAggregatesFunc p_combine_aggregates_func)
+{
+	typedef typename Aggregates::value_type Aggregate;
+
+	std::size_t const num_nodes = p_kd_tree.m_nodes.size();
+	p_aggregates.resize(num_nodes);
+
+	for (std::size_t array_index = num_nodes; array_index-- > 0;)
+	{
+		auto const &cur_node = p_kd_tree.m_nodes[array_index];
+		if (!cur_node.m_occupied)
+			continue;
+
+		Aggregate aggregate = p_make_aggregate_func(cur_node.m_value);
+
+		std::size_t child0_array_index = 2 * array_index + 1;
+		std::size_t child1_array_index = 2 * array_index + 2;
+		if ((child0_array_index < num_nodes) && p_kd_tree.m_nodes[child0_array_index].m_occupied)
+			p_combine_aggregates_func(aggregate, p_aggregates[child0_array_index]);
+		if ((child1_array_index < num_nodes) && p_kd_tree.m_nodes[child1_array_index].m_occupied)
+			p_combine_aggregates_func(aggregate, p_aggregates[child1_array_index]);
+
+		p_aggregates[array_index] = std::move(aggregate);
+	}
+}
+
+
 } // namespace base end
 
 
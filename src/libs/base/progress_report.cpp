@@ -1,5 +1,7 @@
-#include <assert.h>
-#include "fmt/ostream.h"
+#include <algorithm>
+#include <cstdio>
+#include <mutex>
+#include "fmt/format.h"
 #include "progress_report.hpp"
 
 
@@ -7,36 +9,56 @@ namespace base
 {
 
 
-timed_progress_report::timed_progress_report(std::chrono::steady_clock::duration p_min_time_between_reports, progress_report_callback p_progress_report_callback)
-	: m_min_time_between_reports(p_min_time_between_reports)
-	, m_progress_report_callback(std::move(p_progress_report_callback))
+namespace
+{
+
+
+// Serializes the output of all progress reports.
+std::mutex output_mutex;
+
+
+} // unnamed namespace end
+
+
+progress_report::progress_report()
+	: m_text(nullptr)
+	, m_label(nullptr)
+	, m_min_time_between_reports(0)
+	, m_next_check_progress(0)
 {
-	assert(m_progress_report_callback);
 }
 
 
-void timed_progress_report::operator()(std::size_t p_progress, std::size_t p_max_progress) const
+progress_report::progress_report(char const *p_text, char const *p_label, std::chrono::steady_clock::duration p_min_time_between_reports)
+	: m_text(p_text)
+	, m_label(p_label)
+	, m_min_time_between_reports(p_min_time_between_reports)
+	, m_next_check_progress(0)
 {
+}
+
+
+void progress_report::check(unsigned long p_progress, unsigned long p_max_progress)
+{
+	// Check again after another 0.1% of progress.
+	m_next_check_progress = p_progress + std::max(p_max_progress / 1000, 1ul);
+
 	auto now = std::chrono::steady_clock::now();
 	auto time_since_last_report = now - m_last_report_time_point;
 
-	if ((time_since_last_report >= m_min_time_between_reports) || (p_progress == p_max_progress))
-	{
-		m_progress_report_callback(p_progress, p_max_progress);
-		m_last_report_time_point = now;
-	}
-}
+	if ((time_since_last_report < m_min_time_between_reports) && (p_progress != p_max_progress))
+		return;
 
+	m_last_report_time_point = now;
 
-timed_progress_report make_ostream_progress_report(std::ostream &p_ostream, std::string p_text, std::chrono::steady_clock::duration p_min_time_between_reports)
-{
-	return timed_progress_report {
-		p_min_time_between_reports,
-		[text = std::move(p_text), &p_ostream](unsigned long p_progress, unsigned long p_max_progress) -> void {
-			int progress_percent = p_progress * 100 / p_max_progress;
-			fmt::print(p_ostream, "{}: {}%\r", text, progress_percent);
-		}
-	};
+	int progress_percent = (p_max_progress > 0) ? int(p_progress * 100 / p_max_progress) : 100;
+
+	std::lock_guard < std::mutex > lock(output_mutex);
+	if (m_label != nullptr)
+		fmt::print(stderr, "{}: {}: {}%\r", m_label, m_text, progress_percent);
+	else
+		fmt::print(stderr, "{}: {}%\r", m_text, progress_percent);
+	std::fflush(stderr);
 }
 
 
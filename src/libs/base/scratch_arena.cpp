@@ -0,0 +1,75 @@
+#include <algorithm>
+#include "scratch_arena.hpp"
+
+
+namespace base
+{
+
+
+namespace
+{
+
+
+std::pmr::pool_options make_pool_options()
+{
+	std::pmr::pool_options options;
+	// Pool anything up to 1 MB. Bigger blocks are typically
+	// long-lived buffers, which are better off being reused
+	// by their owners.
+	options.largest_required_pool_block = 1024 * 1024;
+	return options;
+}
+
+
+} // unnamed namespace end
+
+
+allocation_stats::allocation_stats()
+	: m_num_heap_allocations(0)
+	, m_num_heap_deallocations(0)
+	, m_num_heap_bytes(0)
+	, m_peak_num_heap_bytes(0)
+{
+}
+
+
+scratch_arena::scratch_arena()
+	: m_pool_resource(make_pool_options(), &m_heap_resource)
+{
+}
+
+
+void scratch_arena::release()
+{
+	m_pool_resource.release();
+}
+
+
+void* scratch_arena::counting_heap_resource::do_allocate(std::size_t p_num_bytes, std::size_t p_alignment)
+{
+	void *pointer = std::pmr::new_delete_resource()->allocate(p_num_bytes, p_alignment);
+
+	++m_stats.m_num_heap_allocations;
+	m_stats.m_num_heap_bytes += p_num_bytes;
+	m_stats.m_peak_num_heap_bytes = std::max(m_stats.m_peak_num_heap_bytes, m_stats.m_num_heap_bytes);
+
+	return pointer;
+}
+
+
+void scratch_arena::counting_heap_resource::do_deallocate(void *p_pointer, std::size_t p_num_bytes, std::size_t p_alignment)
+{
+	std::pmr::new_delete_resource()->deallocate(p_pointer, p_num_bytes, p_alignment);
+
+	++m_stats.m_num_heap_deallocations;
+	m_stats.m_num_heap_bytes -= p_num_bytes;
+}
+
+
+bool scratch_arena::counting_heap_resource::do_is_equal(std::pmr::memory_resource const &p_other) const noexcept
+{
+	return this == &p_other;
+}
+
+
+} // namespace base end
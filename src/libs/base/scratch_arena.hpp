@@ -0,0 +1,86 @@
+#ifndef SCRATCH_ARENA_HPP_________
+#define SCRATCH_ARENA_HPP_________
+
+#include <cstddef>
+#include <memory_resource>
+
+
+namespace base
+{
+
+
+struct allocation_stats
+{
+	// Allocations and deallocations that reached the heap.
+	unsigned long m_num_heap_allocations;
+	unsigned long m_num_heap_deallocations;
+	// Number of bytes currently allocated from the heap, and the
+	// largest number of bytes that were allocated at any one time.
+	std::size_t m_num_heap_bytes;
+	std::size_t m_peak_num_heap_bytes;
+
+	allocation_stats();
+};
+
+
+/**
+ * Pool of memory for scratch buffers that are needed over and over,
+ * such as the working memory of an algorithm that runs once per image.
+ *
+ * Containers use the arena through get_memory_resource(), typically
+ * as std::pmr containers. Memory that they release goes back into
+ * the arena's pools instead of back to the heap. Once the arena has
+ * grown large enough, no more heap allocations take place, which can
+ * be checked with get_stats().
+ *
+ * Allocations that are too large for the pools go straight to the
+ * heap. Buffers of that size should be kept alive and reused instead
+ * of being freed and allocated again.
+ *
+ * Scratch arenas are not thread safe. Use one arena per thread.
+ */
+class scratch_arena
+{
+public:
+	scratch_arena();
+
+	scratch_arena(scratch_arena const &) = delete;
+	scratch_arena& operator = (scratch_arena const &) = delete;
+
+	std::pmr::memory_resource* get_memory_resource()
+	{
+		return &m_pool_resource;
+	}
+
+	allocation_stats const & get_stats() const
+	{
+		return m_heap_resource.m_stats;
+	}
+
+	// Returns all pooled memory to the heap. All containers that
+	// use this arena must have been destroyed before calling this.
+	void release();
+
+
+private:
+	class counting_heap_resource
+		: public std::pmr::memory_resource
+	{
+	public:
+		allocation_stats m_stats;
+
+	private:
+		void* do_allocate(std::size_t p_num_bytes, std::size_t p_alignment) override;
+		void do_deallocate(void *p_pointer, std::size_t p_num_bytes, std::size_t p_alignment) override;
+		bool do_is_equal(std::pmr::memory_resource const &p_other) const noexcept override;
+	};
+
+	counting_heap_resource m_heap_resource;
+	std::pmr::unsynchronized_pool_resource m_pool_resource;
+};
+
+
+} // namespace base end
+
+
+#endif // SCRATCH_ARENA_HPP_________
@@ -0,0 +1,177 @@
+#include <algorithm>
+#include <cstring>
+#include "sha256.hpp"
+
+
+namespace base
+{
+
+
+namespace
+{
+
+
+std::uint32_t const round_constants[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+
+inline std::uint32_t rotate_right(std::uint32_t const p_value, unsigned int const p_num_bits)
+{
+	return (p_value >> p_num_bits) | (p_value << (32 - p_num_bits));
+}
+
+
+} // unnamed namespace end
+
+
+sha256::sha256()
+	: m_state({ 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 })
+	, m_num_block_bytes(0)
+	, m_num_total_bytes(0)
+{
+}
+
+
+void sha256::update(void const *p_data, std::size_t const p_num_bytes)
+{
+	std::uint8_t const *data = reinterpret_cast < std::uint8_t const * > (p_data);
+	std::size_t num_bytes = p_num_bytes;
+
+	m_num_total_bytes += num_bytes;
+
+	// Complete a partially filled block first.
+	if (m_num_block_bytes > 0)
+	{
+		std::size_t num_copied_bytes = std::min(num_bytes, std::size_t(block_size) - m_num_block_bytes);
+		std::memcpy(&m_block[m_num_block_bytes], data, num_copied_bytes);
+		m_num_block_bytes += num_copied_bytes;
+		data += num_copied_bytes;
+		num_bytes -= num_copied_bytes;
+
+		if (m_num_block_bytes < block_size)
+			return;
+
+		process_block(m_block.data());
+		m_num_block_bytes = 0;
+	}
+
+	// Whole blocks are processed in place.
+	for (; num_bytes >= block_size; data += block_size, num_bytes -= block_size)
+		process_block(data);
+
+	std::memcpy(m_block.data(), data, num_bytes);
+	m_num_block_bytes = num_bytes;
+}
+
+
+void sha256::update_uint64(std::uint64_t const p_value)
+{
+	std::uint8_t bytes[8];
+	for (unsigned int i = 0; i < 8; ++i)
+		bytes[i] = std::uint8_t(p_value >> (i * 8));
+	update(bytes, sizeof(bytes));
+}
+
+
+void sha256::update_string(std::string const &p_string)
+{
+	update_uint64(p_string.size());
+	update(p_string.data(), p_string.size());
+}
+
+
+sha256::digest sha256::finish()
+{
+	std::uint64_t num_total_bits = m_num_total_bytes * 8;
+
+	// Pad with a 1 bit, then zeros up to the last 8 bytes of a
+	// block, which get the message length in big-endian order.
+	std::uint8_t padding[block_size + 8] = { 0x80 };
+	std::size_t num_padding_bytes = ((m_num_block_bytes < 56) ? 56 : (56 + block_size)) - m_num_block_bytes;
+	for (unsigned int i = 0; i < 8; ++i)
+		padding[num_padding_bytes + i] = std::uint8_t(num_total_bits >> ((7 - i) * 8));
+	update(padding, num_padding_bytes + 8);
+
+	digest result;
+	for (std::size_t i = 0; i < m_state.size(); ++i)
+	{
+		for (unsigned int j = 0; j < 4; ++j)
+			result[i * 4 + j] = std::uint8_t(m_state[i] >> ((3 - j) * 8));
+	}
+
+	return result;
+}
+
+
+void sha256::process_block(std::uint8_t const *p_block)
+{
+	std::uint32_t schedule[64];
+
+	for (unsigned int i = 0; i < 16; ++i)
+	{
+		schedule[i] =
+			(std::uint32_t(p_block[i * 4 + 0]) << 24) |
+			(std::uint32_t(p_block[i * 4 + 1]) << 16) |
+			(std::uint32_t(p_block[i * 4 + 2]) << 8) |
+			std::uint32_t(p_block[i * 4 + 3]);
+	}
+
+	for (unsigned int i = 16; i < 64; ++i)
+	{
+		std::uint32_t s0 = rotate_right(schedule[i - 15], 7) ^ rotate_right(schedule[i - 15], 18) ^ (schedule[i - 15] >> 3);
+		std::uint32_t s1 = rotate_right(schedule[i - 2], 17) ^ rotate_right(schedule[i - 2], 19) ^ (schedule[i - 2] >> 10);
+		schedule[i] = schedule[i - 16] + s0 + schedule[i - 7] + s1;
+	}
+
+	std::uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+	std::uint32_t e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+
+	for (unsigned int i = 0; i < 64; ++i)
+	{
+		std::uint32_t s1 = rotate_right(e, 6) ^ rotate_right(e, 11) ^ rotate_right(e, 25);
+		std::uint32_t choice = (e & f) ^ (~e & g);
+		std::uint32_t temp1 = h + s1 + choice + round_constants[i] + schedule[i];
+		std::uint32_t s0 = rotate_right(a, 2) ^ rotate_right(a, 13) ^ rotate_right(a, 22);
+		std::uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+		std::uint32_t temp2 = s0 + majority;
+
+		h = g;
+		g = f;
+		f = e;
+		e = d + temp1;
+		d = c;
+		c = b;
+		b = a;
+		a = temp1 + temp2;
+	}
+
+	m_state[0] += a; m_state[1] += b; m_state[2] += c; m_state[3] += d;
+	m_state[4] += e; m_state[5] += f; m_state[6] += g; m_state[7] += h;
+}
+
+
+std::string to_hex_string(sha256::digest const &p_digest)
+{
+	static char const hex_digits[] = "0123456789abcdef";
+
+	std::string result;
+	result.reserve(p_digest.size() * 2);
+	for (std::uint8_t byte : p_digest)
+	{
+		result += hex_digits[byte >> 4];
+		result += hex_digits[byte & 0x0F];
+	}
+
+	return result;
+}
+
+
+} // namespace base end
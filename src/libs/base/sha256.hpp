@@ -0,0 +1,62 @@
+#ifndef SHA256_HPP_________
+#define SHA256_HPP_________
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+
+namespace base
+{
+
+
+/**
+ * Incremental SHA-256 hash, as specified in FIPS 180-4.
+ *
+ * This is meant for content keys, like the keys of on-disk caches, where
+ * different contents must not end up with the same key. Data is added
+ * with update(), in as many pieces as needed; the digest is the same as
+ * if all data had been added at once.
+ */
+class sha256
+{
+public:
+	enum { digest_size = 32, block_size = 64 };
+
+	typedef std::array < std::uint8_t, digest_size > digest;
+
+	sha256();
+
+	void update(void const *p_data, std::size_t const p_num_bytes);
+
+	// Adds the value as 8 bytes in little-endian order, so that
+	// the digest does not depend on the byte order of the machine.
+	void update_uint64(std::uint64_t const p_value);
+
+	// Adds the string along with its length, so that consecutive
+	// strings cannot be confused with differently split ones.
+	void update_string(std::string const &p_string);
+
+	// Finishes the hash. The object must not be updated afterwards.
+	digest finish();
+
+
+private:
+	void process_block(std::uint8_t const *p_block);
+
+	std::array < std::uint32_t, 8 > m_state;
+	std::array < std::uint8_t, block_size > m_block;
+	std::size_t m_num_block_bytes;
+	std::uint64_t m_num_total_bytes;
+};
+
+
+// Lowercase hexadecimal form of a digest.
+std::string to_hex_string(sha256::digest const &p_digest);
+
+
+} // namespace base end
+
+
+#endif // SHA256_HPP_________
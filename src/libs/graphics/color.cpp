@@ -11,16 +11,23 @@ color::color()
 
 
 color::color(int const p_red, int const p_green, int const p_blue)
-	: m_rgb_values {{ p_red, p_green, p_blue }}
+	: m_rgba_values {{ p_red, p_green, p_blue, opaque_alpha }}
+{
+}
+
+
+color::color(int const p_red, int const p_green, int const p_blue, int const p_alpha)
+	: m_rgba_values {{ p_red, p_green, p_blue, p_alpha }}
 {
 }
 
 
 color& color::operator += (color const &p_other)
 {
-	m_rgb_values[0] += p_other.m_rgb_values[0];
-	m_rgb_values[1] += p_other.m_rgb_values[1];
-	m_rgb_values[2] += p_other.m_rgb_values[2];
+	m_rgba_values[0] += p_other.m_rgba_values[0];
+	m_rgba_values[1] += p_other.m_rgba_values[1];
+	m_rgba_values[2] += p_other.m_rgba_values[2];
+	m_rgba_values[3] += p_other.m_rgba_values[3];
 
 	return *this;
 }
@@ -28,9 +35,10 @@ color& color::operator += (color const &p_other)
 
 color& color::operator -= (color const &p_other)
 {
-	m_rgb_values[0] -= p_other.m_rgb_values[0];
-	m_rgb_values[1] -= p_other.m_rgb_values[1];
-	m_rgb_values[2] -= p_other.m_rgb_values[2];
+	m_rgba_values[0] -= p_other.m_rgba_values[0];
+	m_rgba_values[1] -= p_other.m_rgba_values[1];
+	m_rgba_values[2] -= p_other.m_rgba_values[2];
+	m_rgba_values[3] -= p_other.m_rgba_values[3];
 
 	return *this;
 }
@@ -38,9 +46,10 @@ color& color::operator -= (color const &p_other)
 
 color& color::operator *= (int const p_value)
 {
-	m_rgb_values[0] *= p_value;
-	m_rgb_values[1] *= p_value;
-	m_rgb_values[2] *= p_value;
+	m_rgba_values[0] *= p_value;
+	m_rgba_values[1] *= p_value;
+	m_rgba_values[2] *= p_value;
+	m_rgba_values[3] *= p_value;
 
 	return *this;
 }
@@ -48,9 +57,10 @@ color& color::operator *= (int const p_value)
 
 color& color::operator /= (int const p_value)
 {
-	m_rgb_values[0] /= p_value;
-	m_rgb_values[1] /= p_value;
-	m_rgb_values[2] /= p_value;
+	m_rgba_values[0] /= p_value;
+	m_rgba_values[1] /= p_value;
+	m_rgba_values[2] /= p_value;
+	m_rgba_values[3] /= p_value;
 
 	return *this;
 }
@@ -90,27 +100,34 @@ color operator / (color const &p_color, int const p_value)
 
 bool operator < (color const &p_first, color const &p_second)
 {
-	return p_first.m_rgb_values < p_second.m_rgb_values;
+	return p_first.m_rgba_values < p_second.m_rgba_values;
 }
 
 
 bool operator == (color const &p_first, color const &p_second)
 {
-	return p_first.m_rgb_values == p_second.m_rgb_values;
+	return p_first.m_rgba_values == p_second.m_rgba_values;
 }
 
 
 bool operator != (color const &p_first, color const &p_second)
 {
-	return p_first.m_rgb_values != p_second.m_rgb_values;
+	return p_first.m_rgba_values != p_second.m_rgba_values;
 }
 
 
 std::string to_string(color const &p_color)
 {
-	return       std::to_string(p_color.m_rgb_values[0])
-	     + "," + std::to_string(p_color.m_rgb_values[1])
-	     + "," + std::to_string(p_color.m_rgb_values[2]);
+	std::string rgb_string =
+	             std::to_string(p_color.m_rgba_values[0])
+	     + "," + std::to_string(p_color.m_rgba_values[1])
+	     + "," + std::to_string(p_color.m_rgba_values[2]);
+
+	// Only mention alpha if it is relevant.
+	if (p_color.alpha() != color::opaque_alpha)
+		return rgb_string + "," + std::to_string(p_color.alpha());
+	else
+		return rgb_string;
 }
 
 
@@ -120,12 +137,12 @@ long calculate_color_distance(color const &p_first, color const &p_second)
 	// "A low-cost approximation". sqrt() omitted, since we need
 	// the distance only for comparisons and for range searches.
 
-	long r1 = p_first.m_rgb_values[0];
-	long g1 = p_first.m_rgb_values[1];
-	long b1 = p_first.m_rgb_values[2];
-	long r2 = p_second.m_rgb_values[0];
-	long g2 = p_second.m_rgb_values[1];
-	long b2 = p_second.m_rgb_values[2];
+	long r1 = p_first.m_rgba_values[0];
+	long g1 = p_first.m_rgba_values[1];
+	long b1 = p_first.m_rgba_values[2];
+	long r2 = p_second.m_rgba_values[0];
+	long g2 = p_second.m_rgba_values[1];
+	long b2 = p_second.m_rgba_values[2];
 
 	long diff_r = r1 - r2;
 	long diff_g = g1 - g2;
@@ -133,16 +150,26 @@ long calculate_color_distance(color const &p_first, color const &p_second)
 
 	long r_mean = (r1 + r2) / 2;
 
-	return (((512 + r_mean) * diff_r*diff_r) >> 8) + 4 * diff_g*diff_g + (((512 + 255 - r_mean) * diff_b*diff_b) >> 8);
+	// Alpha differences are weighted like green differences, the
+	// channel with the largest weight. For opaque colors, this is 0.
+	long diff_a = p_first.m_rgba_values[3] - p_second.m_rgba_values[3];
+
+	return (((512 + r_mean) * diff_r*diff_r) >> 8) + 4 * diff_g*diff_g + (((512 + 255 - r_mean) * diff_b*diff_b) >> 8) + 4 * diff_a*diff_a;
 }
 
 
 
 
-void compute_color_histogram(
+namespace
+{
+
+
+template < std::size_t NumChannels, channel_order ChannelOrder >
+void compute_color_histogram_for_layout(
 	color_histogram &p_color_histogram,
-	const_pixmap_view_t p_input_pixmap,
-	base::progress_report_callback const &p_progress_report_callback
+	const_pixmap_view_t const &p_input_pixmap,
+	int const p_alpha_threshold,
+	base::progress_report &p_progress_report
 )
 {
 	unsigned long num_pixels_processed = 0;
@@ -150,24 +177,48 @@ void compute_color_histogram(
 
 	for (std::size_t y = 0; y < p_input_pixmap.m_height; ++y)
 	{
+		std::uint8_t const *row_data = at(p_input_pixmap, 0, y);
+
 		for (std::size_t x = 0; x < p_input_pixmap.m_width; ++x)
 		{
-			std::uint8_t const *pixel_data = at(p_input_pixmap, x, y);
+			color pixel_color = read_pixel_color < NumChannels, ChannelOrder > (row_data + x * NumChannels);
 
-			color pixel_color(pixel_data[2], pixel_data[1], pixel_data[0]);
+			if (pixel_color.alpha() >= p_alpha_threshold)
+			{
+				auto iter = p_color_histogram.find(pixel_color);
+				if (iter == p_color_histogram.end())
+					p_color_histogram.emplace(std::move(pixel_color), 1ul);
+				else
+					iter->second++;
+			}
 
-			auto iter = p_color_histogram.find(pixel_color);
-			if (iter == p_color_histogram.end())
-				p_color_histogram.emplace(std::move(pixel_color), 1ul);
-			else
-				iter->second++;
-
-			++num_pixels_processed;
-			if (p_progress_report_callback)
-				p_progress_report_callback(num_pixels_processed, total_num_pixels);
 		}
+
+		num_pixels_processed += p_input_pixmap.m_width;
+		p_progress_report(num_pixels_processed, total_num_pixels);
 	}
 }
 
 
+} // unnamed namespace end
+
+
+void compute_color_histogram(
+	color_histogram &p_color_histogram,
+	const_pixmap_view_t p_input_pixmap,
+	int const p_alpha_threshold,
+	base::progress_report p_progress_report
+)
+{
+	dispatch_pixel_layout(p_input_pixmap, [&](auto p_num_channels, auto p_channel_order) {
+		compute_color_histogram_for_layout < decltype(p_num_channels)::value, decltype(p_channel_order)::value > (
+			p_color_histogram,
+			p_input_pixmap,
+			p_alpha_threshold,
+			p_progress_report
+		);
+	});
+}
+
+
 } // namespace graphics end
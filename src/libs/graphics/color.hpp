@@ -2,8 +2,10 @@
 #define GRAPHICS_COLOR_HPP___________
 
 #include <cstddef>
+#include <cstdint>
 #include <array>
 #include <map>
+#include <memory_resource>
 #include "base/progress_report.hpp"
 #include "pixmap_view.hpp"
 
@@ -12,12 +14,18 @@ namespace graphics
 {
 
 
+// Colors have an alpha channel at index 3, next to the red, green and
+// blue channels at indices 0 to 2. Colors that are constructed from
+// RGB values only are fully opaque (alpha 255).
 struct color
 {
-	std::array < int, 3 > m_rgb_values;
+	enum { num_channels = 4, alpha_channel = 3, opaque_alpha = 255 };
+
+	std::array < int, num_channels > m_rgba_values;
 
 	color();
 	explicit color(int const p_red, int const p_green, int const p_blue);
+	explicit color(int const p_red, int const p_green, int const p_blue, int const p_alpha);
 
 	color& operator += (color const &p_other);
 	color& operator -= (color const &p_other);
@@ -26,12 +34,17 @@ struct color
 
 	int operator [](std::size_t const p_index) const
 	{
-		return m_rgb_values[p_index];
+		return m_rgba_values[p_index];
 	}
 
 	int& operator [](std::size_t const p_index)
 	{
-		return m_rgb_values[p_index];
+		return m_rgba_values[p_index];
+	}
+
+	int alpha() const
+	{
+		return m_rgba_values[alpha_channel];
 	}
 };
 
@@ -48,12 +61,56 @@ std::string to_string(color const &p_color);
 long calculate_color_distance(color const &p_first, color const &p_second);
 
 
-typedef std::map < color, std::size_t > color_histogram;
+/**
+ * Returns the offset of a color channel (see color) within a pixel
+ * whose channel order is known at compile time.
+ */
+template < channel_order ChannelOrder >
+constexpr std::size_t get_pixel_channel_offset(std::size_t const p_channel)
+{
+	return ((ChannelOrder == channel_order::bgr) && (p_channel < 3)) ? (2 - p_channel) : p_channel;
+}
+
+
+/**
+ * Reads a color from pixel data whose layout is known at compile time.
+ *
+ * This is meant for per-pixel kernels that are instantiated for each
+ * layout with dispatch_pixel_layout(). Pixels with 3 channels are opaque.
+ *
+ * @tparam NumChannels Number of channels in the pixel data (3 or 4).
+ * @tparam ChannelOrder Order of the color channels in the pixel data.
+ */
+template < std::size_t NumChannels, channel_order ChannelOrder >
+inline color read_pixel_color(std::uint8_t const *p_pixel_data)
+{
+	static_assert((NumChannels == 3) || (NumChannels == 4), "pixel data must have 3 or 4 channels");
+
+	std::size_t const red_offset = get_pixel_channel_offset < ChannelOrder > (0);
+	std::size_t const blue_offset = get_pixel_channel_offset < ChannelOrder > (2);
+
+	return color(p_pixel_data[red_offset], p_pixel_data[1], p_pixel_data[blue_offset], (NumChannels == 4) ? p_pixel_data[3] : int(color::opaque_alpha));
+}
+
+
+// This is a std::pmr::map so that its nodes can come from
+// a scratch arena when histograms are computed repeatedly.
+typedef std::pmr::map < color, std::size_t > color_histogram;
 
+/**
+ * Computes the histogram of the colors in a pixmap.
+ *
+ * @param p_color_histogram Histogram to add the colors to.
+ * @param p_input_pixmap Pixmap with 3 or 4 channels.
+ * @param p_alpha_threshold Pixels with an alpha value below this are
+ *        skipped. Use 0 to include all pixels.
+ * @param p_progress_report Progress report, called once per row.
+ */
 void compute_color_histogram(
 	color_histogram &p_color_histogram,
 	const_pixmap_view_t p_input_pixmap,
-	base::progress_report_callback const &p_progress_report_callback = base::progress_report_callback()
+	int const p_alpha_threshold = 0,
+	base::progress_report p_progress_report = base::progress_report()
 );
 
 
@@ -0,0 +1,222 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "color_metric.hpp"
+
+
+namespace graphics
+{
+
+
+namespace
+{
+
+
+// Fixed-point formats used during RGB -> Oklab conversion:
+// linear RGB, LMS and nonlinear LMS values use 16 bits (65535 = 1.0),
+// matrix coefficients use 14 fractional bits.
+
+int const unit_value = 65535;
+int const coefficient_shift = 14;
+
+#define OKLAB_COEFFICIENT(VALUE) long((VALUE) * (1 << coefficient_shift) + (((VALUE) >= 0) ? 0.5 : -0.5))
+
+long const linear_rgb_to_lms_matrix[3][3] = {
+	{ OKLAB_COEFFICIENT(0.4122214708), OKLAB_COEFFICIENT(0.5363325363), OKLAB_COEFFICIENT(0.0514459929) },
+	{ OKLAB_COEFFICIENT(0.2119034982), OKLAB_COEFFICIENT(0.6806995451), OKLAB_COEFFICIENT(0.1073969566) },
+	{ OKLAB_COEFFICIENT(0.0883024619), OKLAB_COEFFICIENT(0.2817188376), OKLAB_COEFFICIENT(0.6299787005) }
+};
+
+long const nonlinear_lms_to_oklab_matrix[3][3] = {
+	{ OKLAB_COEFFICIENT(0.2104542553), OKLAB_COEFFICIENT(+0.7936177850), OKLAB_COEFFICIENT(-0.0040720468) },
+	{ OKLAB_COEFFICIENT(1.9779984951), OKLAB_COEFFICIENT(-2.4285922050), OKLAB_COEFFICIENT(+0.4505937099) },
+	{ OKLAB_COEFFICIENT(0.0259040371), OKLAB_COEFFICIENT(+0.7827717662), OKLAB_COEFFICIENT(-0.8086757660) }
+};
+
+#undef OKLAB_COEFFICIENT
+
+
+double srgb_to_linear(double p_value)
+{
+	return (p_value <= 0.04045) ? (p_value / 12.92) : std::pow((p_value + 0.055) / 1.055, 2.4);
+}
+
+
+double linear_to_srgb(double p_value)
+{
+	return (p_value <= 0.0031308) ? (p_value * 12.92) : (1.055 * std::pow(p_value, 1.0 / 2.4) - 0.055);
+}
+
+
+struct oklab_tables
+{
+	// Gamma-encoded 8-bit sRGB value -> 16-bit linear value.
+	std::array < std::uint16_t, 256 > m_srgb_to_linear;
+	// 16-bit LMS value -> 16-bit cube root of it.
+	std::vector < std::uint16_t > m_cube_root;
+
+	oklab_tables()
+		: m_cube_root(unit_value + 1)
+	{
+		for (int i = 0; i < 256; ++i)
+			m_srgb_to_linear[i] = std::uint16_t(std::lround(srgb_to_linear(i / 255.0) * unit_value));
+
+		for (int i = 0; i <= unit_value; ++i)
+			m_cube_root[i] = std::uint16_t(std::lround(std::cbrt(double(i) / unit_value) * unit_value));
+	}
+};
+
+
+oklab_tables const & get_oklab_tables()
+{
+	// Initialized on first use. This is thread safe since C++11.
+	static oklab_tables const tables;
+	return tables;
+}
+
+
+long apply_fixed_point_matrix_row(long const (&p_row)[3], long p_value0, long p_value1, long p_value2)
+{
+	long sum = p_row[0] * p_value0 + p_row[1] * p_value1 + p_row[2] * p_value2;
+	long const rounding = 1l << (coefficient_shift - 1);
+	return (sum >= 0) ? ((sum + rounding) >> coefficient_shift) : -((-sum + rounding) >> coefficient_shift);
+}
+
+
+// Rounding division of a 16-bit fixed-point value to the 0-255 scale.
+int scale_to_8bit(long p_value)
+{
+	long scaled = p_value * 255;
+	return (scaled >= 0) ? int((scaled + unit_value / 2) / unit_value) : -int((-scaled + unit_value / 2) / unit_value);
+}
+
+
+int clamp_8bit(int p_value)
+{
+	return std::min(std::max(p_value, 0), 255);
+}
+
+
+} // unnamed namespace end
+
+
+std::string to_string(color_metric const p_color_metric)
+{
+	switch (p_color_metric)
+	{
+		case color_metric::rgb_low_cost: return "rgb";
+		case color_metric::oklab: return "oklab";
+		default: return "<unknown>";
+	}
+}
+
+
+bool parse_color_metric(std::string const &p_string, color_metric &p_color_metric)
+{
+	if (p_string == "rgb")
+		p_color_metric = color_metric::rgb_low_cost;
+	else if (p_string == "oklab")
+		p_color_metric = color_metric::oklab;
+	else
+		return false;
+
+	return true;
+}
+
+
+color convert_rgb_to_oklab(color const &p_rgb_color)
+{
+	oklab_tables const &tables = get_oklab_tables();
+
+	long linear_r = tables.m_srgb_to_linear[clamp_8bit(p_rgb_color[0])];
+	long linear_g = tables.m_srgb_to_linear[clamp_8bit(p_rgb_color[1])];
+	long linear_b = tables.m_srgb_to_linear[clamp_8bit(p_rgb_color[2])];
+
+	long nonlinear_lms[3];
+	for (int i = 0; i < 3; ++i)
+	{
+		long lms = apply_fixed_point_matrix_row(linear_rgb_to_lms_matrix[i], linear_r, linear_g, linear_b);
+		lms = std::min(std::max(lms, 0l), long(unit_value));
+		nonlinear_lms[i] = tables.m_cube_root[lms];
+	}
+
+	long oklab_l = apply_fixed_point_matrix_row(nonlinear_lms_to_oklab_matrix[0], nonlinear_lms[0], nonlinear_lms[1], nonlinear_lms[2]);
+	long oklab_a = apply_fixed_point_matrix_row(nonlinear_lms_to_oklab_matrix[1], nonlinear_lms[0], nonlinear_lms[1], nonlinear_lms[2]);
+	long oklab_b = apply_fixed_point_matrix_row(nonlinear_lms_to_oklab_matrix[2], nonlinear_lms[0], nonlinear_lms[1], nonlinear_lms[2]);
+
+	return color(
+		clamp_8bit(scale_to_8bit(oklab_l)),
+		clamp_8bit(scale_to_8bit(oklab_a) + 128),
+		clamp_8bit(scale_to_8bit(oklab_b) + 128),
+		p_rgb_color.alpha()
+	);
+}
+
+
+color convert_oklab_to_rgb(color const &p_oklab_color)
+{
+	double oklab_l = p_oklab_color[0] / 255.0;
+	double oklab_a = (p_oklab_color[1] - 128) / 255.0;
+	double oklab_b = (p_oklab_color[2] - 128) / 255.0;
+
+	double l = oklab_l + 0.3963377774 * oklab_a + 0.2158037573 * oklab_b;
+	double m = oklab_l - 0.1055613458 * oklab_a - 0.0638541728 * oklab_b;
+	double s = oklab_l - 0.0894841775 * oklab_a - 1.2914855480 * oklab_b;
+	l = l * l * l;
+	m = m * m * m;
+	s = s * s * s;
+
+	double linear_rgb[3] = {
+		+4.0767416621 * l - 3.3077115913 * m + 0.2309699292 * s,
+		-1.2684380046 * l + 2.6097574011 * m - 0.3413193965 * s,
+		-0.0041960863 * l - 0.7034186147 * m + 1.7076147010 * s
+	};
+
+	color rgb_color;
+	rgb_color[color::alpha_channel] = p_oklab_color.alpha();
+	for (int i = 0; i < 3; ++i)
+	{
+		double value = std::min(std::max(linear_rgb[i], 0.0), 1.0);
+		rgb_color[i] = clamp_8bit(int(std::lround(linear_to_srgb(value) * 255.0)));
+	}
+
+	return rgb_color;
+}
+
+
+color convert_from_rgb(color const &p_rgb_color, color_metric const p_color_metric)
+{
+	switch (p_color_metric)
+	{
+		case color_metric::oklab: return convert_rgb_to_oklab(p_rgb_color);
+		default: return p_rgb_color;
+	}
+}
+
+
+color convert_to_rgb(color const &p_color, color_metric const p_color_metric)
+{
+	switch (p_color_metric)
+	{
+		case color_metric::oklab: return convert_oklab_to_rgb(p_color);
+		default: return p_color;
+	}
+}
+
+
+void convert_color_histogram(color_histogram &p_color_histogram, color_metric const p_color_metric)
+{
+	if (p_color_metric == color_metric::rgb_low_cost)
+		return;
+
+	color_histogram converted_color_histogram(p_color_histogram.get_allocator());
+	for (auto const &histogram_entry : p_color_histogram)
+		converted_color_histogram[convert_from_rgb(histogram_entry.first, p_color_metric)] += histogram_entry.second;
+
+	p_color_histogram = std::move(converted_color_histogram);
+}
+
+
+} // namespace graphics end
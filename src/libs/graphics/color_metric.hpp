@@ -0,0 +1,82 @@
+#ifndef GRAPHICS_COLOR_METRIC_HPP___________
+#define GRAPHICS_COLOR_METRIC_HPP___________
+
+#include <string>
+#include "color.hpp"
+
+
+namespace graphics
+{
+
+
+/**
+ * Metrics that color quantization can work with.
+ *
+ * Each metric comes with its own color space. Colors are converted to
+ * that space before quantization, and all color values (histogram
+ * entries, palette entries etc.) are then in that space, until they
+ * are converted back with convert_to_rgb().
+ *
+ * rgb_low_cost: Gamma-encoded RGB, with the low-cost approximation
+ *   from calculate_color_distance(). No conversion is done.
+ * oklab: Fixed-point Oklab (see https://bottosson.github.io/posts/oklab/),
+ *   with squared euclidean distances. The channels are L, a, b, each
+ *   scaled by 255. a and b are offset by 128. This keeps all channels in
+ *   the same 0-255 range that RGB values have, so everything that relies
+ *   on 8-bit channels (like the octree) works unchanged.
+ *
+ * In all metrics, alpha is passed through unchanged, and alpha
+ * differences add to the distance.
+ */
+enum class color_metric
+{
+	rgb_low_cost,
+	oklab
+};
+
+std::string to_string(color_metric const p_color_metric);
+bool parse_color_metric(std::string const &p_string, color_metric &p_color_metric);
+
+
+// Converts with precomputed fixed-point tables, without any
+// floating point math, so this can be used on a per-pixel basis.
+color convert_rgb_to_oklab(color const &p_rgb_color);
+// Uses floating point math. Meant for converting palettes back to RGB.
+color convert_oklab_to_rgb(color const &p_oklab_color);
+
+color convert_from_rgb(color const &p_rgb_color, color_metric const p_color_metric);
+color convert_to_rgb(color const &p_color, color_metric const p_color_metric);
+
+/**
+ * Converts a histogram of RGB colors to the color space of the metric.
+ *
+ * Each unique color is converted exactly once. Colors that end up at
+ * the same converted value are merged.
+ */
+void convert_color_histogram(color_histogram &p_color_histogram, color_metric const p_color_metric);
+
+
+inline long calculate_squared_euclidean_distance(color const &p_first, color const &p_second)
+{
+	long diff_0 = p_first[0] - p_second[0];
+	long diff_1 = p_first[1] - p_second[1];
+	long diff_2 = p_first[2] - p_second[2];
+	long diff_3 = p_first[3] - p_second[3];
+	return diff_0*diff_0 + diff_1*diff_1 + diff_2*diff_2 + diff_3*diff_3;
+}
+
+
+inline long calculate_color_distance(color const &p_first, color const &p_second, color_metric const p_color_metric)
+{
+	switch (p_color_metric)
+	{
+		case color_metric::oklab: return calculate_squared_euclidean_distance(p_first, p_second);
+		default: return calculate_color_distance(p_first, p_second);
+	}
+}
+
+
+} // namespace graphics end
+
+
+#endif // GRAPHICS_COLOR_METRIC_HPP___________
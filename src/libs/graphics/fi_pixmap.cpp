@@ -52,13 +52,21 @@ fi_pixmap& fi_pixmap::operator = (fi_pixmap &&p_other)
 }
 
 
+// FreeImage stores 24 and 32 bit pixels in B, G, R (, A) order on
+// little endian machines, and in R, G, B (, A) order on big endian ones.
+static channel_order const fi_channel_order = (FI_RGBA_RED == 0) ? channel_order::rgb : channel_order::bgr;
+
+
 static std::size_t get_num_channels(FIBITMAP *p_fibitmap)
 {
 	switch (FreeImage_GetImageType(p_fibitmap))
 	{
-		// TODO: more types
 		case FIT_BITMAP: return std::max(FreeImage_GetBPP(p_fibitmap) / 8u, 1u);
+		case FIT_RGB16:
 		case FIT_RGBF: return 3;
+		case FIT_RGBA16:
+		case FIT_RGBAF: return 4;
+		case FIT_COMPLEX: return 2;
 		default: return 1;
 	}
 }
@@ -76,7 +84,8 @@ const_pixmap_view_t make_pixmap_view(fi_pixmap const &p_fi_pixmap)
 		hstride * height,
 		width, height,
 		hstride,
-		get_num_channels(fibitmap)
+		get_num_channels(fibitmap),
+		fi_channel_order
 	);
 }
 
@@ -93,7 +102,8 @@ nonconst_pixmap_view_t make_pixmap_view(fi_pixmap &p_fi_pixmap)
 		hstride * height,
 		width, height,
 		hstride,
-		get_num_channels(fibitmap)
+		get_num_channels(fibitmap),
+		fi_channel_order
 	);
 }
 
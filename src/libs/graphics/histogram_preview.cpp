@@ -0,0 +1,226 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <memory_resource>
+#include <vector>
+#include "histogram_preview.hpp"
+
+
+namespace graphics
+{
+
+
+namespace
+{
+
+
+// With edge weighting, a preview pixel counts once, plus once more for
+// every this much difference to its neighbour (summed over all
+// channels), up to max_extra_edge_weight more times.
+int const edge_difference_per_weight = 64;
+std::size_t const max_extra_edge_weight = 3;
+
+
+int calculate_edge_difference(color const &p_first, color const &p_second)
+{
+	return std::abs(p_first[0] - p_second[0]) + std::abs(p_first[1] - p_second[1]) + std::abs(p_first[2] - p_second[2]) + std::abs(p_first[3] - p_second[3]);
+}
+
+
+// Computes row p_preview_y of the preview. p_row_colors must have one
+// element per preview column. p_channel_sums is a temporary buffer.
+template < std::size_t NumChannels, channel_order ChannelOrder >
+void read_preview_row(
+	const_pixmap_view_t const &p_input_pixmap,
+	std::size_t const p_preview_y,
+	std::size_t const p_block_size,
+	preview_filter const p_filter,
+	std::pmr::vector < color > &p_row_colors,
+	std::pmr::vector < unsigned long > &p_channel_sums
+)
+{
+	std::size_t preview_width = p_row_colors.size();
+	std::size_t first_y = p_preview_y * p_block_size;
+	std::size_t end_y = std::min(first_y + p_block_size, p_input_pixmap.m_height);
+
+	if (p_filter == preview_filter::subsample)
+	{
+		std::uint8_t const *row_data = at(p_input_pixmap, 0, first_y);
+		for (std::size_t preview_x = 0; preview_x < preview_width; ++preview_x)
+			p_row_colors[preview_x] = read_pixel_color < NumChannels, ChannelOrder > (row_data + preview_x * p_block_size * NumChannels);
+		return;
+	}
+
+	p_channel_sums.assign(preview_width * color::num_channels, 0);
+
+	for (std::size_t y = first_y; y < end_y; ++y)
+	{
+		std::uint8_t const *row_data = at(p_input_pixmap, 0, y);
+
+		for (std::size_t preview_x = 0; preview_x < preview_width; ++preview_x)
+		{
+			std::size_t first_x = preview_x * p_block_size;
+			std::size_t end_x = std::min(first_x + p_block_size, p_input_pixmap.m_width);
+			unsigned long *channel_sums = &(p_channel_sums[preview_x * color::num_channels]);
+
+			for (std::size_t x = first_x; x < end_x; ++x)
+			{
+				color pixel_color = read_pixel_color < NumChannels, ChannelOrder > (row_data + x * NumChannels);
+				for (int c = 0; c < color::num_channels; ++c)
+					channel_sums[c] += pixel_color[c];
+			}
+		}
+	}
+
+	for (std::size_t preview_x = 0; preview_x < preview_width; ++preview_x)
+	{
+		std::size_t first_x = preview_x * p_block_size;
+		std::size_t end_x = std::min(first_x + p_block_size, p_input_pixmap.m_width);
+		unsigned long num_block_pixels = (end_x - first_x) * (end_y - first_y);
+		unsigned long const *channel_sums = &(p_channel_sums[preview_x * color::num_channels]);
+
+		color &preview_color = p_row_colors[preview_x];
+		for (int c = 0; c < color::num_channels; ++c)
+			preview_color[c] = int((channel_sums[c] + num_block_pixels / 2) / num_block_pixels);
+	}
+}
+
+
+template < std::size_t NumChannels, channel_order ChannelOrder >
+std::size_t compute_preview_color_histogram_for_layout(
+	color_histogram &p_color_histogram,
+	const_pixmap_view_t const &p_input_pixmap,
+	histogram_preview const &p_histogram_preview,
+	int const p_alpha_threshold,
+	base::progress_report &p_progress_report
+)
+{
+	std::size_t block_size = get_preview_block_size(p_histogram_preview, p_input_pixmap.m_width, p_input_pixmap.m_height);
+	std::size_t preview_width = (p_input_pixmap.m_width + block_size - 1) / block_size;
+	std::size_t preview_height = (p_input_pixmap.m_height + block_size - 1) / block_size;
+	bool use_edge_weighting = p_histogram_preview.m_use_edge_weighting;
+
+	// The next row is computed ahead, since edge weighting compares
+	// preview pixels with their lower neighbours.
+	std::pmr::memory_resource *memory_resource = p_color_histogram.get_allocator().resource();
+	std::pmr::vector < color > row_colors(preview_width, memory_resource);
+	std::pmr::vector < color > next_row_colors(preview_width, memory_resource);
+	std::pmr::vector < unsigned long > channel_sums(memory_resource);
+
+	if (preview_height > 0)
+		read_preview_row < NumChannels, ChannelOrder > (p_input_pixmap, 0, block_size, p_histogram_preview.m_filter, row_colors, channel_sums);
+
+	for (std::size_t preview_y = 0; preview_y < preview_height; ++preview_y)
+	{
+		bool has_next_row = (preview_y + 1) < preview_height;
+		if (has_next_row)
+			read_preview_row < NumChannels, ChannelOrder > (p_input_pixmap, preview_y + 1, block_size, p_histogram_preview.m_filter, next_row_colors, channel_sums);
+
+		for (std::size_t preview_x = 0; preview_x < preview_width; ++preview_x)
+		{
+			color const &preview_color = row_colors[preview_x];
+			if (preview_color.alpha() < p_alpha_threshold)
+				continue;
+
+			std::size_t weight = 1;
+			if (use_edge_weighting)
+			{
+				int edge_difference = 0;
+				if ((preview_x + 1) < preview_width)
+					edge_difference = std::max(edge_difference, calculate_edge_difference(preview_color, row_colors[preview_x + 1]));
+				if (has_next_row)
+					edge_difference = std::max(edge_difference, calculate_edge_difference(preview_color, next_row_colors[preview_x]));
+
+				weight += std::min(std::size_t(edge_difference / edge_difference_per_weight), max_extra_edge_weight);
+			}
+
+			auto iter = p_color_histogram.find(preview_color);
+			if (iter == p_color_histogram.end())
+				p_color_histogram.emplace(preview_color, weight);
+			else
+				iter->second += weight;
+		}
+
+		if (has_next_row)
+			row_colors.swap(next_row_colors);
+
+		p_progress_report(preview_y + 1, preview_height);
+	}
+
+	return preview_width * preview_height;
+}
+
+
+} // unnamed namespace end
+
+
+std::string to_string(preview_filter const p_preview_filter)
+{
+	switch (p_preview_filter)
+	{
+		case preview_filter::subsample: return "subsample";
+		case preview_filter::box: return "box";
+		default: return "<unknown>";
+	}
+}
+
+
+bool parse_preview_filter(std::string const &p_string, preview_filter &p_preview_filter)
+{
+	if (p_string == "subsample")
+		p_preview_filter = preview_filter::subsample;
+	else if (p_string == "box")
+		p_preview_filter = preview_filter::box;
+	else
+		return false;
+
+	return true;
+}
+
+
+histogram_preview::histogram_preview()
+	: m_block_size(1)
+	, m_max_num_pixels(0)
+	, m_filter(preview_filter::subsample)
+	, m_use_edge_weighting(false)
+{
+}
+
+
+std::size_t get_preview_block_size(histogram_preview const &p_histogram_preview, std::size_t const p_width, std::size_t const p_height)
+{
+	if (p_histogram_preview.m_max_num_pixels == 0)
+		return std::max(p_histogram_preview.m_block_size, std::size_t(1));
+
+	// Start with the estimate from the pixel count ratio, and grow it
+	// until the rounded up preview size actually fits.
+	double ratio = double(p_width) * double(p_height) / double(p_histogram_preview.m_max_num_pixels);
+	std::size_t block_size = std::max(std::size_t(std::sqrt(ratio)), std::size_t(1));
+	while ((((p_width + block_size - 1) / block_size) * ((p_height + block_size - 1) / block_size)) > p_histogram_preview.m_max_num_pixels)
+		++block_size;
+
+	return block_size;
+}
+
+
+std::size_t compute_preview_color_histogram(
+	color_histogram &p_color_histogram,
+	const_pixmap_view_t p_input_pixmap,
+	histogram_preview const &p_histogram_preview,
+	int const p_alpha_threshold,
+	base::progress_report p_progress_report
+)
+{
+	return dispatch_pixel_layout(p_input_pixmap, [&](auto p_num_channels, auto p_channel_order) {
+		return compute_preview_color_histogram_for_layout < decltype(p_num_channels)::value, decltype(p_channel_order)::value > (
+			p_color_histogram,
+			p_input_pixmap,
+			p_histogram_preview,
+			p_alpha_threshold,
+			p_progress_report
+		);
+	});
+}
+
+
+} // namespace graphics end
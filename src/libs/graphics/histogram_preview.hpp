@@ -0,0 +1,89 @@
+#ifndef GRAPHICS_HISTOGRAM_PREVIEW_HPP___________
+#define GRAPHICS_HISTOGRAM_PREVIEW_HPP___________
+
+#include <cstddef>
+#include <string>
+#include "base/progress_report.hpp"
+#include "color.hpp"
+#include "pixmap_view.hpp"
+
+
+namespace graphics
+{
+
+
+/**
+ * How the pixels of a preview are computed from the pixmap.
+ *
+ * subsample: Each preview pixel is the top left pixel of its block.
+ *   Only one pixel per block is ever read.
+ * box: Each preview pixel is the average of all pixels in its block.
+ *   Every pixel is read, but the histogram gets only one entry per
+ *   block, and fine noise and dithering patterns are smoothed out.
+ */
+enum class preview_filter
+{
+	subsample,
+	box
+};
+
+std::string to_string(preview_filter const p_preview_filter);
+bool parse_preview_filter(std::string const &p_string, preview_filter &p_preview_filter);
+
+
+/**
+ * Settings for computing a color histogram from a downscaled preview.
+ *
+ * The preview consists of square blocks of pixels. Each block becomes
+ * one preview pixel (see preview_filter). The block size can be set
+ * directly, or derived from a maximum number of preview pixels.
+ *
+ * With edge weighting, preview pixels that differ strongly from their
+ * right or lower neighbour count up to 4 times in the histogram. Edges
+ * are where small but visually important details are, and these are
+ * the first to lose their colors in a preview.
+ */
+struct histogram_preview
+{
+	// Side length of the blocks. 1 means that no preview is used.
+	std::size_t m_block_size;
+	// If nonzero, this replaces m_block_size: the smallest block size
+	// that gives at most this many preview pixels is used.
+	std::size_t m_max_num_pixels;
+	preview_filter m_filter;
+	bool m_use_edge_weighting;
+
+	histogram_preview();
+};
+
+// Returns the block size that p_histogram_preview uses for
+// a pixmap with the given size. This is always at least 1.
+std::size_t get_preview_block_size(histogram_preview const &p_histogram_preview, std::size_t const p_width, std::size_t const p_height);
+
+
+/**
+ * Computes the histogram of the colors in a preview of a pixmap.
+ *
+ * Temporary buffers are allocated from the histogram's memory resource.
+ *
+ * @param p_color_histogram Histogram to add the colors to.
+ * @param p_input_pixmap Pixmap with 3 or 4 channels.
+ * @param p_histogram_preview Preview settings.
+ * @param p_alpha_threshold Preview pixels with an alpha value below
+ *        this are skipped. Use 0 to include all pixels.
+ * @param p_progress_report Progress report, called once per preview row.
+ * @return Number of preview pixels.
+ */
+std::size_t compute_preview_color_histogram(
+	color_histogram &p_color_histogram,
+	const_pixmap_view_t p_input_pixmap,
+	histogram_preview const &p_histogram_preview,
+	int const p_alpha_threshold = 0,
+	base::progress_report p_progress_report = base::progress_report()
+);
+
+
+} // namespace graphics end
+
+
+#endif // GRAPHICS_HISTOGRAM_PREVIEW_HPP___________
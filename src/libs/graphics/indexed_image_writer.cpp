@@ -0,0 +1,522 @@
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <zlib.h>
+#include "indexed_image_writer.hpp"
+
+
+namespace graphics
+{
+
+
+class indexed_image_writer::encoder
+{
+public:
+	virtual ~encoder()
+	{
+	}
+
+	virtual bool begin(std::FILE *p_file, std::size_t const p_width, std::size_t const p_height, palette const &p_palette) = 0;
+	virtual bool encode_row(std::FILE *p_file, nonstd::span < std::uint8_t const > p_row) = 0;
+	virtual bool end(std::FILE *p_file) = 0;
+};
+
+
+namespace
+{
+
+
+bool write_bytes(std::FILE *p_file, void const *p_data, std::size_t const p_num_bytes)
+{
+	return std::fwrite(p_data, 1, p_num_bytes, p_file) == p_num_bytes;
+}
+
+
+std::uint8_t clamp_8bit(int const p_value)
+{
+	return std::uint8_t(std::min(std::max(p_value, 0), 255));
+}
+
+
+// Smallest number of bits that can hold the indices of a palette
+// with the given number of entries. Always at least 1.
+unsigned int calculate_num_index_bits(std::size_t const p_num_entries)
+{
+	unsigned int num_bits = 1;
+	while ((std::size_t(1) << num_bits) < p_num_entries)
+		++num_bits;
+	return num_bits;
+}
+
+
+class gif_encoder
+	: public indexed_image_writer::encoder
+{
+public:
+	gif_encoder()
+		: m_hash_keys(hash_table_size)
+		, m_hash_codes(hash_table_size)
+	{
+	}
+
+	bool begin(std::FILE *p_file, std::size_t const p_width, std::size_t const p_height, palette const &p_palette) override
+	{
+		if ((p_width > 65535) || (p_height > 65535))
+			return false;
+
+		unsigned int num_index_bits = calculate_num_index_bits(p_palette.size());
+		std::size_t color_table_size = std::size_t(1) << num_index_bits;
+
+		// The first fully transparent entry is used as the transparent
+		// one, since GIF supports only a single transparent entry.
+		int transparent_index = -1;
+		for (std::size_t i = 0; i < p_palette.size(); ++i)
+		{
+			if (p_palette[i].alpha() == 0)
+			{
+				transparent_index = int(i);
+				break;
+			}
+		}
+
+		std::vector < std::uint8_t > header;
+
+		auto append_u16 = [&header](std::size_t p_value) {
+			header.push_back(p_value & 0xFF);
+			header.push_back((p_value >> 8) & 0xFF);
+		};
+
+		// Header and logical screen descriptor. The global color table
+		// flag is set, color resolution is 8 bits per primary.
+		header.insert(header.end(), { 'G', 'I', 'F', '8', '9', 'a' });
+		append_u16(p_width);
+		append_u16(p_height);
+		header.push_back(0x80 | 0x70 | (num_index_bits - 1));
+		header.push_back(0); // background color index
+		header.push_back(0); // pixel aspect ratio
+
+		// Global color table, padded to a power-of-two size.
+		for (std::size_t i = 0; i < color_table_size; ++i)
+		{
+			color const entry = (i < p_palette.size()) ? p_palette[i] : color(0, 0, 0);
+			header.push_back(clamp_8bit(entry[0]));
+			header.push_back(clamp_8bit(entry[1]));
+			header.push_back(clamp_8bit(entry[2]));
+		}
+
+		// Graphic control extension with the transparent palette index.
+		if (transparent_index >= 0)
+			header.insert(header.end(), { 0x21, 0xF9, 0x04, 0x01, 0x00, 0x00, std::uint8_t(transparent_index), 0x00 });
+
+		// Image descriptor covering the entire logical screen.
+		header.push_back(0x2C);
+		append_u16(0);
+		append_u16(0);
+		append_u16(p_width);
+		append_u16(p_height);
+		header.push_back(0x00);
+
+		// LZW minimum code size. GIF does not allow values below 2.
+		m_min_code_size = std::max(num_index_bits, 2u);
+		header.push_back(m_min_code_size);
+
+		if (!write_bytes(p_file, header.data(), header.size()))
+			return false;
+
+		m_clear_code = 1u << m_min_code_size;
+		m_bit_buffer = 0;
+		m_num_bits = 0;
+		m_block_size = 0;
+		m_prefix = -1;
+
+		reset_dictionary();
+		return write_code(p_file, m_clear_code);
+	}
+
+	bool encode_row(std::FILE *p_file, nonstd::span < std::uint8_t const > p_row) override
+	{
+		for (std::uint8_t value : p_row)
+		{
+			if (m_prefix < 0)
+			{
+				m_prefix = value;
+				continue;
+			}
+
+			// Extend the current string if the dictionary has it.
+			std::uint32_t key = (std::uint32_t(m_prefix) << 8) | value;
+			std::size_t slot = find_slot(key);
+			if (m_hash_keys[slot] == (key + 1))
+			{
+				m_prefix = m_hash_codes[slot];
+				continue;
+			}
+
+			if (!write_code(p_file, m_prefix))
+				return false;
+
+			// Add the extended string to the dictionary. Once it is
+			// full, start over with a clear code.
+			unsigned int new_code = m_next_code++;
+			m_hash_keys[slot] = key + 1;
+			m_hash_codes[slot] = new_code;
+
+			if ((new_code >= (1u << m_code_size)) && (m_code_size < max_code_size))
+				++m_code_size;
+
+			if (new_code == max_code)
+			{
+				if (!write_code(p_file, m_clear_code))
+					return false;
+				reset_dictionary();
+			}
+
+			m_prefix = value;
+		}
+
+		return true;
+	}
+
+	bool end(std::FILE *p_file) override
+	{
+		if (m_prefix >= 0)
+		{
+			if (!write_code(p_file, m_prefix))
+				return false;
+
+			// The decoder adds one more dictionary entry after reading
+			// the last code. If that fills up the current code size,
+			// it reads the end of information code one bit wider.
+			if ((m_next_code >= (1u << m_code_size)) && (m_code_size < max_code_size))
+				++m_code_size;
+		}
+		if (!write_code(p_file, m_clear_code + 1))
+			return false;
+
+		if (m_num_bits > 0)
+		{
+			if (!put_byte(p_file, m_bit_buffer & 0xFF))
+				return false;
+		}
+
+		if (!flush_block(p_file))
+			return false;
+
+		// Block terminator and GIF trailer.
+		std::uint8_t const trailer[] = { 0x00, 0x3B };
+		return write_bytes(p_file, trailer, sizeof(trailer));
+	}
+
+
+private:
+	enum
+	{
+		max_code_size = 12,
+		max_code = (1u << max_code_size) - 1,
+		// Twice the number of codes, to keep the probe sequences short.
+		hash_table_size = 8192
+	};
+
+	void reset_dictionary()
+	{
+		std::fill(m_hash_keys.begin(), m_hash_keys.end(), 0);
+		m_code_size = m_min_code_size + 1;
+		m_next_code = m_clear_code + 2;
+	}
+
+	// Returns the slot that contains the key, or the empty
+	// slot where it would have to be inserted.
+	std::size_t find_slot(std::uint32_t const p_key) const
+	{
+		std::size_t slot = (p_key * 2654435761u) >> (32 - 13);
+		while ((m_hash_keys[slot] != 0) && (m_hash_keys[slot] != (p_key + 1)))
+			slot = (slot + 1) & (hash_table_size - 1);
+		return slot;
+	}
+
+	bool write_code(std::FILE *p_file, unsigned int const p_code)
+	{
+		m_bit_buffer |= std::uint32_t(p_code) << m_num_bits;
+		m_num_bits += m_code_size;
+
+		while (m_num_bits >= 8)
+		{
+			if (!put_byte(p_file, m_bit_buffer & 0xFF))
+				return false;
+			m_bit_buffer >>= 8;
+			m_num_bits -= 8;
+		}
+
+		return true;
+	}
+
+	// LZW data is stored in sub-blocks of up to 255 bytes,
+	// each one preceded by its size.
+	bool put_byte(std::FILE *p_file, std::uint8_t const p_byte)
+	{
+		m_block[1 + m_block_size++] = p_byte;
+		return (m_block_size < 255) || flush_block(p_file);
+	}
+
+	bool flush_block(std::FILE *p_file)
+	{
+		if (m_block_size == 0)
+			return true;
+
+		m_block[0] = std::uint8_t(m_block_size);
+		bool ok = write_bytes(p_file, m_block, 1 + m_block_size);
+		m_block_size = 0;
+		return ok;
+	}
+
+	std::vector < std::uint32_t > m_hash_keys;
+	std::vector < std::uint16_t > m_hash_codes;
+
+	unsigned int m_min_code_size, m_code_size;
+	unsigned int m_clear_code, m_next_code;
+	int m_prefix;
+
+	std::uint32_t m_bit_buffer;
+	unsigned int m_num_bits;
+
+	std::uint8_t m_block[256];
+	std::size_t m_block_size;
+};
+
+
+class png_encoder
+	: public indexed_image_writer::encoder
+{
+public:
+	explicit png_encoder(int const p_compression_level)
+		: m_compression_level(std::min(std::max(p_compression_level, 0), 9))
+		, m_zstream_initialized(false)
+		, m_idat_buffer(idat_buffer_size)
+	{
+	}
+
+	~png_encoder()
+	{
+		if (m_zstream_initialized)
+			deflateEnd(&m_zstream);
+	}
+
+	bool begin(std::FILE *p_file, std::size_t const p_width, std::size_t const p_height, palette const &p_palette) override
+	{
+		if ((p_width > 0x7FFFFFFF) || (p_height > 0x7FFFFFFF))
+			return false;
+
+		std::uint8_t const signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+		if (!write_bytes(p_file, signature, sizeof(signature)))
+			return false;
+
+		// Image header: 8 bit depth, color type 3 (palette), deflate
+		// compression, adaptive filtering, no interlacing.
+		std::uint8_t ihdr[13];
+		store_u32(ihdr + 0, p_width);
+		store_u32(ihdr + 4, p_height);
+		ihdr[8] = 8;
+		ihdr[9] = 3;
+		ihdr[10] = 0;
+		ihdr[11] = 0;
+		ihdr[12] = 0;
+		if (!write_chunk(p_file, "IHDR", ihdr, sizeof(ihdr)))
+			return false;
+
+		std::vector < std::uint8_t > plte, trns;
+		std::size_t num_trns_entries = 0;
+		for (std::size_t i = 0; i < p_palette.size(); ++i)
+		{
+			plte.push_back(clamp_8bit(p_palette[i][0]));
+			plte.push_back(clamp_8bit(p_palette[i][1]));
+			plte.push_back(clamp_8bit(p_palette[i][2]));
+			trns.push_back(clamp_8bit(p_palette[i].alpha()));
+			if (trns.back() != 255)
+				num_trns_entries = i + 1;
+		}
+
+		if (!write_chunk(p_file, "PLTE", plte.data(), plte.size()))
+			return false;
+		// tRNS can be shorter than the palette; missing entries are opaque.
+		if ((num_trns_entries > 0) && !write_chunk(p_file, "tRNS", trns.data(), num_trns_entries))
+			return false;
+
+		std::memset(&m_zstream, 0, sizeof(m_zstream));
+		if (deflateInit(&m_zstream, m_compression_level) != Z_OK)
+			return false;
+		m_zstream_initialized = true;
+
+		m_zstream.next_out = m_idat_buffer.data();
+		m_zstream.avail_out = m_idat_buffer.size();
+
+		return true;
+	}
+
+	bool encode_row(std::FILE *p_file, nonstd::span < std::uint8_t const > p_row) override
+	{
+		// Each row starts with its filter type; 0 means unfiltered.
+		std::uint8_t const filter_type = 0;
+		return deflate_data(p_file, &filter_type, 1, Z_NO_FLUSH) && deflate_data(p_file, p_row.data(), p_row.size(), Z_NO_FLUSH);
+	}
+
+	bool end(std::FILE *p_file) override
+	{
+		if (!deflate_data(p_file, nullptr, 0, Z_FINISH))
+			return false;
+
+		return write_idat(p_file) && write_chunk(p_file, "IEND", nullptr, 0);
+	}
+
+
+private:
+	enum { idat_buffer_size = 65536 };
+
+	static void store_u32(std::uint8_t *p_dest, std::size_t const p_value)
+	{
+		p_dest[0] = (p_value >> 24) & 0xFF;
+		p_dest[1] = (p_value >> 16) & 0xFF;
+		p_dest[2] = (p_value >> 8) & 0xFF;
+		p_dest[3] = (p_value >> 0) & 0xFF;
+	}
+
+	static bool write_chunk(std::FILE *p_file, char const *p_type, std::uint8_t const *p_data, std::size_t const p_size)
+	{
+		std::uint8_t length[4];
+		store_u32(length, p_size);
+
+		uLong crc = crc32(0, reinterpret_cast < Bytef const * > (p_type), 4);
+		if (p_size > 0)
+			crc = crc32(crc, p_data, p_size);
+		std::uint8_t crc_bytes[4];
+		store_u32(crc_bytes, crc);
+
+		return write_bytes(p_file, length, 4)
+		    && write_bytes(p_file, p_type, 4)
+		    && ((p_size == 0) || write_bytes(p_file, p_data, p_size))
+		    && write_bytes(p_file, crc_bytes, 4);
+	}
+
+	// Compresses the data, and writes an IDAT chunk whenever
+	// the output buffer is full.
+	bool deflate_data(std::FILE *p_file, std::uint8_t const *p_data, std::size_t const p_size, int const p_flush)
+	{
+		m_zstream.next_in = const_cast < Bytef* > (p_data);
+		m_zstream.avail_in = p_size;
+
+		while (true)
+		{
+			int result = deflate(&m_zstream, p_flush);
+			if ((result != Z_OK) && (result != Z_STREAM_END) && (result != Z_BUF_ERROR))
+				return false;
+
+			// Any remaining output is written by end().
+			if (result == Z_STREAM_END)
+				return true;
+
+			if (m_zstream.avail_out == 0)
+			{
+				if (!write_idat(p_file))
+					return false;
+			}
+			else if ((p_flush != Z_FINISH) && (m_zstream.avail_in == 0))
+				return true;
+		}
+	}
+
+	bool write_idat(std::FILE *p_file)
+	{
+		std::size_t size = m_idat_buffer.size() - m_zstream.avail_out;
+		m_zstream.next_out = m_idat_buffer.data();
+		m_zstream.avail_out = m_idat_buffer.size();
+		return (size == 0) || write_chunk(p_file, "IDAT", m_idat_buffer.data(), size);
+	}
+
+	int m_compression_level;
+	z_stream m_zstream;
+	bool m_zstream_initialized;
+	std::vector < std::uint8_t > m_idat_buffer;
+};
+
+
+} // unnamed namespace end
+
+
+indexed_image_writer::indexed_image_writer()
+	: m_file(nullptr)
+	, m_width(0)
+	, m_height(0)
+	, m_num_rows_written(0)
+	, m_failed(false)
+{
+}
+
+
+indexed_image_writer::~indexed_image_writer()
+{
+	if (m_file != nullptr)
+		std::fclose(m_file);
+}
+
+
+bool indexed_image_writer::open(
+	std::string const &p_filename,
+	indexed_image_format const p_format,
+	std::size_t const p_width,
+	std::size_t const p_height,
+	palette const &p_palette,
+	int const p_compression_level
+)
+{
+	if (is_open() || (p_palette.size() == 0) || (p_palette.size() > 256))
+		return false;
+
+	m_file = std::fopen(p_filename.c_str(), "wb");
+	if (m_file == nullptr)
+		return false;
+
+	// The encoders write many small pieces, so use a large buffer.
+	std::setvbuf(m_file, nullptr, _IOFBF, 65536);
+
+	switch (p_format)
+	{
+		case indexed_image_format::gif: m_encoder.reset(new gif_encoder()); break;
+		case indexed_image_format::png: m_encoder.reset(new png_encoder(p_compression_level)); break;
+	}
+
+	m_width = p_width;
+	m_height = p_height;
+	m_num_rows_written = 0;
+	m_failed = !m_encoder->begin(m_file, p_width, p_height, p_palette);
+
+	return !m_failed;
+}
+
+
+bool indexed_image_writer::write_row(nonstd::span < std::uint8_t const > p_row)
+{
+	if (!is_open() || m_failed || (std::size_t(p_row.size()) != m_width) || (m_num_rows_written >= m_height))
+		return false;
+
+	m_failed = !m_encoder->encode_row(m_file, p_row);
+	++m_num_rows_written;
+
+	return !m_failed;
+}
+
+
+bool indexed_image_writer::close()
+{
+	if (!is_open())
+		return false;
+
+	bool ok = !m_failed && (m_num_rows_written == m_height) && m_encoder->end(m_file);
+	ok = (std::fclose(m_file) == 0) && ok;
+
+	m_file = nullptr;
+	m_encoder.reset();
+
+	return ok;
+}
+
+
+} // namespace graphics end
@@ -0,0 +1,92 @@
+#ifndef GRAPHICS_INDEXED_IMAGE_WRITER_HPP_______
+#define GRAPHICS_INDEXED_IMAGE_WRITER_HPP_______
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include "base/custom_span.hpp"
+#include "palette.hpp"
+
+
+namespace graphics
+{
+
+
+enum class indexed_image_format
+{
+	gif,
+	png
+};
+
+
+/**
+ * Streaming writer for images with 8-bit palette indices.
+ *
+ * The image is written row by row, from top to bottom, as soon as the
+ * rows are available. Nothing but the encoder state is kept in memory.
+ *
+ * GIF images are LZW compressed. GIF supports only one transparent
+ * palette entry, so the first entry with an alpha value of 0 becomes
+ * the transparent one. The alpha values of all other entries are
+ * ignored.
+ *
+ * PNG images are written as PNG8, that is, with a palette. Entries
+ * with an alpha value below 255 are written to the tRNS chunk. Rows
+ * are not filtered, since filtering rarely helps with palette indices.
+ * The compression level (0-9) is the zlib one. Lower levels are
+ * faster, higher ones produce smaller files. GIF has no such levels,
+ * so it is ignored there.
+ */
+class indexed_image_writer
+{
+public:
+	enum { default_compression_level = 1 };
+
+	indexed_image_writer();
+	~indexed_image_writer();
+
+	indexed_image_writer(indexed_image_writer const &) = delete;
+	indexed_image_writer& operator = (indexed_image_writer const &) = delete;
+
+	// The palette must have 1-256 entries with RGBA values.
+	bool open(
+		std::string const &p_filename,
+		indexed_image_format const p_format,
+		std::size_t const p_width,
+		std::size_t const p_height,
+		palette const &p_palette,
+		int const p_compression_level = default_compression_level
+	);
+
+	// Writes the next row. p_row must have as many entries as the
+	// image is wide, and must not contain indices beyond the palette.
+	bool write_row(nonstd::span < std::uint8_t const > p_row);
+
+	// Finishes the image and closes the file. Fails if not all
+	// rows were written.
+	bool close();
+
+	bool is_open() const
+	{
+		return m_file != nullptr;
+	}
+
+	// Abstract base of the format specific encoders.
+	class encoder;
+
+
+private:
+	std::FILE *m_file;
+	std::unique_ptr < encoder > m_encoder;
+	std::size_t m_width, m_height;
+	std::size_t m_num_rows_written;
+	bool m_failed;
+};
+
+
+} // namespace graphics end
+
+
+#endif // GRAPHICS_INDEXED_IMAGE_WRITER_HPP_______
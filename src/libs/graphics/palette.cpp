@@ -1,4 +1,6 @@
+#include <algorithm>
 #include <limits>
+#include <assert.h>
 #include "palette.hpp"
 
 
@@ -6,6 +8,123 @@ namespace graphics
 {
 
 
+namespace
+{
+
+
+// calculate_color_distance() weighs the red and blue differences with
+// (512 + r_mean) / 256 and (767 - r_mean) / 256 respectively. Since
+// r_mean is in the 0..255 range, both weights lie in [2, 3), and the
+// green weight is always 4. This gives a lower and an upper bound that
+// are proper weighted squared euclidean distances:
+//
+//   2*dr^2 + 4*dg^2 + 2*db^2 <= distance <= 3*dr^2 + 4*dg^2 + 3*db^2
+//
+// The upper bound is at most 1.5 times the lower bound. (The >> 8 in
+// calculate_color_distance() only rounds down, so the lower bound still
+// holds.) The alpha term 4*da^2 is the same in the distance and in both
+// bounds.
+
+//
+// For the oklab metric, the distance is a plain squared euclidean
+// distance, so the lower and upper bounds are the distance itself.
+
+long const lower_bound_axis_weights[2][color::num_channels] = {
+	{ 2, 4, 2, 4 }, // rgb_low_cost
+	{ 1, 1, 1, 1 }  // oklab
+};
+
+// Factor f for the early accept test in find_nearest_color(). See there
+// for details. With a ratio r between the upper and the lower bound, f
+// must satisfy f >= (1 + sqrt(r))^2.
+long const early_accept_factors[2] = {
+	5, // rgb_low_cost: r = 1.5
+	4  // oklab: r = 1
+};
+
+
+std::size_t metric_index(color_metric const p_color_metric)
+{
+	return (p_color_metric == color_metric::oklab) ? 1 : 0;
+}
+
+
+// Computes calculate_color_distance(p_palette_entry, p_color, p_color_metric),
+// but gives up as soon as the partial sum shows that the entry cannot beat
+// the current best one. Returns false in that case.
+bool calculate_color_distance_if_better(color const &p_palette_entry, color const &p_color, color_metric const p_color_metric, std::size_t const p_palette_index, long const p_best_distance, std::size_t const p_best_palette_index, long &p_distance)
+{
+	auto is_worse = [&](long p_partial_distance) -> bool {
+		return (p_partial_distance > p_best_distance) || ((p_partial_distance == p_best_distance) && (p_palette_index > p_best_palette_index));
+	};
+
+	long r1 = p_palette_entry[0];
+	long r2 = p_color[0];
+	long diff_r = r1 - r2;
+	long diff_g = long(p_palette_entry[1]) - p_color[1];
+	long diff_b = long(p_palette_entry[2]) - p_color[2];
+	long diff_a = long(p_palette_entry.alpha()) - p_color.alpha();
+	long distance;
+
+	if (p_color_metric == color_metric::oklab)
+	{
+		distance = diff_r*diff_r;
+		if (is_worse(distance))
+			return false;
+
+		distance += diff_g*diff_g;
+		if (is_worse(distance))
+			return false;
+
+		distance += diff_b*diff_b;
+		if (is_worse(distance))
+			return false;
+
+		distance += diff_a*diff_a;
+		if (is_worse(distance))
+			return false;
+	}
+	else
+	{
+		long r_mean = (r1 + r2) / 2;
+
+		// Green has the largest weight, so start with it.
+		distance = 4 * diff_g*diff_g;
+		if (is_worse(distance))
+			return false;
+
+		distance += ((512 + r_mean) * diff_r*diff_r) >> 8;
+		if (is_worse(distance))
+			return false;
+
+		distance += ((512 + 255 - r_mean) * diff_b*diff_b) >> 8;
+		if (is_worse(distance))
+			return false;
+
+		distance += 4 * diff_a*diff_a;
+		if (is_worse(distance))
+			return false;
+	}
+
+	p_distance = distance;
+	return true;
+}
+
+
+} // unnamed namespace end
+
+
+long calculate_lower_bound_color_distance(color const &p_first, color const &p_second, color_metric const p_color_metric)
+{
+	long const *weights = lower_bound_axis_weights[metric_index(p_color_metric)];
+	long diff_0 = p_first[0] - p_second[0];
+	long diff_1 = p_first[1] - p_second[1];
+	long diff_2 = p_first[2] - p_second[2];
+	long diff_3 = p_first[3] - p_second[3];
+	return weights[0] * diff_0*diff_0 + weights[1] * diff_1*diff_1 + weights[2] * diff_2*diff_2 + weights[3] * diff_3*diff_3;
+}
+
+
 palette::palette()
 {
 }
@@ -17,7 +136,7 @@ palette::palette(std::size_t const p_palette_size, color const &p_template)
 }
 
 
-std::size_t find_nearest_color(palette const &p_palette, color const &p_color)
+std::size_t find_nearest_color(palette const &p_palette, color const &p_color, color_metric const p_color_metric)
 {
 	long cur_min_distance = std::numeric_limits < long > ::max();
 	std::size_t cur_best_palette_index = 0;
@@ -25,7 +144,7 @@ std::size_t find_nearest_color(palette const &p_palette, color const &p_color)
 	for (std::size_t palette_index = 0; palette_index < p_palette.size(); ++palette_index)
 	{
 		color const & palette_entry = p_palette[palette_index];
-		long distance = calculate_color_distance(palette_entry, p_color);
+		long distance = calculate_color_distance(palette_entry, p_color, p_color_metric);
 
 		if ((palette_index == 0) || (distance < cur_min_distance))
 		{
@@ -38,4 +157,221 @@ std::size_t find_nearest_color(palette const &p_palette, color const &p_color)
 }
 
 
+palette_index_stats::palette_index_stats()
+	: m_num_lookups(0)
+	, m_num_early_accepts(0)
+	, m_num_visited_entries(0)
+{
+}
+
+
+palette_index::palette_index()
+	: m_color_metric(color_metric::rgb_low_cost)
+	, m_search_axis(0)
+{
+}
+
+
+palette_index::palette_index(palette const &p_palette, color_metric const p_color_metric)
+	: m_color_metric(p_color_metric)
+	, m_search_axis(0)
+{
+	build_palette_index(*this, p_palette, p_color_metric);
+}
+
+
+void build_palette_index(palette_index &p_palette_index, palette const &p_palette, color_metric const p_color_metric)
+{
+	std::size_t num_entries = p_palette.size();
+	long const *axis_weights = lower_bound_axis_weights[metric_index(p_color_metric)];
+
+	p_palette_index.m_colors = p_palette.m_colors;
+	p_palette_index.m_color_metric = p_color_metric;
+	p_palette_index.m_stats = palette_index_stats();
+
+
+	// Pick the axis along which the palette is spread out the most,
+	// taking the axis weights of the lower bound distance into account.
+	// Walking along this axis lets the axis distance alone rule out
+	// the largest number of entries.
+
+	long largest_weighted_range = -1;
+	for (unsigned int axis = 0; axis < color::num_channels; ++axis)
+	{
+		int min_value = std::numeric_limits < int > ::max();
+		int max_value = std::numeric_limits < int > ::min();
+		for (color const &entry : p_palette.m_colors)
+		{
+			min_value = std::min(min_value, entry[axis]);
+			max_value = std::max(max_value, entry[axis]);
+		}
+
+		long range = (num_entries > 0) ? (max_value - min_value) : 0;
+		long weighted_range = axis_weights[axis] * range * range;
+		if (weighted_range > largest_weighted_range)
+		{
+			largest_weighted_range = weighted_range;
+			p_palette_index.m_search_axis = axis;
+		}
+	}
+
+	unsigned int search_axis = p_palette_index.m_search_axis;
+
+	p_palette_index.m_sorted_palette_indices.resize(num_entries);
+	for (std::size_t i = 0; i < num_entries; ++i)
+		p_palette_index.m_sorted_palette_indices[i] = i;
+
+	// Ties are broken by palette index. This gives the same order as
+	// a stable sort, but without its temporary buffer allocation.
+	std::sort(
+		p_palette_index.m_sorted_palette_indices.begin(), p_palette_index.m_sorted_palette_indices.end(),
+		[&p_palette, search_axis](std::size_t p_first, std::size_t p_second) -> bool {
+			int first_value = p_palette[p_first][search_axis];
+			int second_value = p_palette[p_second][search_axis];
+			return (first_value < second_value) || ((first_value == second_value) && (p_first < p_second));
+		}
+	);
+
+	p_palette_index.m_sorted_colors.resize(num_entries);
+	p_palette_index.m_sorted_axis_values.resize(num_entries);
+	for (std::size_t i = 0; i < num_entries; ++i)
+	{
+		p_palette_index.m_sorted_colors[i] = p_palette[p_palette_index.m_sorted_palette_indices[i]];
+		p_palette_index.m_sorted_axis_values[i] = p_palette_index.m_sorted_colors[i][search_axis];
+	}
+
+
+	// Distances to the nearest neighbours within the palette.
+
+	p_palette_index.m_nearest_neighbour_distances.assign(num_entries, std::numeric_limits < long > ::max());
+	for (std::size_t i = 0; i < num_entries; ++i)
+	{
+		for (std::size_t j = i + 1; j < num_entries; ++j)
+		{
+			long distance = calculate_lower_bound_color_distance(p_palette[i], p_palette[j], p_color_metric);
+			p_palette_index.m_nearest_neighbour_distances[i] = std::min(p_palette_index.m_nearest_neighbour_distances[i], distance);
+			p_palette_index.m_nearest_neighbour_distances[j] = std::min(p_palette_index.m_nearest_neighbour_distances[j], distance);
+		}
+	}
+}
+
+
+std::size_t find_nearest_color(palette_index const &p_palette_index, color const &p_color)
+{
+	assert(p_palette_index.size() > 0);
+
+	// Start at the entry whose projection is closest to that of the color.
+
+	unsigned int search_axis = p_palette_index.m_search_axis;
+	auto const &sorted_axis_values = p_palette_index.m_sorted_axis_values;
+
+	std::size_t sorted_pos = std::lower_bound(sorted_axis_values.begin(), sorted_axis_values.end(), p_color[search_axis]) - sorted_axis_values.begin();
+	if (sorted_pos == sorted_axis_values.size())
+		--sorted_pos;
+
+	return find_nearest_color(p_palette_index, p_color, p_palette_index.m_sorted_palette_indices[sorted_pos]);
+}
+
+
+std::size_t find_nearest_color(palette_index const &p_palette_index, color const &p_color, std::size_t const p_start_palette_index)
+{
+	assert(p_start_palette_index < p_palette_index.size());
+
+	auto const &colors = p_palette_index.m_colors;
+	color_metric const metric = p_palette_index.m_color_metric;
+
+	// Early accept: let s^2 be the (lower bound) distance from the start
+	// entry to its nearest neighbour, and t^2 the lower bound distance
+	// from the color to the start entry. For any other entry, the lower
+	// bound norm and the triangle inequality give a distance of at least
+	// (s - t)^2, while the distance to the start entry is at most 1.5*t^2.
+	// If 5*t^2 < s^2, then (s - t)^2 > 1.5*t^2, so the start entry is
+	// strictly the nearest one. (For the oklab metric, the bounds are
+	// exact, and 4*t^2 < s^2 suffices.)
+	palette_index_stats &stats = p_palette_index.m_stats;
+	++stats.m_num_lookups;
+
+	if ((early_accept_factors[metric_index(metric)] * calculate_lower_bound_color_distance(colors[p_start_palette_index], p_color, metric)) < p_palette_index.m_nearest_neighbour_distances[p_start_palette_index])
+	{
+		++stats.m_num_early_accepts;
+		return p_start_palette_index;
+	}
+
+	std::size_t best_palette_index = p_start_palette_index;
+	long best_distance = calculate_color_distance(colors[p_start_palette_index], p_color, metric);
+	++stats.m_num_visited_entries;
+
+
+	// Walk outwards from the color's projection on the search axis, in
+	// both directions. The walk ends once the lower bound distance along
+	// the axis exceeds the best distance on both sides. (Equal values
+	// cannot be ruled out, since a lower palette index wins ties.)
+
+	unsigned int search_axis = p_palette_index.m_search_axis;
+	long axis_weight = lower_bound_axis_weights[metric_index(metric)][search_axis];
+	int color_axis_value = p_color[search_axis];
+	auto const &sorted_axis_values = p_palette_index.m_sorted_axis_values;
+	auto const &sorted_palette_indices = p_palette_index.m_sorted_palette_indices;
+
+	std::size_t num_entries = sorted_axis_values.size();
+	std::size_t upper_pos = std::lower_bound(sorted_axis_values.begin(), sorted_axis_values.end(), color_axis_value) - sorted_axis_values.begin();
+	std::size_t lower_pos = upper_pos;
+
+	auto axis_lower_bound = [&](std::size_t p_sorted_pos) -> long {
+		long axis_diff = sorted_axis_values[p_sorted_pos] - color_axis_value;
+		return axis_weight * axis_diff * axis_diff;
+	};
+
+	while (true)
+	{
+		// Always continue on the side whose next entry is closer along the axis.
+		long upper_bound_distance = (upper_pos < num_entries) ? axis_lower_bound(upper_pos) : std::numeric_limits < long > ::max();
+		long lower_bound_distance = (lower_pos > 0) ? axis_lower_bound(lower_pos - 1) : std::numeric_limits < long > ::max();
+
+		std::size_t sorted_pos;
+		if (upper_bound_distance <= lower_bound_distance)
+		{
+			if (upper_bound_distance > best_distance)
+				break;
+			sorted_pos = upper_pos++;
+		}
+		else
+		{
+			if (lower_bound_distance > best_distance)
+				break;
+			sorted_pos = --lower_pos;
+		}
+
+		std::size_t palette_index = sorted_palette_indices[sorted_pos];
+		long distance;
+		++stats.m_num_visited_entries;
+		if (calculate_color_distance_if_better(p_palette_index.m_sorted_colors[sorted_pos], p_color, metric, palette_index, best_distance, best_palette_index, distance))
+		{
+			best_distance = distance;
+			best_palette_index = palette_index;
+		}
+	}
+
+	return best_palette_index;
+}
+
+
+void find_nearest_colors(palette_index const &p_palette_index, nonstd::span < color const > p_colors, nonstd::span < std::size_t > p_nearest_palette_indices)
+{
+	assert(p_colors.size() == p_nearest_palette_indices.size());
+
+	if (p_colors.empty())
+		return;
+
+	std::size_t nearest_palette_index = find_nearest_color(p_palette_index, p_colors[0]);
+	p_nearest_palette_indices[0] = nearest_palette_index;
+
+	for (std::size_t i = 1; i < std::size_t(p_colors.size()); ++i)
+	{
+		nearest_palette_index = find_nearest_color(p_palette_index, p_colors[i], nearest_palette_index);
+		p_nearest_palette_indices[i] = nearest_palette_index;
+	}
 }
+
+
+} // namespace graphics end
@@ -3,7 +3,9 @@
 
 #include <cstddef>
 #include <vector>
+#include "base/custom_span.hpp"
 #include "color.hpp"
+#include "color_metric.hpp"
 
 
 namespace graphics
@@ -57,7 +59,116 @@ inline palette::colors::iterator end(palette &p_palette)
 	return p_palette.m_colors.end();
 }
 
-std::size_t find_nearest_color(palette const &p_palette, color const &p_color);
+std::size_t find_nearest_color(palette const &p_palette, color const &p_color, color_metric const p_color_metric = color_metric::rgb_low_cost);
+
+/**
+ * Lower bound of calculate_color_distance() that is a true squared norm.
+ *
+ * The rgb_low_cost distance is not a norm, so it does not satisfy the
+ * triangle inequality that pruned searches rely on. It is, however,
+ * never below this bound and never above 1.5 times this bound (see
+ * palette.cpp for details). For the oklab metric, this is the distance
+ * itself.
+ */
+long calculate_lower_bound_color_distance(color const &p_first, color const &p_second, color_metric const p_color_metric);
+
+
+// Counts of the work done by the lookups in a palette_index.
+struct palette_index_stats
+{
+	unsigned long m_num_lookups;
+	// Lookups that accepted their starting entry without a search.
+	unsigned long m_num_early_accepts;
+	// Palette entries that were visited by the searches, that is,
+	// whose distance to the looked up color was evaluated (at least
+	// partially).
+	unsigned long m_num_visited_entries;
+
+	palette_index_stats();
+};
+
+
+/**
+ * Search structure for exact nearest color lookups in a palette.
+ *
+ * This is built once per palette with build_palette_index(), and then
+ * replaces the linear scan of find_nearest_color(palette, color) with
+ * an outward walk along the palette entries sorted by one color axis.
+ * The walk stops as soon as the distance along that axis alone exceeds
+ * the best distance found so far. Candidates are evaluated with partial
+ * distances, which are abandoned once they exceed the best distance.
+ * If the starting candidate is well inside its own Voronoi cell (which
+ * is known from the distance to its nearest neighbour in the palette),
+ * no walk is done at all.
+ *
+ * The results are the same as those of the linear scan, including the
+ * tie-breaking (the lowest palette index wins). Both the palette and
+ * the colors that are looked up must be in the color space of the
+ * metric the index was built for.
+ */
+struct palette_index
+{
+	palette::colors m_colors;
+	color_metric m_color_metric;
+
+	// Axis the entries are sorted by, the sorted entries, their
+	// projections on the axis, and their original palette indices.
+	unsigned int m_search_axis;
+	palette::colors m_sorted_colors;
+	std::vector < int > m_sorted_axis_values;
+	std::vector < std::size_t > m_sorted_palette_indices;
+
+	// Distance from each entry to its nearest neighbour in the palette,
+	// using a lower bound of calculate_color_distance() that is a true
+	// squared norm (see palette.cpp for details).
+	std::vector < long > m_nearest_neighbour_distances;
+
+	// Updated by the lookups, and reset by build_palette_index(). Since
+	// lookups write to this, a palette index must not be used by more
+	// than one thread at the same time.
+	mutable palette_index_stats m_stats;
+
+	palette_index();
+	explicit palette_index(palette const &p_palette, color_metric const p_color_metric = color_metric::rgb_low_cost);
+
+	std::size_t size() const
+	{
+		return m_colors.size();
+	}
+};
+
+// Rebuilding an existing index reuses its memory, so keeping one index
+// around for many palettes avoids heap allocations.
+void build_palette_index(palette_index &p_palette_index, palette const &p_palette, color_metric const p_color_metric = color_metric::rgb_low_cost);
+
+std::size_t find_nearest_color(palette_index const &p_palette_index, color const &p_color);
+
+/**
+ * Find the nearest palette entry, starting at a given entry.
+ *
+ * This is useful when a nearby color was looked up earlier, for example
+ * the previous pixel in a row, or the previous entry in a sorted
+ * histogram. A good starting entry can be accepted without any search.
+ *
+ * @param p_palette_index Palette index to search in.
+ * @param p_color Color to find the nearest palette entry for.
+ * @param p_start_palette_index Palette index of the entry to start at.
+ * @return Index of the nearest palette entry.
+ */
+std::size_t find_nearest_color(palette_index const &p_palette_index, color const &p_color, std::size_t const p_start_palette_index);
+
+/**
+ * Find the nearest palette entries for a batch of colors.
+ *
+ * Each lookup starts at the result of the previous one, so this works
+ * best with coherent batches, like the pixels of a row.
+ *
+ * @param p_palette_index Palette index to search in.
+ * @param p_colors Colors to find the nearest palette entries for.
+ * @param p_nearest_palette_indices Output span for the indices of the
+ *        nearest palette entries. Must have the same size as p_colors.
+ */
+void find_nearest_colors(palette_index const &p_palette_index, nonstd::span < color const > p_colors, nonstd::span < std::size_t > p_nearest_palette_indices);
 
 	
 } // namespace graphics end
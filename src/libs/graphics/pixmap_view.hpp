@@ -1,6 +1,7 @@
 #ifndef GRAPHICS_PIXMAP_VIEW_HPP_______
 #define GRAPHICS_PIXMAP_VIEW_HPP_______
 
+#include <assert.h>
 #include <cstddef>
 #include <type_traits>
 #include "base/custom_span.hpp"
@@ -13,6 +14,15 @@ namespace graphics
 // TODO: Limit PixelData to uint8_t* and uint8_t const *
 
 
+// Order of the color channels within a pixel. An alpha channel, if
+// present, always comes after the color channels.
+enum class channel_order
+{
+	bgr,
+	rgb
+};
+
+
 template < typename PixelData, typename Enable = void >
 struct pixmap_view;
 
@@ -21,17 +31,19 @@ struct pixmap_view < PixelData, typename std::enable_if < std::is_const < PixelD
 {
 	nonstd::span < PixelData > m_data;
 	std::size_t m_width, m_height, m_hstride, m_num_channels;
+	channel_order m_channel_order = channel_order::bgr;
 
 	pixmap_view()
 	{
 	}
 
-	pixmap_view(nonstd::span < PixelData > p_data, std::size_t p_width, std::size_t p_height, std::size_t p_hstride, std::size_t p_num_channels)
+	pixmap_view(nonstd::span < PixelData > p_data, std::size_t p_width, std::size_t p_height, std::size_t p_hstride, std::size_t p_num_channels, channel_order p_channel_order = channel_order::bgr)
 		: m_data(std::move(p_data))
 		, m_width(p_width)
 		, m_height(p_height)
 		, m_hstride(p_hstride)
 		, m_num_channels(p_num_channels)
+		, m_channel_order(p_channel_order)
 	{
 	}
 
@@ -42,6 +54,7 @@ struct pixmap_view < PixelData, typename std::enable_if < std::is_const < PixelD
 		m_height = p_other.m_height;
 		m_hstride = p_other.m_hstride;
 		m_num_channels = p_other.m_num_channels;
+		m_channel_order = p_other.m_channel_order;
 	}
 
 	pixmap_view& operator = (pixmap_view < typename std::remove_const < PixelData > ::type > p_other)
@@ -51,6 +64,7 @@ struct pixmap_view < PixelData, typename std::enable_if < std::is_const < PixelD
 		m_height = p_other.m_height;
 		m_hstride = p_other.m_hstride;
 		m_num_channels = p_other.m_num_channels;
+		m_channel_order = p_other.m_channel_order;
 
 		return *this;
 	}
@@ -61,6 +75,7 @@ struct pixmap_view < PixelData, typename std::enable_if < ! std::is_const < Pixe
 {
 	nonstd::span < PixelData > m_data;
 	std::size_t m_width, m_height, m_hstride, m_num_channels;
+	channel_order m_channel_order = channel_order::bgr;
 };
 
 typedef pixmap_view < std::uint8_t const > const_pixmap_view_t;
@@ -103,17 +118,66 @@ inline PixelData* at(pixmap_view < PixelData > const &p_pixmap_view, std::size_t
 
 
 template < typename PixelData >
-inline pixmap_view < PixelData > make_pixmap_view(PixelData *p_data, std::size_t p_data_size, std::size_t p_width, std::size_t p_height, std::size_t p_hstride, std::size_t p_num_channels)
+inline pixmap_view < PixelData > make_pixmap_view(PixelData *p_data, std::size_t p_data_size, std::size_t p_width, std::size_t p_height, std::size_t p_hstride, std::size_t p_num_channels, channel_order p_channel_order = channel_order::bgr)
 {
 	return pixmap_view < PixelData > {
 		nonstd::make_span(p_data, p_data_size),
 		p_width, p_height,
 		p_hstride,
-		p_num_channels
+		p_num_channels,
+		p_channel_order
 	};
 }
 
 
+/**
+ * Calls a function with the pixel layout of a pixmap as compile time constants.
+ *
+ * Per-pixel kernels that are templated on the number of channels and
+ * the channel order can step through rows with a constant pixel size
+ * and fixed channel offsets, instead of reading the layout from the
+ * pixmap view for every pixel. This picks the matching instantiation
+ * once per pixmap.
+ *
+ * p_function is called with a std::integral_constant of the number of
+ * channels (3 or 4) and one of the channel order, like this:
+ *
+ *   dispatch_pixel_layout(view, [&](auto p_num_channels, auto p_channel_order) {
+ *       kernel < decltype(p_num_channels)::value, decltype(p_channel_order)::value > (view);
+ *   });
+ *
+ * @param p_pixmap_view Pixmap with 3 or 4 channels.
+ * @param p_function Function to call.
+ * @return The return value of p_function.
+ */
+template < typename PixelData, typename Function >
+inline decltype(auto) dispatch_pixel_layout(pixmap_view < PixelData > const &p_pixmap_view, Function &&p_function)
+{
+	typedef std::integral_constant < std::size_t, 3 > three_channels;
+	typedef std::integral_constant < std::size_t, 4 > four_channels;
+	typedef std::integral_constant < channel_order, channel_order::bgr > bgr_order;
+	typedef std::integral_constant < channel_order, channel_order::rgb > rgb_order;
+
+	assert((p_pixmap_view.m_num_channels == 3) || (p_pixmap_view.m_num_channels == 4));
+	bool is_bgr = (p_pixmap_view.m_channel_order == channel_order::bgr);
+
+	if (p_pixmap_view.m_num_channels == 4)
+	{
+		if (is_bgr)
+			return p_function(four_channels(), bgr_order());
+		else
+			return p_function(four_channels(), rgb_order());
+	}
+	else
+	{
+		if (is_bgr)
+			return p_function(three_channels(), bgr_order());
+		else
+			return p_function(three_channels(), rgb_order());
+	}
+}
+
+
 } // namespace graphics end
 
 
@@ -0,0 +1,214 @@
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <random>
+#include <vector>
+#include "fmt/format.h"
+#include "base/custom_span.hpp"
+#include "base/kd_tree.hpp"
+
+
+// Checks the kd-tree queries against a brute force search over
+// random points. Ties make the indices ambiguous, so the distances
+// of the found nodes are compared instead.
+
+
+namespace
+{
+
+
+typedef std::array < int, 3 > point;
+
+
+long calc_distance(point const &p_first, point const &p_second)
+{
+	long distance = 0;
+	for (std::size_t i = 0; i < p_first.size(); ++i)
+	{
+		long delta = p_first[i] - p_second[i];
+		distance += delta * delta;
+	}
+	return distance;
+}
+
+
+// Signed, and squared like calc_distance(), so that its magnitude
+// can be compared with the node distances.
+long calc_plane_distance(point const &p_value, point const &p_search_value, unsigned int p_level)
+{
+	long delta = p_search_value[p_level % 3] - p_value[p_level % 3];
+	return (delta >= 0) ? (delta * delta) : -(delta * delta);
+}
+
+
+bool compare_points(point const &p_first, point const &p_second, unsigned int p_level)
+{
+	return p_first[p_level % 3] < p_second[p_level % 3];
+}
+
+
+std::vector < long > calc_sorted_distances(std::vector < point > const &p_points, point const &p_search_value)
+{
+	std::vector < long > distances;
+	for (auto const &value : p_points)
+		distances.push_back(calc_distance(value, p_search_value));
+	std::sort(distances.begin(), distances.end());
+	return distances;
+}
+
+
+std::vector < point > generate_points(std::mt19937 &p_random_engine, std::size_t const p_num_points, int const p_max_component_value)
+{
+	std::uniform_int_distribution < int > distribution(0, p_max_component_value);
+	std::vector < point > points(p_num_points);
+	for (auto &value : points)
+	{
+		for (auto &component : value)
+			component = distribution(p_random_engine);
+	}
+	return points;
+}
+
+
+bool check_tree(std::mt19937 &p_random_engine, std::size_t const p_num_points, int const p_max_component_value)
+{
+	std::size_t const num_search_values = 500;
+	std::size_t const max_k = 5;
+
+	std::vector < point > points = generate_points(p_random_engine, p_num_points, p_max_component_value);
+	std::vector < point > search_values = generate_points(p_random_engine, num_search_values, p_max_component_value);
+
+	base::kd_tree < point > tree;
+	std::vector < point > fill_values = points;
+	base::fill(tree, fill_values.begin(), fill_values.end(), compare_points);
+
+	auto node_distance = [&](std::size_t p_node_index, point const &p_search_value) -> long {
+		return calc_distance(tree.m_nodes[p_node_index].m_value, p_search_value);
+	};
+
+	std::vector < std::size_t > batch_indices(num_search_values);
+	std::vector < std::size_t > sorted_batch_indices(num_search_values);
+	std::vector < std::size_t > permutation(num_search_values);
+
+	base::find_nearest_batch(
+		tree,
+		nonstd::span < point const > (search_values),
+		nonstd::span < std::size_t > (batch_indices),
+		calc_distance,
+		calc_plane_distance
+	);
+	base::find_nearest_batch(
+		tree,
+		nonstd::span < point const > (search_values),
+		nonstd::span < std::size_t > (sorted_batch_indices),
+		nonstd::span < std::size_t > (permutation),
+		calc_distance,
+		calc_plane_distance,
+		[](point const &p_value) -> int { return p_value[0]; }
+	);
+
+	std::vector < std::size_t > k_batch_indices(num_search_values * max_k);
+	std::vector < long > k_batch_distances(num_search_values * max_k);
+
+	base::find_k_nearest_batch(
+		tree,
+		nonstd::span < point const > (search_values),
+		max_k,
+		nonstd::span < std::size_t > (k_batch_indices),
+		nonstd::span < long > (k_batch_distances),
+		calc_distance,
+		calc_plane_distance
+	);
+
+	for (std::size_t i = 0; i < num_search_values; ++i)
+	{
+		point const &search_value = search_values[i];
+		std::vector < long > reference_distances = calc_sorted_distances(points, search_value);
+
+		auto nearest_iter = base::find_nearest(tree, search_value, calc_distance, calc_plane_distance);
+		if (calc_distance(nearest_iter->m_value, search_value) != reference_distances[0])
+		{
+			fmt::print(stderr, "find_nearest(): wrong distance for search value #{} with {} points\n", i, p_num_points);
+			return false;
+		}
+
+		if (node_distance(batch_indices[i], search_value) != reference_distances[0])
+		{
+			fmt::print(stderr, "find_nearest_batch(): wrong distance for search value #{} with {} points\n", i, p_num_points);
+			return false;
+		}
+
+		if (node_distance(sorted_batch_indices[i], search_value) != reference_distances[0])
+		{
+			fmt::print(stderr, "find_nearest_batch() with sort key: wrong distance for search value #{} with {} points\n", i, p_num_points);
+			return false;
+		}
+
+		for (std::size_t k = 1; k <= max_k; ++k)
+		{
+			std::vector < std::size_t > k_indices(k);
+			std::vector < long > k_distances(k);
+			std::size_t num_found = base::find_k_nearest(
+				tree,
+				search_value,
+				nonstd::span < std::size_t > (k_indices),
+				nonstd::span < long > (k_distances),
+				calc_distance,
+				calc_plane_distance
+			);
+
+			std::size_t expected_num_found = std::min(k, p_num_points);
+			if (num_found != expected_num_found)
+			{
+				fmt::print(stderr, "find_k_nearest(): found {} instead of {} nodes for search value #{} with {} points\n", num_found, expected_num_found, i, p_num_points);
+				return false;
+			}
+
+			for (std::size_t j = 0; j < k; ++j)
+			{
+				bool is_correct = (j < num_found)
+					? ((k_distances[j] == reference_distances[j]) && (node_distance(k_indices[j], search_value) == reference_distances[j]))
+					: (k_indices[j] == tree.m_nodes.size());
+				if (!is_correct)
+				{
+					fmt::print(stderr, "find_k_nearest(): wrong entry #{} of {} for search value #{} with {} points\n", j, k, i, p_num_points);
+					return false;
+				}
+			}
+		}
+
+		for (std::size_t j = 0; j < std::min(max_k, p_num_points); ++j)
+		{
+			if (k_batch_distances[i * max_k + j] != reference_distances[j])
+			{
+				fmt::print(stderr, "find_k_nearest_batch(): wrong entry #{} for search value #{} with {} points\n", j, i, p_num_points);
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+
+} // unnamed namespace end
+
+
+int main()
+{
+	std::mt19937 random_engine(1);
+
+	// A small component range gives many ties and duplicate points.
+	for (int max_component_value : { 7, 255 })
+	{
+		for (std::size_t num_points : { 1, 2, 3, 10, 100, 1000 })
+		{
+			if (!check_tree(random_engine, num_points, max_component_value))
+				return -1;
+		}
+	}
+
+	fmt::print("All kd-tree queries match the brute force search\n");
+
+	return 0;
+}
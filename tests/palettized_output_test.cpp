@@ -0,0 +1,134 @@
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "fmt/format.h"
+#include "context.hpp"
+#include "palettized_output.hpp"
+
+
+// Checks that transparent pixels are counted as transparent and get
+// the transparent palette entry, also when they form runs along a row,
+// with and without dithering.
+
+
+namespace
+{
+
+
+std::size_t const image_width = 8;
+std::size_t const image_height = 4;
+int const alpha_threshold = 128;
+
+
+void set_pixel(std::vector < std::uint8_t > &p_pixels, std::size_t p_x, std::size_t p_y, int p_red, int p_green, int p_blue, int p_alpha)
+{
+	std::uint8_t *pixel_data = &p_pixels[(p_x + p_y * image_width) * 4];
+	pixel_data[0] = p_red;
+	pixel_data[1] = p_green;
+	pixel_data[2] = p_blue;
+	pixel_data[3] = p_alpha;
+}
+
+
+std::vector < std::uint8_t > make_input_pixels()
+{
+	std::vector < std::uint8_t > pixels(image_width * image_height * 4);
+
+	for (std::size_t x = 0; x < image_width; ++x)
+	{
+		// An opaque run, a transparent row (which is a single run),
+		// a transparent row with varying colors, and a row that is
+		// half opaque and half transparent.
+		set_pixel(pixels, x, 0, 255, 0, 0, 255);
+		set_pixel(pixels, x, 1, 0, 0, 0, 0);
+		set_pixel(pixels, x, 2, int(x * 30), 10, 20, int(x * 10));
+		if (x < (image_width / 2))
+			set_pixel(pixels, x, 3, 0, 255, 0, 255);
+		else
+			set_pixel(pixels, x, 3, 40, 50, 60, 0);
+	}
+
+	return pixels;
+}
+
+
+bool is_transparent(std::vector < std::uint8_t > const &p_pixels, std::size_t p_x, std::size_t p_y)
+{
+	return p_pixels[(p_x + p_y * image_width) * 4 + 3] < alpha_threshold;
+}
+
+
+bool check_output(bool const p_use_dithering)
+{
+	std::vector < std::uint8_t > input_pixels = make_input_pixels();
+	std::vector < std::uint8_t > const original_input_pixels = input_pixels;
+	std::vector < std::uint8_t > output_pixels(image_width * image_height);
+
+	context ctx;
+	ctx.m_input_image = graphics::nonconst_pixmap_view_t { nonstd::span < std::uint8_t > (input_pixels), image_width, image_height, image_width * 4, 4, graphics::channel_order::rgb };
+	ctx.m_output_image = graphics::nonconst_pixmap_view_t { nonstd::span < std::uint8_t > (output_pixels), image_width, image_height, image_width, 1 };
+	ctx.m_use_dithering = p_use_dithering;
+	ctx.m_alpha_threshold = alpha_threshold;
+	ctx.m_show_progress = false;
+	ctx.m_palette.m_colors = {
+		graphics::color(255, 0, 0),
+		graphics::color(0, 255, 0),
+		graphics::color(0, 0, 255)
+	};
+
+	palettized_output_buffers buffers;
+	palettized_output_stats stats = produce_palettized_output(ctx, buffers, base::progress_report());
+
+	unsigned long expected_num_transparent = 0;
+	for (std::size_t y = 0; y < image_height; ++y)
+	{
+		for (std::size_t x = 0; x < image_width; ++x)
+		{
+			if (!is_transparent(original_input_pixels, x, y))
+				continue;
+
+			++expected_num_transparent;
+			if (output_pixels[x + y * image_width] != get_transparent_palette_index(ctx))
+			{
+				fmt::print(stderr, "Transparent pixel {},{} did not get the transparent palette entry (dithering: {})\n", x, y, p_use_dithering);
+				return false;
+			}
+		}
+	}
+
+	if (stats.m_num_transparent != expected_num_transparent)
+	{
+		fmt::print(stderr, "Counted {} transparent pixels instead of {} (dithering: {})\n", stats.m_num_transparent, expected_num_transparent, p_use_dithering);
+		return false;
+	}
+
+	unsigned long num_resolved_pixels = stats.m_num_transparent + stats.m_num_run_hits + stats.m_num_cache_hits + stats.m_num_searches + stats.m_num_exact_lookups + stats.m_num_assigned_lookups;
+	if (num_resolved_pixels != stats.m_num_pixels)
+	{
+		fmt::print(stderr, "Resolved {} pixels instead of {} (dithering: {})\n", num_resolved_pixels, stats.m_num_pixels, p_use_dithering);
+		return false;
+	}
+
+	// The opaque pixels are all palette colors.
+	if (stats.m_has_squared_error && (stats.m_squared_error != 0))
+	{
+		fmt::print(stderr, "Squared error is {} instead of 0\n", stats.m_squared_error);
+		return false;
+	}
+
+	return true;
+}
+
+
+} // unnamed namespace end
+
+
+int main()
+{
+	if (!check_output(false) || !check_output(true))
+		return -1;
+
+	fmt::print("Transparent pixels are resolved and counted correctly\n");
+
+	return 0;
+}
@@ -0,0 +1,117 @@
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "fmt/format.h"
+#include "base/progress_report.hpp"
+
+
+// Measures the cost of base::progress_report in a loop over the pixels
+// of a 4096x4096 image, as in the histogram and output loops. The loop
+// body is a light per-pixel operation, so that the overhead of the
+// report is not hidden behind expensive work. Each variant is run
+// several times, and the fastest run counts.
+
+
+namespace
+{
+
+
+std::size_t const image_width = 4096;
+std::size_t const image_height = 4096;
+int const num_runs = 101;
+
+
+enum class report_mode
+{
+	none,
+	disabled_per_row,
+	enabled_per_row,
+	enabled_per_pixel
+};
+
+
+// Each variant gets its own instance of the loop, like the pixel
+// kernels that are specialized for each pixel layout.
+template < report_mode Mode >
+std::uint64_t scan_pixels(std::vector < std::uint8_t > const &p_pixels)
+{
+	// An interval this long keeps the enabled reports from printing,
+	// except for the final 100%, so that only the checks are measured.
+	base::progress_report progress_report;
+	if ((Mode == report_mode::enabled_per_row) || (Mode == report_mode::enabled_per_pixel))
+		progress_report = base::progress_report("Scanning", nullptr, std::chrono::hours{1});
+
+	unsigned long const total_num_pixels = image_width * image_height;
+	std::uint64_t sum = 0;
+
+	for (std::size_t y = 0; y < image_height; ++y)
+	{
+		std::uint8_t const *row_data = &p_pixels[y * image_width];
+		for (std::size_t x = 0; x < image_width; ++x)
+		{
+			sum += row_data[x] * (x | 1);
+			if (Mode == report_mode::enabled_per_pixel)
+				progress_report(y * image_width + x + 1, total_num_pixels);
+		}
+
+		if ((Mode == report_mode::disabled_per_row) || (Mode == report_mode::enabled_per_row))
+			progress_report((y + 1) * image_width, total_num_pixels);
+	}
+
+	return sum;
+}
+
+
+// The variants take turns in each round, so that changes in the load
+// of the machine affect all of them alike.
+typedef std::uint64_t (*scan_function)(std::vector < std::uint8_t > const &p_pixels);
+
+void measure(std::vector < std::uint8_t > const &p_pixels, std::vector < scan_function > const &p_scan_functions, std::vector < double > &p_min_times, std::uint64_t &p_checksum)
+{
+	p_min_times.assign(p_scan_functions.size(), 0.0);
+
+	for (int run = 0; run < num_runs; ++run)
+	{
+		for (std::size_t i = 0; i < p_scan_functions.size(); ++i)
+		{
+			auto start_time_point = std::chrono::steady_clock::now();
+			p_checksum += p_scan_functions[i](p_pixels);
+			std::chrono::duration < double > time = std::chrono::steady_clock::now() - start_time_point;
+
+			p_min_times[i] = (run == 0) ? time.count() : std::min(p_min_times[i], time.count());
+		}
+	}
+}
+
+
+} // unnamed namespace end
+
+
+int main()
+{
+	std::vector < std::uint8_t > pixels(image_width * image_height);
+	for (std::size_t i = 0; i < pixels.size(); ++i)
+		pixels[i] = std::uint8_t(i * 2654435761u >> 24);
+
+	// The checksum keeps the compiler from dropping the loops.
+	std::uint64_t checksum = 0;
+
+	std::vector < scan_function > const scan_functions = {
+		scan_pixels < report_mode::none >,
+		scan_pixels < report_mode::disabled_per_row >,
+		scan_pixels < report_mode::enabled_per_row >,
+		scan_pixels < report_mode::enabled_per_pixel >
+	};
+	char const * const mode_names[] = { "no progress report", "disabled, per row", "enabled, per row", "enabled, per pixel" };
+	std::vector < double > min_times;
+	measure(pixels, scan_functions, min_times, checksum);
+	fmt::print(stderr, "\n");
+
+	fmt::print("{}x{} pixels, fastest of {} runs (checksum {})\n", image_width, image_height, num_runs, checksum);
+	for (std::size_t i = 0; i < scan_functions.size(); ++i)
+		fmt::print("{:<20} {:8.2f} ms  ({:+.1f}%)\n", mode_names[i], min_times[i] * 1000.0, (min_times[i] / min_times[0] - 1.0) * 100.0);
+
+	return 0;
+}
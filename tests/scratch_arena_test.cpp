@@ -0,0 +1,235 @@
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+#include "fmt/format.h"
+#include "context.hpp"
+#include "k_means_quantizer.hpp"
+#include "median_cut_quantizer.hpp"
+#include "octree_quantizer.hpp"
+
+
+// Checks that quantizing the same image again does not allocate from
+// the heap anymore, neither through the quantizer's scratch arena nor
+// anywhere else. The image has enough colors for the buffers of the
+// unique colors, the octree and the like to exceed the arena's largest
+// pool block, so this also checks that these stay alive in their
+// owners between images.
+
+
+namespace
+{
+
+
+std::atomic < unsigned long > num_global_allocations(0);
+
+
+} // unnamed namespace end
+
+
+// GCC mistakes the free() calls below for mismatched deallocations
+// once the replacement operators are inlined into their callers.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+
+void* operator new(std::size_t p_num_bytes)
+{
+	++num_global_allocations;
+	if (void *pointer = std::malloc((p_num_bytes > 0) ? p_num_bytes : 1))
+		return pointer;
+	throw std::bad_alloc();
+}
+
+
+void* operator new(std::size_t p_num_bytes, std::align_val_t p_alignment)
+{
+	++num_global_allocations;
+	std::size_t alignment = std::size_t(p_alignment);
+	std::size_t num_bytes = ((p_num_bytes + alignment - 1) / alignment) * alignment;
+	if (void *pointer = std::aligned_alloc(alignment, (num_bytes > 0) ? num_bytes : alignment))
+		return pointer;
+	throw std::bad_alloc();
+}
+
+
+void operator delete(void *p_pointer) noexcept
+{
+	std::free(p_pointer);
+}
+
+
+void operator delete(void *p_pointer, std::size_t) noexcept
+{
+	std::free(p_pointer);
+}
+
+
+void operator delete(void *p_pointer, std::align_val_t) noexcept
+{
+	std::free(p_pointer);
+}
+
+
+void operator delete(void *p_pointer, std::size_t, std::align_val_t) noexcept
+{
+	std::free(p_pointer);
+}
+
+
+namespace
+{
+
+
+std::size_t const image_width = 512;
+std::size_t const image_height = 512;
+
+
+// Smooth gradients with some noise, for a few hundred thousand colors.
+std::vector < std::uint8_t > make_input_pixels()
+{
+	std::vector < std::uint8_t > pixels(image_width * image_height * 3);
+	std::uint32_t random_state = 1;
+
+	for (std::size_t y = 0; y < image_height; ++y)
+	{
+		for (std::size_t x = 0; x < image_width; ++x)
+		{
+			random_state = random_state * 1664525u + 1013904223u;
+			std::uint8_t *pixel_data = &pixels[(x + y * image_width) * 3];
+			pixel_data[0] = std::uint8_t((x / 2) ^ (random_state >> 29));
+			pixel_data[1] = std::uint8_t((y / 2) ^ ((random_state >> 26) & 0x7));
+			pixel_data[2] = std::uint8_t(((x + y) / 4) ^ ((random_state >> 23) & 0x7));
+		}
+	}
+
+	return pixels;
+}
+
+
+bool check_quantizer(std::string const &p_name, quantizer &p_quantizer, bool const p_use_dithering)
+{
+	std::vector < std::uint8_t > const original_input_pixels = make_input_pixels();
+	std::vector < std::uint8_t > input_pixels = original_input_pixels;
+	std::vector < std::uint8_t > output_pixels(image_width * image_height);
+
+	// The context is reused as well, so that its palette and its
+	// instrumentation keep their memory too.
+	context ctx;
+	ctx.m_input_image = graphics::nonconst_pixmap_view_t { nonstd::span < std::uint8_t > (input_pixels), image_width, image_height, image_width * 3, 3, graphics::channel_order::rgb };
+	ctx.m_output_image = graphics::nonconst_pixmap_view_t { nonstd::span < std::uint8_t > (output_pixels), image_width, image_height, image_width, 1 };
+	ctx.m_use_dithering = p_use_dithering;
+	ctx.m_show_progress = false;
+
+	unsigned long num_arena_allocations[2];
+	unsigned long num_allocations[2];
+
+	for (int run = 0; run < 2; ++run)
+	{
+		// Dithering modifies the input image.
+		std::copy(original_input_pixels.begin(), original_input_pixels.end(), input_pixels.begin());
+
+		unsigned long num_allocations_before = num_global_allocations;
+		if (!p_quantizer.quantize(ctx))
+		{
+			fmt::print(stderr, "{}: quantizing failed\n", p_name);
+			return false;
+		}
+
+		num_allocations[run] = num_global_allocations - num_allocations_before;
+		num_arena_allocations[run] = p_quantizer.get_allocation_stats().m_num_heap_allocations;
+	}
+
+	fmt::print(
+		"{}{}: {} arena heap allocations, {} global allocations in the first run; {} and {} in the second run\n",
+		p_name, p_use_dithering ? " (dithering)" : "",
+		num_arena_allocations[0], num_allocations[0],
+		num_arena_allocations[1] - num_arena_allocations[0], num_allocations[1]
+	);
+
+	return (num_arena_allocations[1] == num_arena_allocations[0]) && (num_allocations[1] == 0);
+}
+
+
+} // unnamed namespace end
+
+
+int main()
+{
+	bool all_passed = true;
+
+	for (bool use_dithering : { false, true })
+	{
+		{
+			k_means_quantizer_options options;
+			k_means_quantizer color_quantizer(options);
+			all_passed = check_quantizer("k-means", color_quantizer, use_dithering) && all_passed;
+		}
+
+		{
+			k_means_quantizer_options options;
+			options.m_engine = k_means_engine::filtering;
+			options.m_num_coarse_bits = 4;
+			k_means_quantizer color_quantizer(options);
+			all_passed = check_quantizer("k-means, filtering, coarse-to-fine", color_quantizer, use_dithering) && all_passed;
+		}
+
+		{
+			median_cut_quantizer_options options;
+			median_cut_quantizer color_quantizer(options);
+			all_passed = check_quantizer("median cut", color_quantizer, use_dithering) && all_passed;
+		}
+
+		{
+			median_cut_quantizer_options options;
+			options.m_use_median_cut_for_nearest_color = true;
+			options.m_refine_median_cut_nearest_color = true;
+			median_cut_quantizer color_quantizer(options);
+			all_passed = check_quantizer("median cut, refined nearest color", color_quantizer, use_dithering) && all_passed;
+		}
+
+		{
+			median_cut_quantizer_options options;
+			options.m_num_refinement_iterations = 3;
+			median_cut_quantizer color_quantizer(options);
+			all_passed = check_quantizer("median cut, k-means refinement", color_quantizer, use_dithering) && all_passed;
+		}
+
+		// With a single build thread, since starting threads allocates.
+		{
+			octree_quantizer_options options;
+			options.m_num_build_threads = 1;
+			octree_quantizer color_quantizer(options);
+			all_passed = check_quantizer("octree", color_quantizer, use_dithering) && all_passed;
+		}
+
+		{
+			octree_quantizer_options options;
+			options.m_num_build_threads = 1;
+			options.m_use_octree_for_nearest_color = true;
+			octree_quantizer color_quantizer(options);
+			all_passed = check_quantizer("octree, octree nearest color", color_quantizer, use_dithering) && all_passed;
+		}
+
+		{
+			octree_quantizer_options options;
+			options.m_num_build_threads = 1;
+			options.m_num_refinement_iterations = 3;
+			octree_quantizer color_quantizer(options);
+			all_passed = check_quantizer("octree, k-means refinement", color_quantizer, use_dithering) && all_passed;
+		}
+	}
+
+	if (!all_passed)
+	{
+		fmt::print(stderr, "Quantizing an image again allocated from the heap\n");
+		return -1;
+	}
+
+	return 0;
+}